@@ -0,0 +1,527 @@
+/**
+ * @file broker.c
+ * @brief host-local connection broker.
+ * Client processes connect to it over a Unix socket instead of opening
+ * their own TCP connection. Each one is pinned to one of a few long-lived
+ * connections to its server, since remote fds belong to the server
+ * session that opened them, and its frames are relayed one request at a
+ * time. A client only gets to use the fds it opened itself, and what it
+ * leaves open when it goes away is closed for it.
+ */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <err.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "serde.h"
+
+#define MAXUPSTREAM 64
+#define CRC_RETRIES 3
+
+// one TCP connection to a server, closed with its last user
+typedef struct server_conn {
+    int sockfd;
+    int refs;                   // the upstream's, and one per client using it
+    bool broken;
+    u_int64_t sent;             // requests sent on it
+    u_int64_t replied;          // replies taken off it
+} server_conn;
+
+// a connection to a server, shared by the clients pinned to it. Requests
+// go out back to back without waiting for replies, the server answers
+// them in order and each client takes the reply of its turn
+typedef struct upstream {
+    u_int32_t addr;             // network order
+    u_int16_t port;
+    bool used;                  // slot taken by a server, kept once taken
+    int clients;                // clients pinned to it
+    server_conn *conn;          // NULL until connected, or after it broke
+    pthread_mutex_t send_lock;  // one request being sent at a time
+    pthread_mutex_t lock;       // conn and its counters
+    pthread_cond_t turn;        // a reply was taken, or the connection broke
+} upstream;
+
+upstream ups[MAXUPSTREAM];
+pthread_mutex_t ups_lock = PTHREAD_MUTEX_INITIALIZER;
+int pool_size;
+
+void *serve_client(void *arg);
+upstream *upstream_pin(u_int32_t addr, u_int16_t port);
+void upstream_unpin(upstream *up);
+char *exchange(upstream *up, const char *req, size_t req_len, size_t *resp_len);
+int upstream_connect(upstream *up);
+void upstream_break(upstream *up, server_conn *c);
+void conn_release(server_conn *c);
+void own_fds(char *req, size_t req_len, const int *open_fds, int nopen);
+char *recv_frame(int fd, size_t *len);
+int send_raw(int fd, const void *data, size_t size);
+int recv_raw(int fd, void *data, size_t size);
+bool frame_intact(const char *frame, size_t len);
+
+int main(int argc, char**argv) {
+    fprintf(stderr, "-----rpc broker-----\n");
+    char *path = getenv("broker15440");
+    if (path == NULL) {
+        fprintf(stderr, "broker15440 must name the socket to listen on\n");
+        exit(1);
+    }
+    char *conns = getenv("brokerconns15440");
+    pool_size = conns ? atoi(conns) : 4;
+    if (pool_size < 1) {
+        pool_size = 1;
+    }
+    int i;
+    for (i = 0; i < MAXUPSTREAM; i++) {
+        pthread_mutex_init(&ups[i].send_lock, NULL);
+        pthread_mutex_init(&ups[i].lock, NULL);
+        pthread_cond_init(&ups[i].turn, NULL);
+    }
+    // a client gone mid reply is noticed by send() failing
+    signal(SIGPIPE, SIG_IGN);
+
+    struct sockaddr_un sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(sa.sun_path)) {
+        fprintf(stderr, "broker socket path too long\n");
+        exit(1);
+    }
+    strcpy(sa.sun_path, path);
+    unlink(path);
+    int sockfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sockfd < 0) err(1, 0);
+    // only this user's processes may connect, they reach its remote fds
+    mode_t mask = umask(077);
+    if (bind(sockfd, (struct sockaddr *) &sa, sizeof(sa)) < 0) err(1, 0);
+    umask(mask);
+    if (listen(sockfd, 64) < 0) err(1, 0);
+    fprintf(stderr, "===== broker on %s, %d connections per server\n", path, pool_size);
+
+    while (1) {
+        int cfd = accept4(sockfd, NULL, NULL, SOCK_CLOEXEC);
+        if (cfd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            err(1, 0);
+        }
+        pthread_t t;
+        if (pthread_create(&t, NULL, serve_client, (void *) (intptr_t) cfd) != 0) {
+            close(cfd);
+            continue;
+        }
+        pthread_detach(t);
+    }
+    return 0;
+}
+
+// relay one client's frames until it hangs up
+void *serve_client(void *arg) {
+    int cfd = (int) (intptr_t) arg;
+    char hello[BROKER_HELLO_SIZE];
+    u_int32_t addr;
+    u_int16_t port;
+    if (recv_raw(cfd, hello, sizeof(hello)) < 0) {
+        close(cfd);
+        return NULL;
+    }
+    broker_hello_unmarshal(hello, &addr, &port);
+    upstream *up = upstream_pin(addr, port);
+    if (up == NULL) {
+        fprintf(stderr, "broker - no room for another server connection\n");
+        close(cfd);
+        return NULL;
+    }
+
+    // remote fds this client has open, closed for it if it goes away
+    int *open_fds = NULL;
+    int nopen = 0, cap = 0;
+    // its last reply, sent again if it arrived corrupt
+    char *last = NULL;
+    size_t last_len = 0;
+
+    while (1) {
+        size_t req_len;
+        char *req = recv_frame(cfd, &req_len);
+        if (req == NULL) {
+            break;
+        }
+        int word;
+        memcpy(&word, req, sizeof(int));
+        if (word & FRAME_NACK) {
+            free(req);
+            if (last != NULL && send_raw(cfd, last, last_len) < 0) {
+                break;
+            }
+            continue;
+        }
+        u_int32_t opcode = 0;
+        if (FRAME_SIZE(word) >= sizeof(u_int32_t)) {
+            mem_read_int32(req, sizeof(int), &opcode);
+        }
+        own_fds(req, req_len, open_fds, nopen);
+
+        size_t resp_len;
+        char *resp = exchange(up, req, req_len, &resp_len);
+        if (resp == NULL) {
+            // the server session and every fd in it are gone
+            free(req);
+            nopen = 0;
+            break;
+        }
+
+        // reply body is err_no, size, data; open replies with the fd,
+        // close takes it as its payload
+        int remote_fd = -1;
+        u_int32_t data_size = 0;
+        mem_read_int32(resp, sizeof(int) * 2, &data_size);
+        if (opcode == OP_OPEN && data_size >= sizeof(int)) {
+            mem_read_data(resp, sizeof(int) * 2 + sizeof(u_int32_t), &remote_fd, sizeof(int));
+            if (remote_fd >= 0) {
+                if (nopen == cap) {
+                    cap = cap ? cap * 2 : 16;
+                    open_fds = realloc(open_fds, sizeof(int) * cap);
+                }
+                open_fds[nopen++] = remote_fd;
+            }
+        } else if (opcode == OP_CLOSE && data_size >= sizeof(int)) {
+            int r;
+            mem_read_data(resp, sizeof(int) * 2 + sizeof(u_int32_t), &r, sizeof(int));
+            mem_read_data(req, sizeof(int) + sizeof(u_int32_t) * 2, &remote_fd, sizeof(int));
+            int i;
+            for (i = 0; r == 0 && i < nopen; i++) {
+                if (open_fds[i] == remote_fd) {
+                    open_fds[i] = open_fds[--nopen];
+                    break;
+                }
+            }
+        }
+        free(req);
+
+        free(last);
+        last = resp;
+        last_len = resp_len;
+        if (send_raw(cfd, resp, resp_len) < 0) {
+            break;
+        }
+    }
+
+    if (nopen > 0) {
+        fprintf(stderr, "broker - closing %d fds left open\n", nopen);
+    }
+    int i;
+    for (i = 0; i < nopen; i++) {
+        char msg[sizeof(int) + CALL_FRAME_SIZE(CLOSE)];
+        int size = (int) call_close_frame(msg + sizeof(int), open_fds[i]);
+        memcpy(msg, &size, sizeof(int));
+        size_t resp_len;
+        char *resp = exchange(up, msg, sizeof(int) + size, &resp_len);
+        if (resp == NULL) {
+            break;
+        }
+        free(resp);
+    }
+    upstream_unpin(up);
+    free(open_fds);
+    free(last);
+    close(cfd);
+    return NULL;
+}
+
+// pin a client to the least shared connection to its server, opening a
+// new one while the busy ones number fewer than pool_size. Connections
+// stay open without clients, the next short-lived tool reuses them.
+upstream *upstream_pin(u_int32_t addr, u_int16_t port) {
+    pthread_mutex_lock(&ups_lock);
+    upstream *best = NULL, *free_slot = NULL;
+    int count = 0;
+    int i;
+    for (i = 0; i < MAXUPSTREAM; i++) {
+        upstream *up = &ups[i];
+        if (!up->used) {
+            if (free_slot == NULL) {
+                free_slot = up;
+            }
+            continue;
+        }
+        if (up->addr != addr || up->port != port) {
+            continue;
+        }
+        ++count;
+        if (best == NULL || up->clients < best->clients) {
+            best = up;
+        }
+    }
+    if (free_slot != NULL && (best == NULL || (best->clients > 0 && count < pool_size))) {
+        best = free_slot;
+        best->used = true;
+        best->addr = addr;
+        best->port = port;
+    }
+    if (best != NULL) {
+        ++best->clients;
+    }
+    pthread_mutex_unlock(&ups_lock);
+    return best;
+}
+
+void upstream_unpin(upstream *up) {
+    pthread_mutex_lock(&ups_lock);
+    --up->clients;
+    pthread_mutex_unlock(&ups_lock);
+}
+
+// the fds a request names that this client did not open are replaced
+// by -1, so the server fails the call with EBADF in the reply it would
+// give for any bad fd; a request with a CRC gets a new one
+void own_fds(char *req, size_t req_len, const int *open_fds, int nopen) {
+    int word;
+    u_int32_t opcode;
+    memcpy(&word, req, sizeof(int));
+    size_t payload = sizeof(int) + 2 * sizeof(u_int32_t);
+    if (FRAME_SIZE(word) < 2 * sizeof(u_int32_t)) {
+        return;
+    }
+    mem_read_int32(req, sizeof(int), &opcode);
+    // every call on an fd has it first, a copy has its second one after
+    // the first one's offset
+    size_t at[2] = {payload, payload + sizeof(int) + sizeof(off_t)};
+    int nfds;
+    switch (opcode) {
+    case OP_OPEN:
+    case OP_STAT:
+    case OP_UNLINK:
+    case OP_GETTRR:
+    case OP_TREEV:
+    case OP_MREAD:
+        nfds = 0;
+        break;
+    case OP_COPY:
+        nfds = 2;
+        break;
+    default:
+        nfds = 1;
+    }
+    bool changed = false;
+    int k, i;
+    for (k = 0; k < nfds && at[k] + sizeof(int) <= sizeof(int) + FRAME_SIZE(word); k++) {
+        int fd;
+        memcpy(&fd, req + at[k], sizeof(int));
+        for (i = 0; i < nopen && open_fds[i] != fd; i++) {
+        }
+        if (i == nopen && fd != -1) {
+            fprintf(stderr, "broker - fd %d is not the client's\n", fd);
+            fd = -1;
+            memcpy(req + at[k], &fd, sizeof(int));
+            changed = true;
+        }
+    }
+    if (changed && (word & FRAME_CRC) && req_len == sizeof(int) + FRAME_SIZE(word) + sizeof(u_int32_t)) {
+        u_int32_t sum = crc32c(crc32c(0, &word, sizeof(int)), req + sizeof(int), FRAME_SIZE(word));
+        memcpy(req + req_len - sizeof(u_int32_t), &sum, sizeof(u_int32_t));
+    }
+}
+
+// send a request upstream and return its reply, both raw frames with the
+// size word; connects if needed and retries frames corrupted on the way.
+// Other clients' requests may go out while this one waits for its reply,
+// except behind one with a CRC: a corrupt reply is asked for again as the
+// server's last one, so nothing is sent until its exchange is over.
+// NULL if the connection broke
+char *exchange(upstream *up, const char *req, size_t req_len, size_t *resp_len) {
+    int word;
+    memcpy(&word, req, sizeof(int));
+    bool crc = (word & FRAME_CRC) != 0;
+    pthread_mutex_lock(&up->send_lock);
+    pthread_mutex_lock(&up->lock);
+    while (crc && up->conn != NULL && up->conn->replied < up->conn->sent) {
+        pthread_cond_wait(&up->turn, &up->lock);
+    }
+    if (up->conn == NULL && upstream_connect(up) < 0) {
+        pthread_mutex_unlock(&up->lock);
+        pthread_mutex_unlock(&up->send_lock);
+        return NULL;
+    }
+    server_conn *c = up->conn;
+    ++c->refs;
+    u_int64_t ticket = c->sent++;
+    pthread_mutex_unlock(&up->lock);
+
+    // replies are read without send_lock, so the server is never stuck
+    // on a full socket behind a request being sent
+    int r = send_raw(c->sockfd, req, req_len);
+    pthread_mutex_lock(&up->lock);
+    if (r < 0) {
+        upstream_break(up, c);
+    }
+    if (!crc) {
+        pthread_mutex_unlock(&up->send_lock);
+    }
+    while (!c->broken && c->replied != ticket) {
+        pthread_cond_wait(&up->turn, &up->lock);
+    }
+    char *resp = NULL;
+    if (!c->broken) {
+        pthread_mutex_unlock(&up->lock);
+        int tries = 0;
+        while ((resp = recv_frame(c->sockfd, resp_len)) != NULL) {
+            int rword;
+            memcpy(&rword, resp, sizeof(int));
+            if (++tries > CRC_RETRIES + 1) {
+                free(resp);
+                resp = NULL;
+                break;
+            }
+            if (rword & FRAME_NACK) {
+                // our request arrived corrupt
+                free(resp);
+                resp = NULL;
+                if (send_raw(c->sockfd, req, req_len) < 0) {
+                    break;
+                }
+                continue;
+            }
+            if (!frame_intact(resp, *resp_len)) {
+                free(resp);
+                resp = NULL;
+                int nack = FRAME_NACK;
+                if (send_raw(c->sockfd, &nack, sizeof(int)) < 0) {
+                    break;
+                }
+                continue;
+            }
+            break;
+        }
+        pthread_mutex_lock(&up->lock);
+        if (resp == NULL) {
+            upstream_break(up, c);
+        } else {
+            ++c->replied;
+            pthread_cond_broadcast(&up->turn);
+        }
+    }
+    conn_release(c);
+    pthread_mutex_unlock(&up->lock);
+    if (crc) {
+        pthread_mutex_unlock(&up->send_lock);
+    }
+    return resp;
+}
+
+// open the connection, called with both locks held
+int upstream_connect(upstream *up) {
+    struct sockaddr_in srv;
+    memset(&srv, 0, sizeof(srv));
+    srv.sin_family = AF_INET;
+    srv.sin_addr.s_addr = up->addr;
+    srv.sin_port = htons(up->port);
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    int on = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    if (connect(fd, (struct sockaddr *) &srv, sizeof(srv)) < 0) {
+        close(fd);
+        return -1;
+    }
+    fprintf(stderr, "broker - connected to server port %u\n", up->port);
+    up->conn = calloc(1, sizeof(server_conn));
+    up->conn->sockfd = fd;
+    up->conn->refs = 1;
+    return 0;
+}
+
+// drop a connection and fail every request still waiting on it, the fd
+// is closed once no client is in a send or recv on it. Called with
+// up->lock held
+void upstream_break(upstream *up, server_conn *c) {
+    if (c->broken) {
+        return;
+    }
+    fprintf(stderr, "broker - lost server port %u\n", up->port);
+    c->broken = true;
+    shutdown(c->sockfd, SHUT_RDWR);
+    if (up->conn == c) {
+        up->conn = NULL;
+        conn_release(c);
+    }
+    pthread_cond_broadcast(&up->turn);
+}
+
+void conn_release(server_conn *c) {
+    if (--c->refs == 0) {
+        close(c->sockfd);
+        free(c);
+    }
+}
+
+// check the CRC32C trailer of a frame that has one
+bool frame_intact(const char *frame, size_t len) {
+    int word;
+    memcpy(&word, frame, sizeof(int));
+    if (!(word & FRAME_CRC)) {
+        return true;
+    }
+    u_int32_t sum;
+    memcpy(&sum, frame + len - sizeof(u_int32_t), sizeof(u_int32_t));
+    return sum == crc32c(crc32c(0, &word, sizeof(int)), frame + sizeof(int), FRAME_SIZE(word));
+}
+
+// one whole frame with its size word and trailer, NULL on EOF or error
+char *recv_frame(int fd, size_t *len) {
+    int word;
+    if (recv_raw(fd, &word, sizeof(int)) < 0) {
+        return NULL;
+    }
+    size_t rest = (word & FRAME_NACK) ? 0 : FRAME_SIZE(word) + ((word & FRAME_CRC) ? sizeof(u_int32_t) : 0);
+    char *frame = malloc(sizeof(int) + rest);
+    memcpy(frame, &word, sizeof(int));
+    if (recv_raw(fd, frame + sizeof(int), rest) < 0) {
+        free(frame);
+        return NULL;
+    }
+    *len = sizeof(int) + rest;
+    return frame;
+}
+
+int send_raw(int fd, const void *data, size_t size) {
+    size_t sent = 0;
+    while (sent < size) {
+        ssize_t rv = send(fd, (const char *) data + sent, size - sent, MSG_NOSIGNAL);
+        if (rv < 0 && errno == EINTR) {
+            continue;
+        }
+        if (rv <= 0) {
+            return -1;
+        }
+        sent += rv;
+    }
+    return 0;
+}
+
+int recv_raw(int fd, void *data, size_t size) {
+    size_t got = 0;
+    while (got < size) {
+        ssize_t rv = recv(fd, (char *) data + got, size - got, 0);
+        if (rv < 0 && errno == EINTR) {
+            continue;
+        }
+        if (rv <= 0) {
+            return -1;
+        }
+        got += rv;
+    }
+    return 0;
+}
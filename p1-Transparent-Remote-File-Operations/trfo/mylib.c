@@ -22,32 +22,401 @@
 
 #include <sys/stat.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <limits.h>
 #include <stdarg.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <err.h>
 #include <arpa/inet.h>
 #include <string.h>
 #include <errno.h>
+#include <dirent.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+#include <linux/userfaultfd.h>
 
 #include "serde.h"
 
 #define MAXMSGLEN 4096
 #define BUFFERLEN 4096
+#define MAX_FD    65536
+#define MMAP_READAHEAD 16
+#define DIRPLUS_BATCH  (1 << 20)
+#define ATTR_CACHE_BUCKETS 4096
+#define ATTR_CACHE_MAX     131072
+#define ATTR_CACHE_TTL     3
+#define MAX_SHARDS         16
+#define MAX_REPLICAS       4
+#define LAT_SAMPLES        256
+#define LAT_MIN_SAMPLES    32
+#define HEDGE_PERCENTILE   95
+#define LAT_STAT           0
+#define LAT_READ           1
+#define REPLICA_UNOPENED   INT_MIN  // replica_fd of a file not opened on that replica yet
+#define DEDUP_BUF          (4 << 20)
+#define CDC_MIN            2048
+#define CDC_MAX            65536
+#define CDC_MASK           ((1 << 13) - 1)
+#define DELTA_MAX          (256 << 20)
+#define CRC_RETRIES        3
+#define PF_TRIGGER         2
+#define PF_FILE_MAX        (64 << 10)
+#define PF_BATCH_BYTES     (1 << 20)
+#define PF_BATCH_FILES     64
+#define PF_DIRS            8
+#define COPY_BUF           (1 << 20)
+#define STAT_VER           1  // _STAT_VER of x86_64, gone from newer headers
 
+/**
+ * one trfo server of a shard
+ */
+typedef struct replica {
+    char *host;
+    unsigned short port;
+    int sockfd;
+    int outstanding;        // requests sent or waiting for the connection
+    int owed;               // replies to lost hedges and pipelined calls, unread
+    u_int32_t opens;        // OP_OPENs sent on this connection, numbered like the server does
+    int opening_at;         // owed replies ahead of a speculative open's, -1 if none in flight
+    struct remote_file *opening;    // file waiting on that open, NULL once closed
+    pthread_mutex_t lock;   // one request in flight per connection
+} replica;
+
+/**
+ * trfo servers exporting the same content, owning the paths under prefix
+ */
+typedef struct shard {
+    char *prefix;           // NULL for the default shard
+    int nreplicas;
+    replica r[MAX_REPLICAS];    // r[0] is the primary and takes every write
+    int opened_fd;          // remote files open on this shard
+} shard;
+
+/**
+ * recent latencies of one kind of hedgeable request
+ */
+typedef struct lat_ring {
+    long us[LAT_SAMPLES];
+    int count;
+    long threshold;         // hedge delay, -1 until there are enough samples
+} lat_ring;
+
+/**
+ * client side state of a remote file, indexed by the local fd reserved for it
+ */
+typedef struct remote_file {
+    int shard;
+    int remote_fd;
+    int replica_fd[MAX_REPLICAS];   // read-only files: fd on each replica, -1 if none
+    int flags;      // open() flags, a replica opens the file with them when a read first picks it
+    off_t offset;   // file offset, tracked locally and sent with pread/pwrite
+    int refs;       // the local fd plus one per live mapping
+    char *path;     // as passed to open(), prefix of attribute cache keys
+    char *dir_buf;  // last readdirplus batch of dirents
+    size_t dir_len; // bytes of dirents in dir_buf
+    size_t dir_pos; // next dirent to return from dir_buf
+    off_t dir_at;   // directory position of dir_pos
+    int dedup;      // sequential writes are buffered and sent as chunks
+    int delta;      // O_TRUNC rewrite, held whole and sent as a delta
+    char *wbuf;     // written bytes not sent yet
+    size_t wbuf_len;
+    size_t wbuf_cap;
+    off_t wbuf_off; // file offset of wbuf[0]
+    int wbuf_err;   // errno of a failed flush, returned by the next call
+    int open_err;   // errno of a speculative open that failed, returned by every call
+    int clean;      // opened read-only, a pipelined close doesn't wait for the server
+    char *cached;   // whole content from a prefetch batch, never opened on the server
+    size_t cached_len;
+    struct remote_file *next_dirty;
+} remote_file;
+
+/**
+ * cached stat result of a remote path
+ */
+typedef struct attr_entry {
+    char *path;
+    struct stat st;
+    time_t expire;
+    int shard;      // shard holding a callback on it, -1 if it expires instead
+    struct attr_entry *next;
+} attr_entry;
+
+/**
+ * content of a small file fetched ahead of its open
+ */
+typedef struct pf_entry {
+    char *path;     // normalized like pf_key()
+    char *data;
+    size_t len;
+    time_t expire;
+    struct stat st; // the file the content came from
+
+    struct pf_entry *next;
+} pf_entry;
+
+/**
+ * a directory listed through readdirplus and the small files in it
+ */
+typedef struct pf_dir {
+    char *path;     // normalized like pf_key(), NULL for a free slot
+    int shard;
+    int n;
+    int cap;
+    char **names;
+    off_t *sizes;
+    char *done;     // opened or fetched already
+    int opens;      // opens of its files so far
+} pf_dir;
+
+/**
+ * last getdirtree() result of a root, and its version on the server
+ */
+typedef struct tree_cache {
+    int shard;
+    char *path;
+    u_int64_t hash;
+    struct dirtreenode *tree;
+    struct tree_cache *next;
+} tree_cache;
+
+/**
+ * a remote file mapped by mmap(), pages are filled in on fault
+ */
+typedef struct remote_map {
+    char *addr;
+    size_t length;          // page aligned
+    size_t npages;
+    off_t offset;           // file offset of addr
+    off_t file_size;        // size at mmap time, write back stops here
+    int prot;
+    bool track_dirty;       // MAP_SHARED and PROT_WRITE
+    remote_file *file;
+    char *present;          // per page
+    char *dirty;            // per page
+    char *mapped;           // per page, cleared by munmap
+    size_t live;            // pages still mapped
+    int users;              // write-backs and faults running without map_lock
+    struct remote_map *next;
+} remote_map;
+
+int (*orig_open)(const char *pathname, int flags, ...);
 int (*orig_close)(int fd);
 ssize_t (*orig_write)(int fd, const void *buf, size_t count);
 ssize_t (*orig_read)(int fd, void *buf, size_t count);
+off_t (*orig_lseek)(int fd, off_t offset, int whence);
+ssize_t (*orig_getdirentries)(int fd, char *buf, size_t nbytes, off_t *basep);
+void *(*orig_mmap)(void *addr, size_t length, int prot, int flags, int fd, off_t offset);
+int (*orig_munmap)(void *addr, size_t length);
+int (*orig_msync)(void *addr, size_t length, int flags);
+ssize_t (*orig_readv)(int fd, const struct iovec *iov, int iovcnt);
+ssize_t (*orig_writev)(int fd, const struct iovec *iov, int iovcnt);
+ssize_t (*orig_preadv)(int fd, const struct iovec *iov, int iovcnt, off_t offset);
+ssize_t (*orig_pwritev)(int fd, const struct iovec *iov, int iovcnt, off_t offset);
+ssize_t (*orig_copy_file_range)(int fd_in, off_t *off_in, int fd_out, off_t *off_out, size_t len,
+                                unsigned int flags);
+ssize_t (*orig_sendfile)(int out_fd, int in_fd, off_t *offset, size_t count);
 
-rpc_resp* send_request(const char *msg, size_t msg_sz);
+rpc_resp* send_request(int shard, const char *msg, size_t msg_sz);
+rpc_resp* send_request_to(int shard, int replica, const char *msg, size_t msg_sz);
+rpc_resp* send_hedged(int shard, int kind, char *msgs[], const size_t sizes[], remote_file *file);
+int replica_ready(int shard, int replica, remote_file *file, char *msg);
+int pick_replica(shard *sh, char *const msgs[], int skip);
+long hedge_delay(int kind);
+void latency_record(int kind, long us);
+rpc_resp* recv_resp(int sockfd);
 void send_all(int sockfd, const void *data, size_t size);
-int init_client();
+void send_nack(int sockfd);
+void frame_retry(int *tries);
+rpc_resp* send_request_iov(int shard, const struct iovec *iov, int iovcnt, size_t head,
+                           const struct iovec *rx_iov, int rx_iovcnt);
+void iov_advance(struct iovec **iov, int *iovcnt, size_t n);
+void send_all_iov(int sockfd, const struct iovec *iov, int iovcnt);
+void recv_all(int sockfd, void *data, size_t size);
+void busy_wait(int sockfd);
+rpc_resp* recv_resp_iov(int sockfd, size_t head, const struct iovec *iov, int iovcnt);
+int init_client(int shard, int replica);
+int broker_connect(int shard, int replica);
+void *prewarm(void *arg);
+int get_socket_fd(int shard, int replica);
+rpc_resp* send_open(int shard, int replica, const char *msg, size_t msg_sz, remote_file *ahead);
+void send_ahead(int shard, int replica, const char *msg, size_t msg_sz);
+void owed_drain(replica *r, bool all);
+void open_resolve(remote_file *file, rpc_resp *resp);
+bool open_failed(remote_file *file);
+bool pipelined(int shard);
+void init_shards();
+int route_path(const char *path);
+bool path_under(const char *path, const char *prefix);
+int remote_close(int shard, int replica, int remote_fd, int *err_no, bool wait);
+ssize_t rpc_pwrite(int shard, int remote_fd, const void *buf, size_t count, off_t offset,
+                   off_t *new_off, int *err_no);
+ssize_t rpc_preadv(int shard, int remote_fd, const struct iovec *iov, int iovcnt, off_t offset);
+ssize_t rpc_pwritev(int shard, int remote_fd, const struct iovec *iov, int iovcnt, off_t offset, off_t *new_off);
+ssize_t remote_copy(int fd_in, off_t *off_in, int fd_out, off_t *off_out, size_t len);
+int rpc_stat(int ver, const char *path, struct stat *stat_buf);
+ssize_t resp_value(rpc_resp *resp, size_t size, int *err_no);
+// rpc_<name>(shard, replica, fields) for every FIXED call, see RPC_STUB_FIXED
+#define RPC_STUB_DECLARE_FIXED(OP, name) rpc_resp *rpc_##name(int shard, int replica CALL_##OP(RPC_FIELD_PARAM));
+#define RPC_STUB_DECLARE_VAR(OP, name)
+#define RPC_STUB_DECLARE(OP, code, name, kind, shape) RPC_STUB_DECLARE_##shape(OP, name)
+RPC_OPS(RPC_STUB_DECLARE)
+ssize_t copy_through(int fd_in, off_t *off_in, int fd_out, off_t *off_out, size_t len);
+
+bool is_remote_fd(int fd);
+int fd_table_insert(int shard, int remote_fd, const char *path);
+void fd_table_remove(int fd);
+int remote_file_release(remote_file *file, int *err_no);
+
+int readdirplus_fetch(remote_file *file);
+void attr_path_normalize(char *out, const char *path);
+unsigned long attr_hash(const char *path);
+bool attr_cache_get(const char *path, struct stat *st, bool held);
+void attr_cache_put(const char *path, const struct stat *st, int shard);
+void attr_cache_invalidate(const char *path);
+void attr_cache_break(int shard, const file_id *ids, u_int32_t n);
+bool callback_watch(int shard);
+void callback_drain(int sockfd, bool wait);
+
+void pf_key(char *out, const char *path);
+pf_dir *pf_dir_listed(remote_file *file);
+void pf_dir_add(pf_dir *d, const char *name, off_t size);
+int pf_open(int shard, const char *pathname);
+void pf_fetch(pf_dir *d, int first);
+void pf_put(const char *path, const struct stat *st, const char *data, size_t len);
+pf_entry *pf_take(const char *key);
+void pf_drop(const char *path);
+void pf_expire();
+ssize_t cached_read(remote_file *file, const struct iovec *iov, int iovcnt, off_t offset);
 
-int _sockfd;
-int min_fd;
-int opened_fd;
+struct dirtreenode* shard_dirtree(int shard, const char *path);
+void tree_graft(struct dirtreenode *root, const char *path, struct dirtreenode *sub);
+int treev_fetch(tree_cache *cache, u_int64_t have);
+size_t tree_apply(struct dirtreenode *root, const char *buf, size_t off);
+struct dirtreenode* tree_find(struct dirtreenode *root, const char *path);
+struct dirtreenode* tree_copy(const struct dirtreenode *tree);
+
+remote_map *map_find(const char *addr);
+remote_map **map_hold(const char *addr, size_t length, size_t *n);
+void map_unhold(remote_map **maps, size_t n, const char *unmapped, size_t length);
+int map_fetch(remote_map *map, size_t first, size_t npages, char *out);
+void map_touch(const struct iovec *iov, int iovcnt);
+int map_write_back(remote_map *map, char *addr, size_t length);
+int map_load_all(remote_map *map);
+int uffd_register(remote_map *map);
+void handle_page_fault(char *addr, u_int64_t flags, pid_t tid);
+void *fault_handler(void *arg);
+
+ssize_t dedup_write(remote_file *file, const void *buf, size_t count);
+int dedup_flush(remote_file *file, bool final);
+int dedup_sync(remote_file *file);
+void dedup_sync_path(const char *path);
+void dedup_sync_all();
+size_t cdc_cut(const unsigned char *p, size_t n);
+ssize_t rpc_dedup_write(remote_file *file, const char *data, const chunk_ref *refs, u_int32_t n,
+                        off_t offset, int *err_no);
+ssize_t delta_write(remote_file *file, const void *buf, size_t count);
+int delta_commit(remote_file *file);
+void dirty_remove(remote_file *file);
+
+// servers, a path goes to the shard with the longest matching prefix
+shard shards[MAX_SHARDS];
+int nshards;
+
+// reads and stats slower than this percentile are sent to a second replica,
+// 0 turns hedging off
+int hedge_pct = HEDGE_PERCENTILE;
+lat_ring latencies[2];
+
+// durable15440 set: every writable open is O_DSYNC, the server acks a
+// write once a group commit covers it
+int durable_writes;
+
+// crc15440 set: frames carry a CRC32C trailer, the server answers in kind
+// and either side asks for a corrupt frame again
+int frame_crc;
+
+// sockbuf15440: send and receive buffer size of server sockets, unset
+// leaves them to the kernel's autotuning
+int sock_buf;
+
+// busypoll15440: microseconds to spin on a socket for a reply before
+// sleeping in recv(), and SO_BUSY_POLL on server sockets; unset sleeps
+// right away
+int busy_poll_us;
+
+// broker15440: Unix socket of the host's connection broker, which keeps
+// server connections open across short-lived processes
+char *broker_path;
+
+// pipeline15440 set: open() hands out the fd before the server answers and
+// the first call on it goes out right behind the open, a read-only fd's
+// close doesn't wait either; errors show up on the next call that needs
+// the file. Single server shards reached directly, without CRC frames
+int pipelining;
+
+// callbacks15440 set: stat results are cached until the server reports a
+// change, on single server shards reached directly
+int callbacks_on;
+
+// attrcache15440 set: stat results without a callback are served from the
+// cache for ATTR_CACHE_TTL seconds, and may be that stale; unset asks the
+// server every time
+int attr_ttl_on;
+
+// dedup15440 set: sequential writes are cut into content-defined chunks
+// and the server is only sent the chunks it has not seen
+int dedup_writes;
+u_int64_t gear[256];
+remote_file *dirty_list;
+
+// delta15440 set: a file opened with O_TRUNC keeps its old content on the
+// server until close, then only the differences are sent
+int delta_writes;
+pthread_mutex_t lat_lock = PTHREAD_MUTEX_INITIALIZER;
+unsigned int replica_rr;
+
+// descriptor table: a local fd is reserved (dup of placeholder_fd) for every
+// remote fd, so remote fds can never collide with local ones.
+int placeholder_fd;
+u_int64_t fd_bitmap[MAX_FD / 64];
+remote_file *fd_table[MAX_FD];
+
+// stat results by normalized path, filled by __xstat and readdirplus.
+// attr_lock is never held while taking a connection's lock, breaks are
+// applied with one held
+attr_entry *attr_cache[ATTR_CACHE_BUCKETS];
+size_t attr_cache_size;
+pthread_mutex_t attr_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// prefetch15440: cache budget in bytes. A second open in a directory
+// listed with getdirentries() fetches its remaining small files in one
+// OP_MREAD, later read-only opens of them are served here for
+// ATTR_CACHE_TTL seconds while the file's stat still matches
+size_t prefetch_budget;
+pf_entry *pf_cache[ATTR_CACHE_BUCKETS];
+size_t pf_bytes;
+pf_dir pf_dirs[PF_DIRS];
+unsigned int pf_next_dir;
+
+// getdirtree() roots seen so far
+tree_cache *tree_list;
+
+// remote mappings, served by the userfaultfd handler thread
+remote_map *map_list;
+pthread_mutex_t map_lock = PTHREAD_MUTEX_INITIALIZER;
+int uffd = -1;          // -1 not created yet, -2 not available
+bool uffd_wp;
+size_t page_size;
 
 /**
  * @brief RPC call for remote read.
@@ -70,6 +439,31 @@ int open(const char *pathname, int flags, ...) {
 		va_end(a);
 	}
 
+    if (flags & (O_WRONLY | O_RDWR | O_CREAT | O_TRUNC)) {
+        attr_cache_invalidate(pathname);
+    }
+
+    if (durable_writes && (flags & O_ACCMODE) != O_RDONLY) {
+        flags |= O_DSYNC;
+    }
+    dedup_sync_path(pathname);
+
+    // the server needs the old content to diff against, the truncate
+    // happens when the new content replaces it
+    int delta = delta_writes && (flags & O_TRUNC) && (flags & O_ACCMODE) != O_RDONLY &&
+                !(flags & (O_APPEND | O_DSYNC));
+    if (delta) {
+        flags &= ~O_TRUNC;
+    }
+
+    int sh = route_path(pathname);
+    if (prefetch_budget > 0 && (flags & O_ACCMODE) == O_RDONLY && !(flags & (O_CREAT | O_TRUNC | O_DIRECTORY))) {
+        int fd = pf_open(sh, pathname);
+        if (fd >= 0) {
+            fprintf(stderr, "lib: open system call - local fd [%d] from prefetch\n", fd);
+            return fd;
+        }
+    }
     struct rpc_frame* frame = malloc(sizeof(rpc_resp));
     frame->opcode = OP_OPEN;
 
@@ -83,29 +477,69 @@ int open(const char *pathname, int flags, ...) {
 
     // send rpc frame
     fprintf(stderr, "lib: open system call - sending request size %zu\n", frame_size);
-    rpc_resp * resp = send_request(buf, frame_size);
-
-    // handle response
     int fd;
-    int new_err = resp->err_no;
-    mem_read_data(resp->data, 0, &fd, sizeof(int));
+    int new_err = 0;
+    if (pipelined(sh)) {
+        // the local fd is reserved first, the reply is read with the
+        // reply to the first call on it
+        fd = fd_table_insert(sh, -1, pathname);
+        new_err = errno;
+        if (fd >= 0) {
+            send_open(sh, 0, buf, frame_size, fd_table[fd]);
+        }
+    } else {
+        rpc_resp * resp = send_open(sh, 0, buf, frame_size, NULL);
 
-    // free resources
-    free(resp->data);
-    free(resp);
-    free(buf);
-    free(frame->payload);
-    free(frame);
+        // handle response
+        new_err = resp->err_no;
+        mem_read_data(resp->data, 0, &fd, sizeof(int));
+        free(resp->data);
+        free(resp);
+
+        fprintf(stderr, "lib: open system call - got fd from server %d\n", fd);
+        if (fd >= 0) {
+            int remote_fd = fd;
+            fd = fd_table_insert(sh, remote_fd, pathname);
+            if (fd < 0) {
+                // no local fd to reserve, drop the remote one
+                new_err = errno;
+                remote_close(sh, 0, remote_fd, NULL, true);
+            }
+        }
+    }
 
-    fprintf(stderr, "lib: open system call - got fd from server %d\n", fd);
     if (fd >= 0) {
-        min_fd = fd < min_fd? fd: min_fd;
-        ++opened_fd;
-        fprintf(stderr, "lib: open system call - min_fd [%d] opened_fd [%d]\n", min_fd, opened_fd);
+        ++shards[sh].opened_fd;
+        fprintf(stderr, "lib: open system call - local fd [%d] shard [%d]\n", fd, sh);
+        fd_table[fd]->clean = (flags & O_ACCMODE) == O_RDONLY;
+        fd_table[fd]->flags = flags;
+        // appends and synchronous writes can't be held back
+        fd_table[fd]->dedup = dedup_writes && (flags & O_ACCMODE) != O_RDONLY &&
+                              !(flags & (O_APPEND | O_DSYNC));
+        if (delta) {
+            fd_table[fd]->dedup = 0;
+            fd_table[fd]->delta = 1;
+            fd_table[fd]->next_dirty = dirty_list;
+            dirty_list = fd_table[fd];
+        }
+
+        // reads of a read-only file may go to any replica, each opens it
+        // the first time one is sent there
+        if ((flags & O_ACCMODE) == O_RDONLY) {
+            int i;
+            for (i = 1; i < shards[sh].nreplicas; i++) {
+                fd_table[fd]->replica_fd[i] = REPLICA_UNOPENED;
+            }
+        }
     } else {
         fprintf(stderr, "lib: open system call - error: %s\n", strerror(new_err));
         errno = new_err;
     }
+
+    // free resources
+    free(buf);
+    free(frame->payload);
+    free(frame);
     return fd;
 }
 
@@ -122,52 +556,89 @@ int open(const char *pathname, int flags, ...) {
 int close(int fd) {
     fprintf(stderr, "\nlib: close system call - (%d)\n", fd);
 
-    if (fd < min_fd) {
+    if (!is_remote_fd(fd)) {
         fprintf(stderr, "lib: close system call - using local close.\n");
         return orig_close(fd);
     }
 
-    struct rpc_frame* frame = malloc(sizeof(rpc_resp));
-    frame->opcode = OP_CLOSE;
-
-    // build op message
-    frame->payload = malloc(BUFFERLEN);
-    frame->payload_size = call_close_marshal(frame->payload, fd);
+    // a mapped file stays open on the server until its last munmap()
+    remote_file *file = fd_table[fd];
+    fd_table_remove(fd);
+    int new_err = 0;
+    int synced = dedup_sync(file);
+    int sync_err = errno;
+    int r = remote_file_release(file, &new_err);
+    if (synced < 0 && r == 0) {
+        // buffered writes that failed are reported here at the latest
+        r = -1;
+        new_err = sync_err;
+    }
 
-    // build rpc frame
-    char *buf = malloc(BUFFERLEN);
-    size_t frame_size = marshal_frame(buf, frame);
+    fprintf(stderr, "lib: close system call - finish return %d\n", r);
+    if (r < 0) {
+        fprintf(stderr, "error in close %s\n", strerror(new_err));
+        errno = new_err;
+    }
+    return r;
+}
 
-    // send rpc frame
+/**
+ * @brief send close request for a remote fd.
+ *
+ * @param shard shard holding the file
+ * @param replica replica the fd was opened on
+ * @param remote_fd fd on the server side
+ * @param err_no errno from the server, ignored if NULL
+ * @param wait wait for the reply, otherwise it is read with a later one
+ * @return return value of close() on the server, 0 if not waited for
+ */
+int remote_close(int shard, int replica, int remote_fd, int *err_no, bool wait) {
+    if (wait) {
+        return resp_value(rpc_close(shard, replica, remote_fd), sizeof(int), err_no);
+    }
+    char buf[CALL_FRAME_SIZE(CLOSE)];
+    size_t frame_size = call_close_frame(buf, remote_fd);
     fprintf(stderr, "lib: close system call - sending request size %zu\n", frame_size);
-    rpc_resp * resp = send_request(buf, frame_size);
+    send_ahead(shard, replica, buf, frame_size);
+    return 0;
+}
 
-    // handle response
-    int r;
-    int new_err = resp->err_no;
-    mem_read_data(resp->data, 0, &r, sizeof(int));
+/**
+ * @brief send/receive stubs of the FIXED calls, generated from RPC_OPS:
+ * rpc_<name>(shard, replica, fields) builds the frame on the stack, sends
+ * it in one send and returns the reply, which the caller frees.
+ */
+#define RPC_STUB_FIXED(OP, name) \
+rpc_resp *rpc_##name(int shard, int replica CALL_##OP(RPC_FIELD_PARAM)) { \
+    char buf[CALL_FRAME_SIZE(OP)]; \
+    size_t frame_size = call_##name##_frame(buf CALL_##OP(RPC_FIELD_ARG)); \
+    fprintf(stderr, "lib: " #name " - sending request size %zu\n", frame_size); \
+    return send_request_to(shard, replica, buf, frame_size); \
+}
+#define RPC_STUB_VAR(OP, name)
+#define RPC_STUB(OP, code, name, kind, shape) RPC_STUB_##shape(OP, name)
+RPC_OPS(RPC_STUB)
 
-    // free resources
+/**
+ * @brief take the result a reply starts with, and free the reply.
+ *
+ * @param resp reply of a call that returns one value
+ * @param size bytes of the value, sizeof(int) or sizeof(ssize_t)
+ * @param err_no errno from the server, ignored if NULL
+ * @return the value
+ */
+ssize_t resp_value(rpc_resp *resp, size_t size, int *err_no) {
+    ssize_t r;
+    if (size == sizeof(int)) {
+        int v;
+        mem_read_data(resp->data, 0, &v, sizeof(int));
+        r = v;
+    } else {
+        mem_read_data(resp->data, 0, &r, sizeof(ssize_t));
+    }
+    if (err_no) *err_no = resp->err_no;
     free(resp->data);
     free(resp);
-    free(buf);
-    free(frame->payload);
-    free(frame);
-
-    if (r == 0) {
-        --opened_fd;
-        if (opened_fd == 0) {
-            fprintf(stderr, "lib: close system call - closing socket\n");
-            // close socket here? when close is succeeded and all fd closed
-            orig_close(_sockfd);
-            _sockfd = -1;
-        }
-    }
-    fprintf(stderr, "lib: close system call - finish return %d\n", r);
-    if (r < 0) {
-        fprintf(stderr, "error in close %s\n", strerror(new_err));
-        errno = new_err;
-    }
     return r;
 }
 
@@ -187,24 +658,54 @@ int close(int fd) {
  */
 ssize_t read(int fd, void *buf, size_t count) {
     fprintf(stderr, "\nlib: read system call - (%d) (%zu)\n", fd, count);
-    if (fd < min_fd) {
+    if (!is_remote_fd(fd)) {
         fprintf(stderr, "lib: read system call - local read\n");
         return orig_read(fd, buf, count);
     }
-    struct rpc_frame* frame = malloc(sizeof(rpc_resp));
-    frame->opcode = OP_READ;
-
-    // build op message
-    frame->payload = malloc(BUFFERLEN);
-    frame->payload_size = call_read_marshal(frame->payload, fd, count);
-
-    // build rpc frame
-    char *rpc_buf = malloc(BUFFERLEN);
-    size_t frame_size = marshal_frame(rpc_buf, frame);
+    // one frame carries the whole reply, a short read is allowed
+    count = count < IO_MAX ? count : IO_MAX;
+    remote_file *file = fd_table[fd];
+    if (open_failed(file)) {
+        return -1;
+    }
+    if (file->delta) {
+        if ((file->flags & O_ACCMODE) == O_WRONLY) {
+            errno = EBADF;
+            return -1;
+        }
+        // the new content only exists here until close
+        size_t n = file->offset >= (off_t) file->wbuf_len ? 0 : file->wbuf_len - file->offset;
+        n = n < count ? n : count;
+        memcpy(buf, file->wbuf + file->offset, n);
+        file->offset += n;
+        return n;
+    }
+    if (file->cached != NULL) {
+        struct iovec v = { buf, count };
+        ssize_t r = cached_read(file, &v, 1, file->offset);
+        file->offset += r;
+        return r;
+    }
+    if (dedup_sync(file) < 0) {
+        return -1;
+    }
+    // one frame per replica holding the file, they differ in the remote fd
+    char bufs[MAX_REPLICAS][CALL_FRAME_SIZE(PREAD)];
+    char *msgs[MAX_REPLICAS] = {NULL};
+    size_t sizes[MAX_REPLICAS];
+    int i;
+    for (i = 0; i < shards[file->shard].nreplicas; i++) {
+        // the primary holds every file, under an open still in flight maybe
+        if (i > 0 && file->replica_fd[i] == -1) {
+            continue;
+        }
+        msgs[i] = bufs[i];
+        sizes[i] = call_pread_frame(msgs[i], file->replica_fd[i], count, file->offset);
+    }
 
     // send rpc frame
-    fprintf(stderr, "lib: read system call - sending request size %zu\n", frame_size);
-    rpc_resp * resp = send_request(rpc_buf, frame_size);
+    fprintf(stderr, "lib: read system call - sending request size %zu\n", sizes[0]);
+    rpc_resp * resp = send_hedged(file->shard, LAT_READ, msgs, sizes, file);
 
     // handle response
     ssize_t r;
@@ -212,20 +713,33 @@ ssize_t read(int fd, void *buf, size_t count) {
     size_t off = 0;
     off = mem_read_data(resp->data, off, &r, sizeof(ssize_t));
     if (r > 0) {
-        mem_read_data(resp->data, off, buf, r);
+        // only the data extents came over, the holes between them are zeros
+        u_int32_t n, k;
+        off = mem_read_int32(resp->data, off, &n);
+        const char *data = resp->data + off + n * 2 * sizeof(u_int64_t);
+        size_t at = 0;
+        for (k = 0; k < n; k++) {
+            u_int64_t start, len;
+            off = mem_read_data(resp->data, off, &start, sizeof(u_int64_t));
+            off = mem_read_data(resp->data, off, &len, sizeof(u_int64_t));
+            memset((char *) buf + at, 0, start - at);
+            memcpy((char *) buf + start, data, len);
+            data += len;
+            at = start + len;
+        }
+        memset((char *) buf + at, 0, r - at);
+        file->offset += r;
     }
 
     // free resources
     free(resp->data);
     free(resp);
-    free(rpc_buf);
-    free(frame->payload);
-    free(frame);
 
     fprintf(stderr, "read call finish: return %zd\n", r);
     if (r < 0) {
         fprintf(stderr, "error in read %s\n", strerror(new_err));
         errno = new_err;
+        open_failed(file);
     }
     return r;
 }
@@ -243,31 +757,78 @@ ssize_t read(int fd, void *buf, size_t count) {
  */
 ssize_t write(int fd, const void *buf, size_t count) {
     fprintf(stderr, "\nlib: write system call - (%d) (%zu)\n", fd, count);
-    if (fd < min_fd) {
+    if (!is_remote_fd(fd)) {
         fprintf(stderr, "lib: write system call - local write\n");
         return orig_write(fd, buf, count);
     }
+    count = count < IO_MAX ? count : IO_MAX;
+    remote_file *file = fd_table[fd];
+    if (open_failed(file)) {
+        return -1;
+    }
+    if (file->cached != NULL) {
+        errno = EBADF;
+        return -1;
+    }
+    attr_cache_invalidate(file->path);
+    if (file->delta && file->offset + count <= DELTA_MAX) {
+        return delta_write(file, buf, count);
+    }
+    if (file->dedup && dedup_writes) {
+        return dedup_write(file, buf, count);
+    }
+    if (dedup_sync(file) < 0) {
+        return -1;
+    }
+    int new_err;
+    ssize_t r = rpc_pwrite(file->shard, file->remote_fd, buf, count, file->offset, &file->offset, &new_err);
+
+    fprintf(stderr, "write call finish: return %zd\n", r);
+    if (r < 0) {
+        fprintf(stderr, "error in write: %s\n", strerror(new_err));
+        errno = new_err;
+        open_failed(file);
+    }
+    return r;
+}
+
+/**
+ * @brief send pwrite request for a remote fd.
+ *
+ * @param shard shard holding the file
+ * @param remote_fd fd on the server side
+ * @param buf data to write
+ * @param count count for bytes to write
+ * @param offset file offset to write at
+ * @param new_off file offset after the write
+ * @param err_no errno from the server
+ * @return return value of pwrite() on the server
+ */
+ssize_t rpc_pwrite(int shard, int remote_fd, const void *buf, size_t count, off_t offset,
+                   off_t *new_off, int *err_no) {
+    count = count < IO_MAX ? count : IO_MAX;
     struct rpc_frame* frame = malloc(sizeof(rpc_resp));
-    frame->opcode = OP_WRITE;
+    frame->opcode = OP_PWRITE;
 
     // build op message
-    frame->payload = malloc(count + sizeof(int) + sizeof(size_t));
-    frame->payload_size = call_write_marshal(frame->payload, fd, buf, count);
+    frame->payload = malloc(count + sizeof(int) + sizeof(size_t) + sizeof(off_t));
+    frame->payload_size = call_pwrite_marshal(frame->payload, remote_fd, buf, count, offset);
 
     fprintf(stderr, "lib: write system call - frame payload size: %d\n", frame->payload_size);
 
     // build rpc frame
-    char *rpc_buf = malloc(count + sizeof(rpc_frame));
+    char *rpc_buf = malloc(frame->payload_size + 2 * sizeof(u_int32_t));
     size_t frame_size = marshal_frame(rpc_buf, frame);
 
     // send rpc frame
     fprintf(stderr, "lib: write system call - sending request size %zu\n", frame_size);
-    rpc_resp * resp = send_request(rpc_buf, frame_size);
+    rpc_resp * resp = send_request(shard, rpc_buf, frame_size);
 
     // handle response
     ssize_t r;
-    int new_err = resp->err_no;
-    mem_read_data(resp->data, 0, &r, sizeof(ssize_t));
+    *err_no = resp->err_no;
+    size_t off = mem_read_data(resp->data, 0, &r, sizeof(ssize_t));
+    mem_read_data(resp->data, off, new_off, sizeof(off_t));
 
     // free resources
     free(resp->data);
@@ -275,106 +836,560 @@ ssize_t write(int fd, const void *buf, size_t count) {
     free(rpc_buf);
     free(frame->payload);
     free(frame);
+    return r;
+}
 
-    fprintf(stderr, "write call finish: return %zd\n", r);
-    if (r < 0) {
-        fprintf(stderr, "error in write: %s\n", strerror(new_err));
-        errno = new_err;
+/**
+ * @brief RPC call for remote readv.
+ *
+ * readv() reads iovcnt buffers from the file associated with the file
+ * descriptor fd into the buffers described by iov. The whole table is
+ * one OP_PREADV request at the tracked file offset.
+ *
+ * @param fd file descriptor
+ * @param iov buffers to fill
+ * @param iovcnt number of buffers
+ * @return On success, the number of bytes read is returned. On error,
+ * -1 is returned, and errno is set to indicate the error.
+ */
+ssize_t readv(int fd, const struct iovec *iov, int iovcnt) {
+    if (!is_remote_fd(fd)) {
+        return orig_readv(fd, iov, iovcnt);
+    }
+    fprintf(stderr, "\nlib: readv system call - (%d) (%d)\n", fd, iovcnt);
+    remote_file *file = fd_table[fd];
+    if (open_failed(file) || dedup_sync(file) < 0) {
+        return -1;
+    }
+    if (file->cached != NULL) {
+        ssize_t r = cached_read(file, iov, iovcnt, file->offset);
+        file->offset += r;
+        return r;
+    }
+    ssize_t r = rpc_preadv(file->shard, file->remote_fd, iov, iovcnt, file->offset);
+    if (r > 0) {
+        file->offset += r;
+    } else if (r < 0) {
+        open_failed(file);
     }
     return r;
 }
 
 /**
- * @brief RPC call for remote lseek.
+ * @brief RPC call for remote writev.
  *
- * lseek() repositions the file offset of the open file description
- * associated with the file descriptor fd to the argument offset
- * according to the directive whence.
+ * writev() writes iovcnt buffers of data described by iov to the file
+ * associated with the file descriptor fd. The whole table is one
+ * OP_PWRITEV request at the tracked file offset.
  *
  * @param fd file descriptor
- * @param offset offset bytes
- * @param whence condition of offset
- * @return Upon successful completion, lseek() returns the resulting
- * offset location as measured in bytes from the beginning of the file.
- * On error, the value (off_t) -1 is returned and errno is set to indicate
- * the error.
+ * @param iov buffers to write
+ * @param iovcnt number of buffers
+ * @return On success, the number of bytes written is returned. On
+ * error, -1 is returned, and errno is set to indicate the error.
  */
-off_t lseek(int fd, off_t offset, int whence) {
-    fprintf(stderr, "\nlib: lseek system call - (%d) (-) (%d)\n", fd, whence);
-    if (opened_fd == 0) {
+ssize_t writev(int fd, const struct iovec *iov, int iovcnt) {
+    if (!is_remote_fd(fd)) {
+        return orig_writev(fd, iov, iovcnt);
+    }
+    fprintf(stderr, "\nlib: writev system call - (%d) (%d)\n", fd, iovcnt);
+    remote_file *file = fd_table[fd];
+    if (open_failed(file)) {
+        return -1;
+    }
+    if (file->cached != NULL) {
         errno = EBADF;
         return -1;
     }
-    struct rpc_frame* frame = malloc(sizeof(rpc_resp));
-    frame->opcode = OP_LSEEK;
-
-    // build op message
-    frame->payload = malloc(BUFFERLEN);
-    frame->payload_size = call_lseek_marshal(frame->payload, fd, offset, whence);
-
-    // build rpc frame
-    char *rpc_buf = malloc(BUFFERLEN);
-    size_t frame_size = marshal_frame(rpc_buf, frame);
-
-    // send rpc frame
-    fprintf(stderr, "lib: lseek system call - sending request size %zu\n", frame_size);
-    rpc_resp * resp = send_request(rpc_buf, frame_size);
-
-    // handle response
-    off_t r;
-    int new_err = resp->err_no;
-    mem_read_data(resp->data, 0, &r, sizeof(off_t));
-
-    // free resources
-    free(resp->data);
-    free(resp);
-    free(rpc_buf);
-    free(frame->payload);
-    free(frame);
-
-    fprintf(stderr, "lseek call finish: return %ld\n", r);
+    attr_cache_invalidate(file->path);
+    if (dedup_sync(file) < 0) {
+        return -1;
+    }
+    ssize_t r = rpc_pwritev(file->shard, file->remote_fd, iov, iovcnt, file->offset, &file->offset);
     if (r < 0) {
-        fprintf(stderr, "error in lseek %s\n", strerror(new_err));
-        errno = new_err;
+        open_failed(file);
     }
     return r;
 }
 
 /**
- * @brief RPC call for remote state.
+ * @brief RPC call for remote preadv.
  *
- * These functions return information about a file, in the buffer
- * pointed to by statbuf.
+ * Like readv(), but reads at offset and leaves the file offset alone.
  *
- * @param ver version
- * @param path file path
- * @param stat_buf buf to store data
- * @return On success, zero is returned.  On error, -1 is returned,
- * and errno is set to indicate the error.
+ * @param fd file descriptor
+ * @param iov buffers to fill
+ * @param iovcnt number of buffers
+ * @param offset file offset to read from
+ * @return On success, the number of bytes read is returned. On error,
+ * -1 is returned, and errno is set to indicate the error.
  */
-int __xstat(int ver, const char *path, struct stat *stat_buf) {
-    fprintf(stderr, "\nlib: __xstat system call - (%d) (%s)\n", ver, path);
-    struct rpc_frame* frame = malloc(sizeof(rpc_resp));
-    frame->opcode = OP_STAT;
+ssize_t preadv(int fd, const struct iovec *iov, int iovcnt, off_t offset) {
+    if (!is_remote_fd(fd)) {
+        return orig_preadv(fd, iov, iovcnt, offset);
+    }
+    fprintf(stderr, "\nlib: preadv system call - (%d) (%d) (%ld)\n", fd, iovcnt, offset);
+    if (open_failed(fd_table[fd]) || dedup_sync(fd_table[fd]) < 0) {
+        return -1;
+    }
+    if (fd_table[fd]->cached != NULL) {
+        if (offset < 0) {
+            errno = EINVAL;
+            return -1;
+        }
+        return cached_read(fd_table[fd], iov, iovcnt, offset);
+    }
+    ssize_t r = rpc_preadv(fd_table[fd]->shard, fd_table[fd]->remote_fd, iov, iovcnt, offset);
+    if (r < 0) {
+        open_failed(fd_table[fd]);
+    }
+    return r;
+}
+
+/**
+ * @brief RPC call for remote pwritev.
+ *
+ * Like writev(), but writes at offset and leaves the file offset alone.
+ *
+ * @param fd file descriptor
+ * @param iov buffers to write
+ * @param iovcnt number of buffers
+ * @param offset file offset to write at
+ * @return On success, the number of bytes written is returned. On
+ * error, -1 is returned, and errno is set to indicate the error.
+ */
+ssize_t pwritev(int fd, const struct iovec *iov, int iovcnt, off_t offset) {
+    if (!is_remote_fd(fd)) {
+        return orig_pwritev(fd, iov, iovcnt, offset);
+    }
+    fprintf(stderr, "\nlib: pwritev system call - (%d) (%d) (%ld)\n", fd, iovcnt, offset);
+    off_t new_off;
+    if (open_failed(fd_table[fd])) {
+        return -1;
+    }
+    if (fd_table[fd]->cached != NULL) {
+        errno = EBADF;
+        return -1;
+    }
+    attr_cache_invalidate(fd_table[fd]->path);
+    if (dedup_sync(fd_table[fd]) < 0) {
+        return -1;
+    }
+    ssize_t r = rpc_pwritev(fd_table[fd]->shard, fd_table[fd]->remote_fd, iov, iovcnt, offset, &new_off);
+    if (r < 0) {
+        open_failed(fd_table[fd]);
+    }
+    return r;
+}
+
+/**
+ * @brief send preadv request for a remote fd. The reply data is received
+ * straight into iov.
+ *
+ * @param shard shard holding the file
+ * @param remote_fd fd on the server side
+ * @param iov buffers to fill
+ * @param iovcnt number of buffers
+ * @param offset file offset to read from
+ * @return return value of preadv() on the server, errno is set on error
+ */
+ssize_t rpc_preadv(int shard, int remote_fd, const struct iovec *iov, int iovcnt, off_t offset) {
+    if (iovcnt < 0 || iovcnt > IOV_MAX) {
+        errno = EINVAL;
+        return -1;
+    }
+    // the reply fits one frame, buffers past IO_MAX are left as they are
+    struct iovec *dst = malloc(sizeof(struct iovec) * (iovcnt + 1));
+    memcpy(dst, iov, sizeof(struct iovec) * iovcnt);
+    iov_cap(dst, &iovcnt, IO_MAX);
+
+    // frame header and payload header, no data
+    char *hdr = malloc(CALL_PREADV_HDR_SIZE(iovcnt));
+    size_t payload_size = call_preadv_marshal(hdr + 2 * sizeof(u_int32_t), remote_fd, dst, iovcnt, offset);
+    mem_write_int32(hdr, 0, OP_PREADV);
+    mem_write_int32(hdr, sizeof(u_int32_t), payload_size);
+
+    struct iovec req = { hdr, payload_size + 2 * sizeof(u_int32_t) };
+    rpc_resp *resp = send_request_iov(shard, &req, 1, sizeof(ssize_t), dst, iovcnt);
+
+    ssize_t r;
+    int new_err = resp->err_no;
+    mem_read_data(resp->data, 0, &r, sizeof(ssize_t));
+
+    free(resp->data);
+    free(resp);
+    free(hdr);
+    free(dst);
+
+    fprintf(stderr, "preadv call finish: return %zd\n", r);
+    if (r < 0) {
+        fprintf(stderr, "error in preadv %s\n", strerror(new_err));
+        errno = new_err;
+    }
+    return r;
+}
+
+/**
+ * @brief send pwritev request for a remote fd. The caller's buffers are
+ * sent as they are after the header, one frame for the whole table.
+ *
+ * @param shard shard holding the file
+ * @param remote_fd fd on the server side
+ * @param iov buffers to write
+ * @param iovcnt number of buffers
+ * @param offset file offset to write at
+ * @param new_off file offset after the write
+ * @return return value of pwritev() on the server, errno is set on error
+ */
+ssize_t rpc_pwritev(int shard, int remote_fd, const struct iovec *iov, int iovcnt, off_t offset, off_t *new_off) {
+    if (iovcnt < 0 || iovcnt > IOV_MAX) {
+        errno = EINVAL;
+        return -1;
+    }
+    // one frame for what fits, a short write is allowed
+    struct iovec *req = malloc(sizeof(struct iovec) * (iovcnt + 1));
+    memcpy(req + 1, iov, sizeof(struct iovec) * iovcnt);
+    size_t count = iov_cap(req + 1, &iovcnt, IO_MAX);
+
+    char *hdr = malloc(CALL_PREADV_HDR_SIZE(iovcnt));
+    size_t hdr_size = call_pwritev_marshal(hdr + 2 * sizeof(u_int32_t), remote_fd, req + 1, iovcnt, offset);
+    mem_write_int32(hdr, 0, OP_PWRITEV);
+    mem_write_int32(hdr, sizeof(u_int32_t), hdr_size + count);
+    req[0].iov_base = hdr;
+    req[0].iov_len = hdr_size + 2 * sizeof(u_int32_t);
+
+    rpc_resp *resp = send_request_iov(shard, req, iovcnt + 1, 0, NULL, 0);
+
+    ssize_t r;
+    int new_err = resp->err_no;
+    size_t off = mem_read_data(resp->data, 0, &r, sizeof(ssize_t));
+    mem_read_data(resp->data, off, new_off, sizeof(off_t));
+
+    free(resp->data);
+    free(resp);
+    free(hdr);
+    free(req);
+
+    fprintf(stderr, "pwritev call finish: return %zd\n", r);
+    if (r < 0) {
+        fprintf(stderr, "error in pwritev %s\n", strerror(new_err));
+        errno = new_err;
+    }
+    return r;
+}
+
+/**
+ * @brief RPC call for remote copy_file_range.
+ *
+ * copy_file_range() copies up to len bytes from fd_in to fd_out, at
+ * *off_in and *off_out if given or at the file offsets otherwise. Two
+ * files open on the same server are copied there with one OP_COPY and
+ * no data comes to the client.
+ *
+ * @param fd_in file descriptor to copy from
+ * @param off_in offset to copy from, NULL for the file offset
+ * @param fd_out file descriptor to copy to
+ * @param off_out offset to copy to, NULL for the file offset
+ * @param len count for bytes to copy
+ * @param flags must be 0
+ * @return On success, the number of bytes copied is returned. On error,
+ * -1 is returned, and errno is set to indicate the error.
+ */
+ssize_t copy_file_range(int fd_in, off_t *off_in, int fd_out, off_t *off_out, size_t len, unsigned int flags) {
+    if (!is_remote_fd(fd_in) && !is_remote_fd(fd_out)) {
+        return orig_copy_file_range(fd_in, off_in, fd_out, off_out, len, flags);
+    }
+    fprintf(stderr, "\nlib: copy_file_range system call - (%d) (%d) (%zu)\n", fd_in, fd_out, len);
+    if (flags != 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    return remote_copy(fd_in, off_in, fd_out, off_out, len);
+}
+
+/**
+ * @brief RPC call for remote sendfile.
+ *
+ * sendfile() copies up to count bytes from in_fd at *offset, or at its
+ * file offset if offset is NULL, to out_fd at its file offset. Like
+ * copy_file_range() it stays on the server when it can.
+ *
+ * @param out_fd file descriptor to copy to
+ * @param in_fd file descriptor to copy from
+ * @param offset offset to copy from, NULL for the file offset
+ * @param count count for bytes to copy
+ * @return On success, the number of bytes copied is returned. On error,
+ * -1 is returned, and errno is set to indicate the error.
+ */
+ssize_t sendfile(int out_fd, int in_fd, off_t *offset, size_t count) {
+    if (!is_remote_fd(in_fd) && !is_remote_fd(out_fd)) {
+        return orig_sendfile(out_fd, in_fd, offset, count);
+    }
+    fprintf(stderr, "\nlib: sendfile system call - (%d) (%d) (%zu)\n", out_fd, in_fd, count);
+    return remote_copy(in_fd, offset, out_fd, NULL, count);
+}
+
+/**
+ * @brief sendfile() for callers built with 64 bit file offsets, off64_t
+ * is off_t here.
+ */
+ssize_t sendfile64(int out_fd, int in_fd, off64_t *offset, size_t count) {
+    return sendfile(out_fd, in_fd, (off_t *) offset, count);
+}
+
+/**
+ * @brief copy between two fds, at least one of them remote. An offset
+ * pointer is advanced past what was copied, a NULL one means the file
+ * offset, which is advanced instead.
+ *
+ * @param fd_in file descriptor to copy from
+ * @param off_in offset to copy from, NULL for the file offset
+ * @param fd_out file descriptor to copy to
+ * @param off_out offset to copy to, NULL for the file offset
+ * @param len count for bytes to copy
+ * @return bytes copied, -1 with errno set on error
+ */
+ssize_t remote_copy(int fd_in, off_t *off_in, int fd_out, off_t *off_out, size_t len) {
+    remote_file *in = is_remote_fd(fd_in) ? fd_table[fd_in] : NULL;
+    remote_file *out = is_remote_fd(fd_out) ? fd_table[fd_out] : NULL;
+    if ((in != NULL && open_failed(in)) || (out != NULL && open_failed(out))) {
+        return -1;
+    }
+    // content held here (a prefetched copy, a rewrite sent at close) or
+    // another server: through the client like read() and write()
+    if (in == NULL || out == NULL || in->shard != out->shard || in->cached != NULL || out->cached != NULL ||
+        in->delta || out->delta) {
+        return copy_through(fd_in, off_in, fd_out, off_out, len);
+    }
+    if (dedup_sync(in) < 0 || dedup_sync(out) < 0) {
+        return -1;
+    }
+    off_t from = off_in != NULL ? *off_in : in->offset;
+    off_t to = off_out != NULL ? *off_out : out->offset;
+    if (from < 0 || to < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    attr_cache_invalidate(out->path);
+    int new_err;
+    ssize_t r = resp_value(rpc_copy(in->shard, 0, in->remote_fd, from, out->remote_fd, to, len), sizeof(ssize_t),
+                           &new_err);
+    fprintf(stderr, "copy call finish: return %zd\n", r);
+    if (r > 0) {
+        if (off_in != NULL) {
+            *off_in += r;
+        } else {
+            in->offset += r;
+        }
+        if (off_out != NULL) {
+            *off_out += r;
+        } else {
+            out->offset += r;
+        }
+    } else if (r < 0) {
+        fprintf(stderr, "error in copy %s\n", strerror(new_err));
+        errno = new_err;
+        if (!open_failed(in)) {
+            open_failed(out);
+        }
+    }
+    return r;
+}
+
+/**
+ * @brief copy through a client buffer with the interposed calls, for
+ * fds that can't be copied on one server. The input offset moves by the
+ * bytes written, not the bytes read.
+ *
+ * @param fd_in file descriptor to copy from
+ * @param off_in offset to copy from, NULL for the file offset
+ * @param fd_out file descriptor to copy to
+ * @param off_out offset to copy to, NULL for the file offset
+ * @param len count for bytes to copy
+ * @return bytes copied, -1 with errno set if nothing was
+ */
+ssize_t copy_through(int fd_in, off_t *off_in, int fd_out, off_t *off_out, size_t len) {
+    char *buf = malloc(len < COPY_BUF ? len : COPY_BUF);
+    size_t done = 0;
+    ssize_t r = 0;
+    while (done < len && r >= 0) {
+        size_t n = len - done < COPY_BUF ? len - done : COPY_BUF;
+        struct iovec v = { buf, n };
+        r = off_in != NULL ? preadv(fd_in, &v, 1, *off_in) : read(fd_in, buf, n);
+        if (r <= 0) {
+            break;
+        }
+        size_t got = r;
+        size_t put = 0;
+        while (put < got) {
+            v.iov_base = buf + put;
+            v.iov_len = got - put;
+            r = off_out != NULL ? pwritev(fd_out, &v, 1, *off_out) : write(fd_out, buf + put, got - put);
+            if (r <= 0) {
+                r = -1;
+                break;
+            }
+            put += r;
+            if (off_out != NULL) {
+                *off_out += r;
+            }
+        }
+        // only what was written counts as copied, a read() past it is
+        // given back so the next call starts at the first unwritten byte
+        if (off_in != NULL) {
+            *off_in += put;
+        } else if (put < got && lseek(fd_in, (off_t) put - (off_t) got, SEEK_CUR) < 0) {
+            r = -1;
+        }
+        done += put;
+    }
+    free(buf);
+    return done > 0 ? (ssize_t) done : r;
+}
+
+/**
+ * @brief RPC call for remote lseek.
+ *
+ * lseek() repositions the file offset of the open file description
+ * associated with the file descriptor fd to the argument offset
+ * according to the directive whence.
+ *
+ * @param fd file descriptor
+ * @param offset offset bytes
+ * @param whence condition of offset
+ * @return Upon successful completion, lseek() returns the resulting
+ * offset location as measured in bytes from the beginning of the file.
+ * On error, the value (off_t) -1 is returned and errno is set to indicate
+ * the error.
+ */
+off_t lseek(int fd, off_t offset, int whence) {
+    fprintf(stderr, "\nlib: lseek system call - (%d) (-) (%d)\n", fd, whence);
+    if (!is_remote_fd(fd)) {
+        fprintf(stderr, "lib: lseek system call - local lseek\n");
+        return orig_lseek(fd, offset, whence);
+    }
+
+    // offset is tracked locally, only SEEK_END and SEEK_DATA/SEEK_HOLE
+    // (anything that needs the file size or its holes) ask the server
+    remote_file *file = fd_table[fd];
+    if (open_failed(file)) {
+        return -1;
+    }
+    if (whence == SEEK_SET || whence == SEEK_CUR) {
+        off_t r = whence == SEEK_SET ? offset : file->offset + offset;
+        if (r < 0) {
+            errno = EINVAL;
+            return -1;
+        }
+        file->offset = r;
+        fprintf(stderr, "lseek call finish locally: return %ld\n", r);
+        return r;
+    }
+
+    if (file->delta || file->cached != NULL) {
+        // the whole file is here, without holes
+        off_t len = file->delta ? file->wbuf_len : file->cached_len;
+        off_t r;
+        if (whence == SEEK_END) {
+            r = len + offset;
+        } else if (whence == SEEK_DATA || whence == SEEK_HOLE) {
+            if (offset < 0 || offset >= len) {
+                errno = ENXIO;
+                return -1;
+            }
+            r = whence == SEEK_DATA ? offset : len;
+        } else {
+            r = -1;
+        }
+        if (r < 0) {
+            errno = EINVAL;
+            return -1;
+        }
+        file->offset = r;
+        return r;
+    }
+    if (dedup_sync(file) < 0) {
+        return -1;
+    }
+    int new_err;
+    off_t r = resp_value(rpc_lseek(file->shard, 0, file->remote_fd, offset, whence), sizeof(off_t), &new_err);
+
+    fprintf(stderr, "lseek call finish: return %ld\n", r);
+    if (r >= 0) {
+        file->offset = r;
+    }
+    if (r < 0) {
+        fprintf(stderr, "error in lseek %s\n", strerror(new_err));
+        errno = new_err;
+        open_failed(file);
+    }
+    return r;
+}
+
+/**
+ * @brief RPC call for remote state.
+ *
+ * These functions return information about a file, in the buffer
+ * pointed to by statbuf.
+ *
+ * @param ver version
+ * @param path file path
+ * @param stat_buf buf to store data
+ * @return On success, zero is returned.  On error, -1 is returned,
+ * and errno is set to indicate the error.
+ */
+int __xstat(int ver, const char *path, struct stat *stat_buf) {
+    fprintf(stderr, "\nlib: __xstat system call - (%d) (%s)\n", ver, path);
+    dedup_sync_path(path);
+    if (attr_cache_get(path, stat_buf, false)) {
+        fprintf(stderr, "__xstat call finish from cache\n");
+        return 0;
+    }
+    return rpc_stat(ver, path, stat_buf);
+}
+
+/**
+ * @brief send stat request, the result goes into the attribute cache.
+ *
+ * @param ver version
+ * @param path file path
+ * @param stat_buf buf to store data
+ * @return return value of the stat on the server, errno is set on error
+ */
+int rpc_stat(int ver, const char *path, struct stat *stat_buf) {
+    struct rpc_frame* frame = malloc(sizeof(rpc_resp));
+    frame->opcode = OP_STAT;
 
     // build op message
     frame->payload = malloc(BUFFERLEN);
-    frame->payload_size = call_stat_marshal(frame->payload, ver, path);
+    int sh = route_path(path);
+    u_int32_t watch = callback_watch(sh);
+    frame->payload_size = call_stat_marshal(frame->payload, ver, path, watch);
 
     // build rpc frame
     char *rpc_buf = malloc(BUFFERLEN);
     size_t frame_size = marshal_frame(rpc_buf, frame);
 
-    // send rpc frame
+    // send rpc frame, any replica can answer
     fprintf(stderr, "lib: __xstat system call - sending request size %zu\n", frame_size);
-    rpc_resp * resp = send_request(rpc_buf, frame_size);
+    char *msgs[MAX_REPLICAS];
+    size_t sizes[MAX_REPLICAS];
+    int i;
+    for (i = 0; i < MAX_REPLICAS; i++) {
+        msgs[i] = rpc_buf;
+        sizes[i] = frame_size;
+    }
+    rpc_resp * resp = send_hedged(sh, LAT_STAT, msgs, sizes, NULL);
 
     // handle response
     int r;
+    u_int32_t promised;
     int new_err = resp->err_no;
     size_t off = mem_read_int32(resp->data, 0, (u_int32_t *) &r);
     if (r >= 0) {
-        mem_read_data(resp->data, off, stat_buf, sizeof(struct stat));
+        off = mem_read_data(resp->data, off, stat_buf, sizeof(struct stat));
+        mem_read_int32(resp->data, off, &promised);
+        attr_cache_put(path, stat_buf, promised ? sh : -1);
     }
     // free resources
     free(resp->data);
@@ -404,6 +1419,8 @@ int __xstat(int ver, const char *path, struct stat *stat_buf) {
  */
 int unlink(const char *pathname){
     fprintf(stderr, "\nmylib: unlink called for path %s \n", pathname);
+    attr_cache_invalidate(pathname);
+    dedup_sync_path(pathname);
     struct rpc_frame* frame = malloc(sizeof(rpc_resp));
     frame->opcode = OP_UNLINK;
 
@@ -417,7 +1434,7 @@ int unlink(const char *pathname){
 
     // send rpc frame
     fprintf(stderr, "lib: unlink system call - sending request size %zu\n", frame_size);
-    rpc_resp * resp = send_request(rpc_buf, frame_size);
+    rpc_resp * resp = send_request(route_path(pathname), rpc_buf, frame_size);
 
     // handle response
     int r;
@@ -456,178 +1473,2629 @@ int unlink(const char *pathname){
  */
 ssize_t getdirentries(int fd, char *buf, size_t nbytes, off_t *basep) {
     fprintf(stderr, "\nmylib: getdirentries called for path %d \n", fd);
-    if (opened_fd == 0) {
-        errno = EBADF;
+    if (!is_remote_fd(fd)) {
+        fprintf(stderr, "lib: getdirentries system call - local getdirentries\n");
+        return orig_getdirentries(fd, buf, nbytes, basep);
+    }
+
+    // entries come from the local readdirplus batch, refilled when it is
+    // used up or the caller moved the position with lseek()
+    remote_file *file = fd_table[fd];
+    if (open_failed(file)) {
         return -1;
     }
-    struct rpc_frame* frame = malloc(sizeof(rpc_resp));
-    frame->opcode = OP_GETDIR;
+    if (file->cached != NULL) {
+        errno = ENOTDIR;
+        return -1;
+    }
+    if (file->dir_buf == NULL || file->dir_at != file->offset || file->dir_pos >= file->dir_len) {
+        if (readdirplus_fetch(file) < 0) {
+            open_failed(file);
+            return -1;
+        }
+    }
 
-    // build op message
-    frame->payload = malloc(BUFFERLEN);
-    frame->payload_size = call_getdirentries_marshal(frame->payload, fd, nbytes, *basep);
+    // copy whole records only
+    size_t r = 0;
+    off_t next = file->offset;
+    while (file->dir_pos < file->dir_len) {
+        struct dirent *ent = (struct dirent *) (file->dir_buf + file->dir_pos);
+        if (r + ent->d_reclen > nbytes) {
+            break;
+        }
+        r = mem_write_data(buf, r, ent, ent->d_reclen);
+        file->dir_pos += ent->d_reclen;
+        next = ent->d_off;
+    }
+    if (r == 0 && file->dir_pos < file->dir_len) {
+        // buffer too small for the next entry
+        errno = EINVAL;
+        return -1;
+    }
 
-    // build rpc frame
-    char *rpc_buf = malloc(BUFFERLEN);
-    size_t frame_size = marshal_frame(rpc_buf, frame);
+    // like glibc, basep is the position before this read
+    *basep = file->offset;
+    file->offset = next;
+    file->dir_at = next;
+    fprintf(stderr, "getdirentries call finish: return %zu\n", r);
+    return r;
+}
 
-    // send rpc frame
-    fprintf(stderr, "lib: getdirentries system call - sending request size %zu\n", frame_size);
-    rpc_resp * resp = send_request(rpc_buf, frame_size);
+/**
+ * @brief fetch the next readdirplus batch of a directory.
+ *
+ * One OP_DIRPLUS request returns up to DIRPLUS_BATCH bytes of dirents
+ * starting at the file's position, together with the stat of every
+ * entry, which goes into the attribute cache.
+ *
+ * @param file remote directory
+ * @return 0 on success, -1 with errno set on error
+ */
+int readdirplus_fetch(remote_file *file) {
+    // entries carry sizes, so held back writes go out first
+    dedup_sync_all();
+    rpc_resp * resp = rpc_readdirplus(file->shard, 0, file->remote_fd, file->offset, DIRPLUS_BATCH,
+                                      callback_watch(file->shard));
 
     // handle response
     ssize_t r;
     int new_err = resp->err_no;
     size_t off = mem_read_data(resp->data, 0, &r, sizeof(ssize_t));
-    off = mem_read_data(resp->data, off, basep, sizeof(off_t));
 
+    free(file->dir_buf);
+    file->dir_buf = NULL;
+    file->dir_len = 0;
+    file->dir_pos = 0;
+    file->dir_at = file->offset;
     if (r > 0) {
-        mem_read_data(resp->data, off, buf, r);
+        file->dir_buf = malloc(r);
+        file->dir_len = r;
+        off = mem_read_data(resp->data, off, file->dir_buf, r);
+
+        u_int32_t nent, promised;
+        off = mem_read_int32(resp->data, off, &nent);
+        // the promise comes after the entries
+        mem_read_int32(resp->data, off + nent * (sizeof(int) + sizeof(struct stat)), &promised);
+        char *path = malloc(strlen(file->path) + 2 + 256);
+        pf_dir *d = prefetch_budget > 0 ? pf_dir_listed(file) : NULL;
+        size_t pos = 0;
+        while (pos < file->dir_len) {
+            struct dirent *ent = (struct dirent *) (file->dir_buf + pos);
+            int sr;
+            struct stat st;
+            off = mem_read_int32(resp->data, off, (u_int32_t *) &sr);
+            off = mem_read_data(resp->data, off, &st, sizeof(struct stat));
+            if (sr == 0) {
+                sprintf(path, "%s/%s", file->path, ent->d_name);
+                attr_cache_put(path, &st, promised ? file->shard : -1);
+                if (d != NULL && S_ISREG(st.st_mode) && st.st_size <= PF_FILE_MAX) {
+                    pf_dir_add(d, ent->d_name, st.st_size);
+                }
+            }
+            pos += ent->d_reclen;
+        }
+        free(path);
     }
 
     free(resp->data);
     free(resp);
-    free(rpc_buf);
-    free(frame->payload);
-    free(frame);
 
-    fprintf(stderr, "getdirentries call finish: return %zd\n", r);
+    fprintf(stderr, "readdirplus finish: return %zd\n", r);
     if (r < 0) {
-        fprintf(stderr, "error in getdirentries %s\n", strerror(new_err));
+        fprintf(stderr, "error in readdirplus %s\n", strerror(new_err));
         errno = new_err;
+        return -1;
     }
-
-    return r;
+    return 0;
 }
 
 /**
- * @brief RPC call for remote getdirtree.
- *
- * Recusively descend through directory hierarchy starting at directory
- * indicated by path string. Allocates and constructs directory tree data
- * structure representing all of the directories in the hierarchy.
+ * @brief normalize a path for the attribute cache, collapsing repeated
+ * and trailing slashes.
  *
- * @param path file path
- * @return pointer to root node of directory tree structure or NULL if
- * there was en error (will set errno in this case)
+ * @param out output buffer, at least strlen(path) + 1 bytes
+ * @param path path
  */
-struct dirtreenode* getdirtree(const char *path) {
-    fprintf(stderr, "\nmylib: getdirtree called for path %s \n", path);
-    struct rpc_frame* frame = malloc(sizeof(rpc_resp));
-    frame->opcode = OP_GETTRR;
-
-    // build op message
-    frame->payload = malloc(BUFFERLEN);
-    frame->payload_size = call_dirtreenode_marshal(frame->payload, path);
-
-    // build rpc frame
-    char *rpc_buf = malloc(BUFFERLEN);
-    size_t frame_size = marshal_frame(rpc_buf, frame);
-
-    // send rpc frame
-    fprintf(stderr, "lib: getdirtree system call - sending request size %zu\n", frame_size);
-    rpc_resp * resp = send_request(rpc_buf, frame_size);
-
-    // handle response
-    struct dirtreenode* tree = malloc(sizeof(struct dirtreenode));
-    int new_err = resp->err_no;
-    u_int32_t r = resp->size;
-    if (r > 0) {
-        mem_read_tree(tree, resp->data, 0);
+void attr_path_normalize(char *out, const char *path) {
+    size_t n = 0;
+    const char *p;
+    for (p = path; *p; p++) {
+        if (*p == '/' && n > 0 && out[n - 1] == '/') {
+            continue;
+        }
+        out[n++] = *p;
     }
-
-    free(resp->data);
-    free(resp);
-    free(rpc_buf);
-    free(frame->payload);
-    free(frame);
-
-    fprintf(stderr, "getdirtree call finished: \n");
-
-    if (r == 0) {
-        fprintf(stderr, "error in getdirtree %s\n", strerror(new_err));
-        errno = new_err;
+    if (n > 1 && out[n - 1] == '/') {
+        --n;
     }
-
-    return tree;
+    out[n] = '\0';
+}
+
+/**
+ * @brief djb2 hash of a normalized path.
+ */
+unsigned long attr_hash(const char *path) {
+    unsigned long h = 5381;
+    while (*path) {
+        h = h * 33 + (unsigned char) *path++;
+    }
+    return h % ATTR_CACHE_BUCKETS;
+}
+
+/**
+ * @brief look up a path in the attribute cache. An entry under a callback
+ * is only trusted once the breaks already sent by its server are applied.
+ *
+ * @param path path
+ * @param st stat buffer, filled on hit
+ * @param held only take an entry under a callback, not one that expires
+ * @return true on a fresh hit
+ */
+bool attr_cache_get(const char *path, struct stat *st, bool held) {
+    char *key = malloc(strlen(path) + 1);
+    attr_path_normalize(key, path);
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    attr_entry *e;
+    bool hit = false;
+    unsigned long h = attr_hash(key);
+    pthread_mutex_lock(&attr_lock);
+    for (e = attr_cache[h]; e != NULL && strcmp(e->path, key) != 0; e = e->next) {
+    }
+    int shard = e != NULL ? e->shard : -1;
+    if (shard >= 0) {
+        // the entry may go with the breaks, look again afterwards; a
+        // connection in use gets them with its reply
+        pthread_mutex_unlock(&attr_lock);
+        replica *r = &shards[shard].r[0];
+        if (pthread_mutex_trylock(&r->lock) == 0) {
+            if (r->sockfd >= 0) {
+                // breaks may be queued behind replies to pipelined calls
+                owed_drain(r, true);
+                callback_drain(r->sockfd, false);
+            }
+            pthread_mutex_unlock(&r->lock);
+        }
+        pthread_mutex_lock(&attr_lock);
+        for (e = attr_cache[h]; e != NULL && strcmp(e->path, key) != 0; e = e->next) {
+        }
+    }
+    if (e != NULL && (e->shard >= 0 || (!held && e->expire > now.tv_sec))) {
+        memcpy(st, &e->st, sizeof(struct stat));
+        hit = true;
+    }
+    pthread_mutex_unlock(&attr_lock);
+    free(key);
+    return hit;
+}
+
+/**
+ * @brief add or refresh a path in the attribute cache. The cache is
+ * dropped as a whole when it grows past ATTR_CACHE_MAX entries.
+ *
+ * @param path path
+ * @param st stat result
+ * @param shard shard whose server holds a callback on it, -1 for none;
+ * those are only kept with attrcache15440
+ */
+void attr_cache_put(const char *path, const struct stat *st, int shard) {
+    char *key = malloc(strlen(path) + 1);
+    attr_path_normalize(key, path);
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    unsigned long h = attr_hash(key);
+    attr_entry *e;
+    attr_entry **prev = &attr_cache[h];
+    pthread_mutex_lock(&attr_lock);
+    for (e = attr_cache[h]; e != NULL; e = e->next) {
+        if (strcmp(e->path, key) == 0) {
+            break;
+        }
+        prev = &e->next;
+    }
+    if (shard < 0 && !attr_ttl_on) {
+        // nothing keeps it valid, an older entry goes too
+        if (e != NULL) {
+            *prev = e->next;
+            free(e->path);
+            free(e);
+            --attr_cache_size;
+        }
+        pthread_mutex_unlock(&attr_lock);
+        free(key);
+        return;
+    }
+    if (e == NULL) {
+        if (attr_cache_size >= ATTR_CACHE_MAX) {
+            size_t i;
+            for (i = 0; i < ATTR_CACHE_BUCKETS; i++) {
+                while (attr_cache[i] != NULL) {
+                    attr_entry *next = attr_cache[i]->next;
+                    free(attr_cache[i]->path);
+                    free(attr_cache[i]);
+                    attr_cache[i] = next;
+                }
+            }
+            attr_cache_size = 0;
+        }
+        e = malloc(sizeof(attr_entry));
+        e->path = key;
+        e->next = attr_cache[h];
+        attr_cache[h] = e;
+        ++attr_cache_size;
+    } else {
+        free(key);
+    }
+    memcpy(&e->st, st, sizeof(struct stat));
+    e->expire = now.tv_sec + ATTR_CACHE_TTL;
+    e->shard = shard;
+    pthread_mutex_unlock(&attr_lock);
+}
+
+/**
+ * @brief drop a path from the attribute cache.
+ *
+ * @param path path
+ */
+void attr_cache_invalidate(const char *path) {
+    char *key = malloc(strlen(path) + 1);
+    attr_path_normalize(key, path);
+    pthread_mutex_lock(&attr_lock);
+    attr_entry **prev = &attr_cache[attr_hash(key)];
+    while (*prev != NULL) {
+        attr_entry *e = *prev;
+        if (strcmp(e->path, key) == 0) {
+            *prev = e->next;
+            free(e->path);
+            free(e);
+            --attr_cache_size;
+            break;
+        }
+        prev = &e->next;
+    }
+    pthread_mutex_unlock(&attr_lock);
+    free(key);
+    if (pf_bytes > 0) {
+        pf_drop(path);
+    }
+}
+
+/**
+ * @brief drop the entries a server broke its callbacks on.
+ *
+ * @param shard shard of the server
+ * @param ids files whose callbacks are broken
+ * @param n number of files, 0 for every entry under the shard's callbacks
+ */
+void attr_cache_break(int shard, const file_id *ids, u_int32_t n) {
+    size_t i;
+    pthread_mutex_lock(&attr_lock);
+    for (i = 0; i < ATTR_CACHE_BUCKETS; i++) {
+        attr_entry **prev = &attr_cache[i];
+        while (*prev != NULL) {
+            attr_entry *e = *prev;
+            bool drop = e->shard == shard && n == 0;
+            u_int32_t k;
+            for (k = 0; e->shard == shard && k < n && !drop; k++) {
+                drop = e->st.st_dev == ids[k].dev && e->st.st_ino == ids[k].ino;
+            }
+            if (drop) {
+                *prev = e->next;
+                free(e->path);
+                free(e);
+                --attr_cache_size;
+            } else {
+                prev = &e->next;
+            }
+        }
+    }
+    pthread_mutex_unlock(&attr_lock);
+}
+
+/**
+ * @brief normalize a path for the prefetcher, like attr_path_normalize()
+ * and without a leading "./", so a name listed in "." matches the bare
+ * name it is opened with.
+ *
+ * @param out output buffer, at least strlen(path) + 1 bytes
+ * @param path path
+ */
+void pf_key(char *out, const char *path) {
+    attr_path_normalize(out, path);
+    while (out[0] == '.' && out[1] == '/') {
+        memmove(out, out + 2, strlen(out + 2) + 1);
+    }
+}
+
+/**
+ * @brief the prefetch record of a directory being listed, started over
+ * when the listing starts over. The PF_DIRS most recent ones are kept.
+ *
+ * @param file remote directory, at the position of the next batch
+ * @return its record
+ */
+pf_dir *pf_dir_listed(remote_file *file) {
+    char *key = malloc(strlen(file->path) + 1);
+    pf_key(key, file->path);
+    pf_dir *d = NULL;
+    int i;
+    for (i = 0; i < PF_DIRS; i++) {
+        if (pf_dirs[i].path != NULL && pf_dirs[i].shard == file->shard && strcmp(pf_dirs[i].path, key) == 0) {
+            d = &pf_dirs[i];
+            break;
+        }
+    }
+    if (d != NULL && file->offset > 0) {
+        // the next batch of a listing
+        free(key);
+        return d;
+    }
+    if (d == NULL) {
+        d = &pf_dirs[pf_next_dir++ % PF_DIRS];
+    }
+    for (i = 0; i < d->n; i++) {
+        free(d->names[i]);
+    }
+    free(d->path);
+    d->path = key;
+    d->shard = file->shard;
+    d->n = 0;
+    d->opens = 0;
+    return d;
+}
+
+/**
+ * @brief note a small regular file of a listed directory.
+ *
+ * @param d directory
+ * @param name entry name
+ * @param size file size
+ */
+void pf_dir_add(pf_dir *d, const char *name, off_t size) {
+    if (d->n == d->cap) {
+        d->cap = d->cap ? d->cap * 2 : 64;
+        d->names = realloc(d->names, sizeof(char *) * d->cap);
+        d->sizes = realloc(d->sizes, sizeof(off_t) * d->cap);
+        d->done = realloc(d->done, d->cap);
+    }
+    d->names[d->n] = strdup(name);
+    d->sizes[d->n] = size;
+    d->done[d->n] = 0;
+    ++d->n;
+}
+
+/**
+ * @brief open a file from the prefetch cache. An open of a file in a
+ * listed directory counts towards PF_TRIGGER, the one that reaches it
+ * fetches the file together with the rest of the directory's. A cached
+ * file is checked against a stat first, so a change since the fetch is
+ * read from the server.
+ *
+ * @param shard shard the path routes to
+ * @param pathname path as passed to open()
+ * @return local fd of a file served here, -1 to open it on the server
+ */
+int pf_open(int shard, const char *pathname) {
+    char *key = malloc(strlen(pathname) + 1);
+    pf_key(key, pathname);
+    pf_entry *e = pf_take(key);
+    if (e == NULL) {
+        char *slash = strrchr(key, '/');
+        const char *base = slash != NULL ? slash + 1 : key;
+        char *dir = slash == NULL ? strdup(".") : slash == key ? strdup("/") : strndup(key, slash - key);
+        int i, k;
+        for (i = 0; i < PF_DIRS; i++) {
+            pf_dir *d = &pf_dirs[i];
+            if (d->path == NULL || d->shard != shard || strcmp(d->path, dir) != 0) {
+                continue;
+            }
+            for (k = 0; k < d->n && strcmp(d->names[k], base) != 0; k++) {
+            }
+            if (k < d->n && !d->done[k]) {
+                d->done[k] = 1;
+                if (++d->opens >= PF_TRIGGER) {
+                    pf_fetch(d, k);
+                    e = pf_take(key);
+                }
+            }
+            break;
+        }
+        free(dir);
+    }
+    free(key);
+    if (e == NULL) {
+        return -1;
+    }
+    // serve it only if the file is still the one read: its stat under a
+    // callback, or a new one from the server, against the one of the read
+    struct stat st;
+    if ((!attr_cache_get(pathname, &st, true) && rpc_stat(STAT_VER, pathname, &st) < 0) ||
+        st.st_ino != e->st.st_ino || st.st_dev != e->st.st_dev || st.st_size != e->st.st_size ||
+        st.st_mtim.tv_sec != e->st.st_mtim.tv_sec || st.st_mtim.tv_nsec != e->st.st_mtim.tv_nsec) {
+        fprintf(stderr, "lib: prefetched %s changed, opening it on the server\n", pathname);
+        free(e->path);
+        free(e->data);
+        free(e);
+        return -1;
+    }
+
+    int fd = fd_table_insert(shard, -1, pathname);
+    if (fd >= 0) {
+        fd_table[fd]->cached = e->data;
+        fd_table[fd]->cached_len = e->len;
+        fd_table[fd]->clean = 1;
+    } else {
+        free(e->data);
+    }
+    free(e->path);
+    free(e);
+    return fd;
+}
+
+/**
+ * @brief fetch a batch of a listed directory's files into the prefetch
+ * cache with one OP_MREAD: the file first, then the ones not opened or
+ * fetched yet, as far as PF_BATCH_BYTES, PF_BATCH_FILES and what is left
+ * of prefetch_budget allow. Only one batch is in flight at a time, the
+ * caller waits for it.
+ *
+ * @param d directory
+ * @param first index of the file being opened
+ */
+void pf_fetch(pf_dir *d, int first) {
+    // held back writes go out first, the batch reads what the server has
+    dedup_sync_all();
+    pf_expire();
+    char *paths[PF_BATCH_FILES];
+    u_int32_t n = 0;
+    size_t bytes = 0;
+    size_t payload_size = 2 * sizeof(u_int32_t);
+    int k;
+    for (k = 0; k < d->n && n < PF_BATCH_FILES; k++) {
+        int i = (first + k) % d->n;
+        if (k > 0 && d->done[i]) {
+            continue;
+        }
+        if (bytes + d->sizes[i] > PF_BATCH_BYTES || pf_bytes + bytes + d->sizes[i] > prefetch_budget) {
+            break;
+        }
+        d->done[i] = 1;
+        paths[n] = malloc(strlen(d->path) + strlen(d->names[i]) + 2);
+        sprintf(paths[n], "%s/%s", d->path, d->names[i]);
+        payload_size += sizeof(u_int32_t) + strlen(paths[n]) + 1;
+        bytes += d->sizes[i];
+        ++n;
+    }
+    if (n == 0) {
+        return;
+    }
+
+    struct rpc_frame* frame = malloc(sizeof(rpc_resp));
+    frame->opcode = OP_MREAD;
+
+    // build op message
+    frame->payload = malloc(payload_size);
+    frame->payload_size = call_mread_marshal(frame->payload, (const char *const *) paths, n, PF_FILE_MAX);
+
+    // build rpc frame
+    char *rpc_buf = malloc(frame->payload_size + 2 * sizeof(u_int32_t));
+    size_t frame_size = marshal_frame(rpc_buf, frame);
+
+    // send rpc frame
+    fprintf(stderr, "lib: prefetch - %u files, %zu bytes from %s\n", n, bytes, d->path);
+    rpc_resp * resp = send_request(d->shard, rpc_buf, frame_size);
+
+    // handle response, [n][(err, stat, len, data) per file]
+    u_int32_t got = 0;
+    size_t off = resp->size >= sizeof(u_int32_t) ? mem_read_int32(resp->data, 0, &got) : 0;
+    u_int32_t i;
+    for (i = 0; i < got && i < n; i++) {
+        int e;
+        struct stat st;
+        u_int32_t len;
+        off = mem_read_int32(resp->data, off, (u_int32_t *) &e);
+        off = mem_read_data(resp->data, off, &st, sizeof(struct stat));
+        off = mem_read_int32(resp->data, off, &len);
+        if (e == 0) {
+            attr_cache_put(paths[i], &st, -1);
+            pf_put(paths[i], &st, resp->data + off, len);
+        }
+        off += len;
+    }
+
+    // free resources
+    for (i = 0; i < n; i++) {
+        free(paths[i]);
+    }
+    free(resp->data);
+    free(resp);
+    free(rpc_buf);
+    free(frame->payload);
+    free(frame);
+}
+
+/**
+ * @brief add a file's content to the prefetch cache.
+ *
+ * @param path path
+ * @param st stat of the file at the time of the read
+ * @param data content
+ * @param len bytes of content
+ */
+void pf_put(const char *path, const struct stat *st, const char *data, size_t len) {
+    pf_drop(path);
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    pf_entry *e = malloc(sizeof(pf_entry));
+    e->path = malloc(strlen(path) + 1);
+    pf_key(e->path, path);
+    e->data = malloc(len + 1);
+    memcpy(e->data, data, len);
+    e->len = len;
+    e->expire = now.tv_sec + ATTR_CACHE_TTL;
+    memcpy(&e->st, st, sizeof(struct stat));
+    unsigned long h = attr_hash(e->path);
+    e->next = pf_cache[h];
+    pf_cache[h] = e;
+    pf_bytes += len;
+}
+
+/**
+ * @brief take a file out of the prefetch cache, each fetch serves one open.
+ *
+ * @param key path normalized by pf_key()
+ * @return the entry, NULL if there is none or it expired
+ */
+pf_entry *pf_take(const char *key) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    pf_entry **prev = &pf_cache[attr_hash(key)];
+    while (*prev != NULL) {
+        pf_entry *e = *prev;
+        if (strcmp(e->path, key) == 0) {
+            *prev = e->next;
+            pf_bytes -= e->len;
+            if (e->expire > now.tv_sec) {
+                return e;
+            }
+            free(e->path);
+            free(e->data);
+            free(e);
+            return NULL;
+        }
+        prev = &e->next;
+    }
+    return NULL;
+}
+
+/**
+ * @brief drop a path from the prefetch cache.
+ *
+ * @param path path
+ */
+void pf_drop(const char *path) {
+    char *key = malloc(strlen(path) + 1);
+    pf_key(key, path);
+    pf_entry *e = pf_take(key);
+    if (e != NULL) {
+        free(e->path);
+        free(e->data);
+        free(e);
+    }
+    free(key);
+}
+
+/**
+ * @brief drop the expired entries of the prefetch cache, so files that are
+ * never opened don't hold on to the budget.
+ */
+void pf_expire() {
+    if (pf_bytes == 0) {
+        return;
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    size_t i;
+    for (i = 0; i < ATTR_CACHE_BUCKETS; i++) {
+        pf_entry **prev = &pf_cache[i];
+        while (*prev != NULL) {
+            pf_entry *e = *prev;
+            if (e->expire <= now.tv_sec) {
+                *prev = e->next;
+                pf_bytes -= e->len;
+                free(e->path);
+                free(e->data);
+                free(e);
+            } else {
+                prev = &e->next;
+            }
+        }
+    }
+}
+
+/**
+ * @brief read a prefetched file into iov.
+ *
+ * @param file remote file served from its cached content
+ * @param iov buffers to fill
+ * @param iovcnt number of buffers
+ * @param offset file offset to read from
+ * @return bytes read, 0 at end of file
+ */
+ssize_t cached_read(remote_file *file, const struct iovec *iov, int iovcnt, off_t offset) {
+    size_t done = 0;
+    int i;
+    for (i = 0; i < iovcnt && offset + done < file->cached_len; i++) {
+        size_t n = file->cached_len - offset - done;
+        n = n < iov[i].iov_len ? n : iov[i].iov_len;
+        memcpy(iov[i].iov_base, file->cached + offset + done, n);
+        done += n;
+    }
+    return done;
+}
+
+/**
+ * @brief whether to ask a shard's server for callbacks. Only a direct
+ * connection to the one server of a shard can keep the promise: writes
+ * through another replica or a broker's shared session are not reported.
+ *
+ * @param shard shard
+ * @return true to ask
+ */
+bool callback_watch(int shard) {
+    return callbacks_on && broker_path == NULL && shards[shard].nreplicas == 1;
+}
+
+/**
+ * @brief apply the callback breaks a server pushed ahead of the next
+ * reply on a connection. The caller holds the replica's lock.
+ *
+ * @param sockfd socket fd
+ * @param wait block until the next frame starts, otherwise only take
+ * what has arrived
+ */
+void callback_drain(int sockfd, bool wait) {
+    int i, word;
+    if (!callbacks_on) {
+        return;
+    }
+    for (i = 0; i < nshards && shards[i].r[0].sockfd != sockfd; i++) {
+    }
+    if (i == nshards || !callback_watch(i)) {
+        return;
+    }
+    while (1) {
+        ssize_t rv = recv(sockfd, &word, sizeof(int), MSG_PEEK | (wait ? MSG_WAITALL : MSG_DONTWAIT));
+        if (rv < (ssize_t) sizeof(int)) {
+            // the server, or the broker in front of it, hung up
+            if (wait) err(1, 0);
+            return;
+        }
+        if (!(word & FRAME_CALLBACK)) {
+            return;
+        }
+        recv_all(sockfd, &word, sizeof(int));
+        char *buf = malloc(FRAME_SIZE(word));
+        recv_all(sockfd, buf, FRAME_SIZE(word));
+        u_int32_t n;
+        file_id *ids = callback_unmarshal(buf, &n);
+        fprintf(stderr, "lib: %u callback breaks from shard [%d]\n", n, i);
+        attr_cache_break(i, ids, n);
+        free(ids);
+        free(buf);
+    }
+}
+
+/**
+ * @brief RPC call for remote getdirtree.
+ *
+ * Recusively descend through directory hierarchy starting at directory
+ * indicated by path string. Allocates and constructs directory tree data
+ * structure representing all of the directories in the hierarchy.
+ *
+ * @param path file path
+ * @return pointer to root node of directory tree structure or NULL if
+ * there was en error (will set errno in this case)
+ */
+struct dirtreenode* getdirtree(const char *path) {
+    fprintf(stderr, "\nmylib: getdirtree called for path %s \n", path);
+
+    int owner = route_path(path);
+    struct dirtreenode *tree = shard_dirtree(owner, path);
+    if (tree == NULL || nshards == 1) {
+        return tree;
+    }
+
+    // shards owning directories below the root are grafted in, shallower
+    // prefixes first so deeper ones replace what they cover
+    char *root = malloc(strlen(path) + 1);
+    attr_path_normalize(root, path);
+    int i, j;
+    int order[MAX_SHARDS];
+    int n = 0;
+    for (i = 0; i < nshards; i++) {
+        if (i == owner || shards[i].prefix == NULL || strcmp(shards[i].prefix, root) == 0 ||
+            !path_under(shards[i].prefix, root)) {
+            continue;
+        }
+        for (j = n; j > 0 && strlen(shards[order[j - 1]].prefix) > strlen(shards[i].prefix); j--) {
+            order[j] = order[j - 1];
+        }
+        order[j] = i;
+        ++n;
+    }
+    for (i = 0; i < n; i++) {
+        const char *prefix = shards[order[i]].prefix;
+        struct dirtreenode *sub = shard_dirtree(order[i], prefix);
+        if (sub == NULL) {
+            continue;
+        }
+        const char *rel = prefix + strlen(root);
+        while (*rel == '/') ++rel;
+        tree_graft(tree, rel, sub);
+    }
+    free(root);
+    return tree;
+}
+
+/**
+ * @brief fetch the tree below path from one shard.
+ *
+ * @param shard shard to ask
+ * @param path root of the tree
+ * @return a copy of the tree, or NULL with errno set on error
+ */
+struct dirtreenode* shard_dirtree(int shard, const char *path) {
+    // the last tree of this root is kept, the server only sends what
+    // changed since that version
+    tree_cache *cache;
+    for (cache = tree_list; cache != NULL; cache = cache->next) {
+        if (cache->shard == shard && strcmp(cache->path, path) == 0) {
+            break;
+        }
+    }
+    if (cache == NULL) {
+        cache = malloc(sizeof(tree_cache));
+        cache->shard = shard;
+        cache->path = strdup(path);
+        cache->hash = 0;
+        cache->tree = NULL;
+        cache->next = tree_list;
+        tree_list = cache;
+    }
+
+    int r = treev_fetch(cache, cache->hash);
+    if (r > 0) {
+        // delta did not reproduce the server's tree, start over
+        r = treev_fetch(cache, 0);
+    }
+    if (r < 0) {
+        return NULL;
+    }
+    fprintf(stderr, "getdirtree call finished: \n");
+    return tree_copy(cache->tree);
+}
+
+/**
+ * @brief put a subtree at a path relative to root, replacing whatever is
+ * there and creating missing directories on the way.
+ *
+ * @param root tree to graft into
+ * @param path names joined by '/'
+ * @param sub subtree, owned by root afterwards
+ */
+void tree_graft(struct dirtreenode *root, const char *path, struct dirtreenode *sub) {
+    struct dirtreenode *node = root;
+    const char *p = path;
+    while (*p) {
+        const char *end = strchr(p, '/');
+        size_t len = end ? (size_t) (end - p) : strlen(p);
+        int i;
+        for (i = 0; i < node->num_subdirs; i++) {
+            if (strlen(node->subdirs[i]->name) == len && strncmp(node->subdirs[i]->name, p, len) == 0) {
+                break;
+            }
+        }
+        if (end == NULL) {
+            // last name, the subtree goes here under that name
+            free(sub->name);
+            sub->name = strndup(p, len);
+            if (i < node->num_subdirs) {
+                freedirtree(node->subdirs[i]);
+            } else {
+                node->subdirs = realloc(node->subdirs, sizeof(struct dirtreenode *) * (node->num_subdirs + 1));
+                ++node->num_subdirs;
+            }
+            node->subdirs[i] = sub;
+            return;
+        }
+        if (i == node->num_subdirs) {
+            struct dirtreenode *dir = malloc(sizeof(struct dirtreenode));
+            dir->name = strndup(p, len);
+            dir->num_subdirs = 0;
+            dir->subdirs = NULL;
+            node->subdirs = realloc(node->subdirs, sizeof(struct dirtreenode *) * (node->num_subdirs + 1));
+            node->subdirs[node->num_subdirs++] = dir;
+        }
+        node = node->subdirs[i];
+        p = end + 1;
+    }
+    freedirtree(sub);
+}
+
+/**
+ * @brief send OP_TREEV for a cached root and bring the cache up to date.
+ *
+ * @param cache cached root
+ * @param have version the server may diff against, 0 for a full tree
+ * @return 0 on success, 1 if a delta left the tree at the wrong version,
+ * -1 with errno set on error
+ */
+int treev_fetch(tree_cache *cache, u_int64_t have) {
+    struct rpc_frame* frame = malloc(sizeof(rpc_resp));
+    frame->opcode = OP_TREEV;
+
+    // build op message
+    frame->payload = malloc(BUFFERLEN);
+    frame->payload_size = call_treev_marshal(frame->payload, cache->path, have);
+
+    // build rpc frame
+    char *rpc_buf = malloc(BUFFERLEN);
+    size_t frame_size = marshal_frame(rpc_buf, frame);
+
+    // send rpc frame
+    fprintf(stderr, "lib: getdirtree system call - sending request size %zu\n", frame_size);
+    rpc_resp * resp = send_request(cache->shard, rpc_buf, frame_size);
+
+    // handle response
+    int r = 0;
+    int new_err = resp->err_no;
+    if (resp->size == 0) {
+        r = -1;
+    } else {
+        u_int32_t kind;
+        u_int64_t hash = cache->hash;
+        size_t off = mem_read_int32(resp->data, 0, &kind);
+        if (kind != TREE_UNCHANGED) {
+            off = mem_read_data(resp->data, off, &hash, sizeof(u_int64_t));
+        }
+        if (kind == TREE_FULL) {
+            if (cache->tree != NULL) freedirtree(cache->tree);
+            cache->tree = malloc(sizeof(struct dirtreenode));
+            mem_read_tree(cache->tree, resp->data, off);
+        } else if (kind == TREE_DELTA) {
+            u_int32_t nops, i;
+            off = mem_read_int32(resp->data, off, &nops);
+            fprintf(stderr, "lib: getdirtree - applying %u changes\n", nops);
+            for (i = 0; i < nops; i++) {
+                off = tree_apply(cache->tree, resp->data, off);
+            }
+            if (tree_hash(cache->tree) != hash) {
+                r = 1;
+            }
+        }
+        cache->hash = hash;
+        fprintf(stderr, "lib: getdirtree - reply kind %u\n", kind);
+    }
+
+    free(resp->data);
+    free(resp);
+    free(rpc_buf);
+    free(frame->payload);
+    free(frame);
+
+    if (r < 0) {
+        fprintf(stderr, "error in getdirtree %s\n", strerror(new_err));
+        errno = new_err;
+    }
+    return r;
+}
+
+/**
+ * @brief apply one OP_TREEV delta op to a tree.
+ *
+ * @param root root of the cached tree
+ * @param buf reply data
+ * @param off offset of the op in buf
+ * @return offset after the op
+ */
+size_t tree_apply(struct dirtreenode *root, const char *buf, size_t off) {
+    u_int32_t type, path_len, index;
+    off = mem_read_int32(buf, off, &type);
+    off = mem_read_int32(buf, off, &path_len);
+    char *path = malloc(path_len);
+    off = mem_read_data(buf, off, path, path_len);
+    off = mem_read_int32(buf, off, &index);
+
+    if (type == TREE_OP_DEL) {
+        // path names the subtree, split off its parent
+        char *name = strrchr(path, '/');
+        struct dirtreenode *parent = root;
+        if (name != NULL) {
+            *name++ = '\0';
+            parent = tree_find(root, path);
+        } else {
+            name = path;
+        }
+        int i;
+        for (i = 0; parent != NULL && i < parent->num_subdirs; i++) {
+            if (strcmp(parent->subdirs[i]->name, name) == 0) {
+                freedirtree(parent->subdirs[i]);
+                memmove(parent->subdirs + i, parent->subdirs + i + 1,
+                        sizeof(struct dirtreenode *) * (parent->num_subdirs - i - 1));
+                --parent->num_subdirs;
+                break;
+            }
+        }
+    } else {
+        // path names the parent, the subtree goes in at index
+        struct dirtreenode *node = malloc(sizeof(struct dirtreenode));
+        off = mem_read_tree(node, buf, off);
+        struct dirtreenode *parent = tree_find(root, path);
+        if (parent == NULL) {
+            freedirtree(node);
+        } else {
+            if (index > parent->num_subdirs) {
+                index = parent->num_subdirs;
+            }
+            parent->subdirs = realloc(parent->subdirs, sizeof(struct dirtreenode *) * (parent->num_subdirs + 1));
+            memmove(parent->subdirs + index + 1, parent->subdirs + index,
+                    sizeof(struct dirtreenode *) * (parent->num_subdirs - index));
+            parent->subdirs[index] = node;
+            ++parent->num_subdirs;
+        }
+    }
+    free(path);
+    return off;
+}
+
+/**
+ * @brief find a node by its path relative to the root.
+ *
+ * @param root root of the tree
+ * @param path names joined by '/', "" for the root itself
+ * @return the node, or NULL if there is none
+ */
+struct dirtreenode* tree_find(struct dirtreenode *root, const char *path) {
+    struct dirtreenode *node = root;
+    const char *p = path;
+    while (node != NULL && *p) {
+        const char *end = strchr(p, '/');
+        size_t len = end ? (size_t) (end - p) : strlen(p);
+        struct dirtreenode *next = NULL;
+        int i;
+        for (i = 0; i < node->num_subdirs; i++) {
+            if (strlen(node->subdirs[i]->name) == len && strncmp(node->subdirs[i]->name, p, len) == 0) {
+                next = node->subdirs[i];
+                break;
+            }
+        }
+        node = next;
+        p += len;
+        if (*p == '/') ++p;
+    }
+    return node;
+}
+
+/**
+ * @brief deep copy a tree, the caller frees it with freedirtree().
+ *
+ * @param tree tree to copy
+ * @return the copy
+ */
+struct dirtreenode* tree_copy(const struct dirtreenode *tree) {
+    struct dirtreenode *copy = malloc(sizeof(struct dirtreenode));
+    copy->name = strdup(tree->name);
+    copy->num_subdirs = tree->num_subdirs;
+    copy->subdirs = malloc(sizeof(struct dirtreenode *) * tree->num_subdirs);
+    int i;
+    for (i = 0; i < tree->num_subdirs; i++) {
+        copy->subdirs[i] = tree_copy(tree->subdirs[i]);
+    }
+    return copy;
 }
 
 /**
  * @brief RPC call for remote freedirtree (executed locally).
  *
- * Recursively frees the memory used to hold the directory tree structures,
- * including the name strings, pointer arrays, and dirtreenode structures.
+ * Recursively frees the memory used to hold the directory tree structures,
+ * including the name strings, pointer arrays, and dirtreenode structures.
+ *
+ * @param dt dirtreenode struct
+ */
+void freedirtree(struct dirtreenode* dt) {
+    size_t i;
+    for (i = 0; i < dt->num_subdirs; i++) {
+        freedirtree(dt->subdirs[i]);
+    }
+    free(dt->name);
+    free(dt->subdirs);
+    free(dt);
+}
+
+/**
+ * @brief RPC backed mmap for remote files.
+ *
+ * A remote mapping is an anonymous mapping registered with userfaultfd.
+ * Missing pages are fetched by fault_handler() through OP_PGREAD, with
+ * read-ahead, and dirty pages of shared writable mappings are written
+ * back with OP_PWRITE on msync()/munmap(). Without userfaultfd the whole
+ * range is read eagerly instead.
+ *
+ * @param addr hint or fixed address
+ * @param length length of the mapping
+ * @param prot memory protection
+ * @param flags mapping flags
+ * @param fd file descriptor
+ * @param offset file offset, must be a multiple of the page size
+ * @return On success, mmap() returns a pointer to the mapped area. On
+ * error, the value MAP_FAILED is returned, and errno is set to indicate
+ * the error.
+ */
+void *mmap(void *addr, size_t length, int prot, int flags, int fd, off_t offset) {
+    if ((flags & MAP_ANONYMOUS) || !is_remote_fd(fd)) {
+        return orig_mmap(addr, length, prot, flags, fd, offset);
+    }
+    fprintf(stderr, "\nlib: mmap system call - (%d) (%zu) (%ld)\n", fd, length, offset);
+    if (length == 0 || offset % page_size != 0) {
+        errno = EINVAL;
+        return MAP_FAILED;
+    }
+
+    remote_file *file = fd_table[fd];
+    if (open_failed(file) || dedup_sync(file) < 0) {
+        return MAP_FAILED;
+    }
+    if (file->cached != NULL) {
+        // a private copy of the prefetched content, nothing to fault in
+        if ((flags & MAP_SHARED) && (prot & PROT_WRITE)) {
+            errno = EACCES;
+            return MAP_FAILED;
+        }
+        char *area = orig_mmap(addr, length, prot | PROT_WRITE,
+                               MAP_PRIVATE | MAP_ANONYMOUS | (flags & (MAP_FIXED | MAP_FIXED_NOREPLACE)), -1, 0);
+        if (area == MAP_FAILED) {
+            return MAP_FAILED;
+        }
+        struct iovec v = { area, length };
+        cached_read(file, &v, 1, offset);
+        if (!(prot & PROT_WRITE)) {
+            mprotect(area, length, prot);
+        }
+        return area;
+    }
+    // also settles an open still in flight, faults use the fd it got
+    int new_err;
+    off_t file_size = resp_value(rpc_lseek(file->shard, 0, file->remote_fd, 0, SEEK_END), sizeof(off_t), &new_err);
+    if (file_size < 0) {
+        errno = new_err;
+        open_failed(file);
+        return MAP_FAILED;
+    }
+
+    size_t len = (length + page_size - 1) / page_size * page_size;
+    int area_flags = MAP_PRIVATE | MAP_ANONYMOUS | (flags & (MAP_FIXED | MAP_FIXED_NOREPLACE));
+    char *area = orig_mmap(addr, len, prot, area_flags, -1, 0);
+    if (area == MAP_FAILED) {
+        return MAP_FAILED;
+    }
+
+    remote_map *map = malloc(sizeof(remote_map));
+    map->addr = area;
+    map->length = len;
+    map->npages = len / page_size;
+    map->offset = offset;
+    map->file_size = file_size;
+    map->prot = prot;
+    map->track_dirty = (flags & MAP_SHARED) && (prot & PROT_WRITE);
+    map->file = file;
+    map->present = calloc(map->npages, 1);
+    map->dirty = calloc(map->npages, 1);
+    map->mapped = malloc(map->npages);
+    memset(map->mapped, 1, map->npages);
+    map->live = map->npages;
+    map->users = 0;
+    ++file->refs;
+
+    if (uffd_register(map) < 0) {
+        fprintf(stderr, "lib: mmap system call - no userfaultfd, reading eagerly\n");
+        if (map_load_all(map) < 0) {
+            int load_err = errno;
+            orig_munmap(area, len);
+            remote_file_release(file, &new_err);
+            free(map->present);
+            free(map->dirty);
+            free(map->mapped);
+            free(map);
+            errno = load_err;
+            return MAP_FAILED;
+        }
+    }
+
+    pthread_mutex_lock(&map_lock);
+    map->next = map_list;
+    map_list = map;
+    pthread_mutex_unlock(&map_lock);
+
+    fprintf(stderr, "lib: mmap system call - mapped at %p\n", area);
+    return area;
+}
+
+/**
+ * @brief RPC backed munmap for remote mappings.
+ *
+ * Dirty pages in the range are written back first. The range may be any
+ * part of a mapping; the remote file is released once no page of the
+ * mapping is left.
+ *
+ * @param addr start of the range
+ * @param length length of the range
+ * @return On success, munmap() returns 0. On failure, it returns -1,
+ * and errno is set to indicate the error.
+ */
+int munmap(void *addr, size_t length) {
+    size_t n, i;
+    remote_map **maps = map_hold(addr, length, &n);
+    if (n > 0) {
+        fprintf(stderr, "\nlib: munmap system call - (%p) (%zu)\n", addr, length);
+    }
+    for (i = 0; i < n; i++) {
+        if (map_write_back(maps[i], addr, length) < 0) {
+            // the pages are gone after the unmap, the next call on the
+            // file reports it
+            maps[i]->file->wbuf_err = EIO;
+        }
+    }
+    int r = orig_munmap(addr, length);
+    map_unhold(maps, n, r == 0 ? addr : NULL, length);
+    return r;
+}
+
+/**
+ * @brief RPC backed msync for remote mappings.
+ *
+ * Dirty pages of shared writable remote mappings in the range are
+ * written back to the server.
+ *
+ * @param addr start of the range
+ * @param length length of the range
+ * @param flags MS_ASYNC, MS_SYNC, MS_INVALIDATE
+ * @return On success, zero is returned. On error, -1 is returned, and
+ * errno is set to indicate the error.
+ */
+int msync(void *addr, size_t length, int flags) {
+    size_t n, i;
+    remote_map **maps = map_hold(addr, length, &n);
+    if (n == 0) {
+        free(maps);
+        return orig_msync(addr, length, flags);
+    }
+    fprintf(stderr, "\nlib: msync system call - (%p) (%zu)\n", addr, length);
+    int r = 0;
+    for (i = 0; i < n; i++) {
+        if (map_write_back(maps[i], addr, length) < 0) {
+            r = -1;
+        }
+    }
+    map_unhold(maps, n, NULL, 0);
+    if (r < 0) {
+        errno = EIO;
+    }
+    return r;
+}
+
+/**
+ * @brief take a reference on every remote mapping with pages in a range,
+ * so it can be worked on without map_lock.
+ *
+ * @param addr start of the range
+ * @param length length of the range
+ * @param n set to the number of mappings found
+ * @return array of the mappings, release with map_unhold()
+ */
+remote_map **map_hold(const char *addr, size_t length, size_t *n) {
+    size_t cap = 4;
+    remote_map **maps = malloc(sizeof(remote_map *) * cap);
+    remote_map *map;
+    *n = 0;
+    pthread_mutex_lock(&map_lock);
+    for (map = map_list; map != NULL; map = map->next) {
+        if (map->live == 0 || addr >= map->addr + map->length || addr + length <= map->addr) {
+            continue;
+        }
+        if (*n == cap) {
+            cap *= 2;
+            maps = realloc(maps, sizeof(remote_map *) * cap);
+        }
+        ++map->users;
+        maps[(*n)++] = map;
+    }
+    pthread_mutex_unlock(&map_lock);
+    return maps;
+}
+
+/**
+ * @brief drop references taken by map_hold(), and free the mappings that
+ * have no page left.
+ *
+ * @param maps mappings
+ * @param n number of mappings
+ * @param unmapped start of a range just unmapped, or NULL
+ * @param length length of that range
+ */
+void map_unhold(remote_map **maps, size_t n, const char *unmapped, size_t length) {
+    size_t i, j;
+    pthread_mutex_lock(&map_lock);
+    for (i = 0; i < n; i++) {
+        remote_map *map = maps[i];
+        if (unmapped != NULL) {
+            size_t first = unmapped <= map->addr ? 0 : (unmapped - map->addr) / page_size;
+            size_t last = unmapped + length >= map->addr + map->length ?
+                          map->npages : (unmapped + length - map->addr + page_size - 1) / page_size;
+            for (j = first; j < last; j++) {
+                map->live -= map->mapped[j];
+                map->mapped[j] = 0;
+            }
+        }
+        maps[i] = NULL;
+        if (--map->users == 0 && map->live == 0) {
+            remote_map **prev = &map_list;
+            while (*prev != map) {
+                prev = &(*prev)->next;
+            }
+            *prev = map->next;
+            maps[i] = map;
+        }
+    }
+    pthread_mutex_unlock(&map_lock);
+    // release outside the lock, the close is an RPC
+    for (i = 0; i < n; i++) {
+        if (maps[i] != NULL) {
+            int new_err;
+            remote_file_release(maps[i]->file, &new_err);
+            free(maps[i]->present);
+            free(maps[i]->dirty);
+            free(maps[i]->mapped);
+            free(maps[i]);
+        }
+    }
+    free(maps);
+}
+
+/**
+ * @brief find the remote mapping containing an address, map_lock held.
+ *
+ * @param addr address
+ * @return the mapping, or NULL if addr is not in a remote mapping
+ */
+remote_map *map_find(const char *addr) {
+    remote_map *map;
+    for (map = map_list; map != NULL; map = map->next) {
+        if (addr >= map->addr && addr < map->addr + map->length &&
+            map->mapped[(addr - map->addr) / page_size]) {
+            return map;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief fetch pages of a mapping from the server.
+ *
+ * @param map remote mapping
+ * @param first first page index in the mapping
+ * @param npages number of pages
+ * @param out page aligned buffer of npages pages, tail past EOF is zeroed
+ * @return 0 on success, -1 with errno set on error
+ */
+int map_fetch(remote_map *map, size_t first, size_t npages, char *out) {
+    off_t file_page = map->offset / page_size + first;
+    rpc_resp * resp = rpc_pgread(map->file->shard, 0, map->file->remote_fd, file_page, npages, page_size);
+
+    // handle response
+    ssize_t r;
+    size_t off = mem_read_data(resp->data, 0, &r, sizeof(ssize_t));
+    if (r > 0) {
+        mem_read_data(resp->data, off, out, r);
+    }
+    memset(out + (r > 0 ? r : 0), 0, npages * page_size - (r > 0 ? r : 0));
+    if (r < 0) {
+        errno = resp->err_no;
+    }
+
+    free(resp->data);
+    free(resp);
+    return r < 0 ? -1 : 0;
+}
+
+/**
+ * @brief fault in the pages of remote mappings under an iovec table. The
+ * kernel must not fault on them in sendmsg()/recvmsg() while a
+ * connection's lock is held, fetching them takes that lock.
+ *
+ * @param iov buffers about to be sent from or received into
+ * @param iovcnt number of buffers
+ */
+void map_touch(const struct iovec *iov, int iovcnt) {
+    int i;
+    for (i = 0; i < iovcnt; i++) {
+        const char *start = iov[i].iov_base;
+        const char *end = start + iov[i].iov_len;
+        size_t n, k;
+        remote_map **maps = map_hold(start, iov[i].iov_len, &n);
+        for (k = 0; k < n; k++) {
+            remote_map *map = maps[k];
+            if (!(map->prot & PROT_READ)) {
+                continue;
+            }
+            size_t page = start <= map->addr ? 0 : (start - map->addr) / page_size;
+            size_t last = end >= map->addr + map->length ?
+                          map->npages : (end - map->addr + page_size - 1) / page_size;
+            for (; page < last; page++) {
+                const char *p = map->addr + page * page_size;
+                if (map->mapped[page]) {
+                    (void) *(volatile const char *) (p < start ? start : p);
+                }
+            }
+        }
+        map_unhold(maps, n, NULL, 0);
+    }
+}
+
+/**
+ * @brief write dirty pages of a mapping in a range back to the server,
+ * with a reference held and map_lock not held. Each run of dirty pages is
+ * re-protected before it is sent, so a write racing the RPC marks it
+ * dirty again.
+ *
+ * @param map remote mapping
+ * @param addr start of the range
+ * @param length length of the range
+ * @return 0 on success, -1 if a run could not be written, its pages are
+ * dirty again
+ */
+int map_write_back(remote_map *map, char *addr, size_t length) {
+    if (!map->track_dirty) {
+        return 0;
+    }
+    attr_cache_invalidate(map->file->path);
+    size_t first = addr <= map->addr ? 0 : (addr - map->addr) / page_size;
+    size_t last = addr + length >= map->addr + map->length ?
+                  map->npages : (addr + length - map->addr + page_size - 1) / page_size;
+    size_t i = first;
+    int r = 0;
+    while (i < last) {
+        // coalesce a run of dirty pages into one pwrite, without
+        // write-protect there is no way to see the next write, so the
+        // pages stay dirty
+        pthread_mutex_lock(&map_lock);
+        while (i < last && !(map->dirty[i] && map->mapped[i])) {
+            ++i;
+        }
+        size_t run = i;
+        while (run < last && map->dirty[run] && map->mapped[run]) {
+            if (uffd_wp) map->dirty[run] = 0;
+            ++run;
+        }
+        if (run > i && uffd_wp) {
+            struct uffdio_writeprotect wp = {
+                .range = { (unsigned long) (map->addr + i * page_size), (run - i) * page_size },
+                .mode = UFFDIO_WRITEPROTECT_MODE_WP,
+            };
+            ioctl(uffd, UFFDIO_WRITEPROTECT, &wp);
+        }
+        pthread_mutex_unlock(&map_lock);
+        if (run == i) {
+            break;
+        }
+        off_t pos = map->offset + (off_t) i * page_size;
+        size_t count = (run - i) * page_size;
+        // pages past EOF are never written to the file
+        if (pos < map->file_size) {
+            if (pos + (off_t) count > map->file_size) {
+                count = map->file_size - pos;
+            }
+            // a short write goes on where it stopped
+            size_t done = 0;
+            while (done < count) {
+                int new_err;
+                off_t new_off;
+                ssize_t w = rpc_pwrite(map->file->shard, map->file->remote_fd, map->addr + i * page_size + done,
+                                       count - done, pos + done, &new_off, &new_err);
+                if (w <= 0) {
+                    break;
+                }
+                done += w;
+            }
+            if (done < count) {
+                pthread_mutex_lock(&map_lock);
+                memset(map->dirty + i, 1, run - i);
+                pthread_mutex_unlock(&map_lock);
+                r = -1;
+            }
+        }
+        i = run;
+    }
+    return r;
+}
+
+/**
+ * @brief read a whole mapping eagerly, used when userfaultfd is not
+ * available. Every page of a shared writable mapping counts as dirty.
+ *
+ * @param map remote mapping
+ * @return 0 on success, -1 with errno set if a fetch failed
+ */
+int map_load_all(remote_map *map) {
+    if (!(map->prot & PROT_WRITE)) {
+        mprotect(map->addr, map->length, map->prot | PROT_WRITE);
+    }
+    size_t i;
+    int r = 0;
+    for (i = 0; i < map->npages && r == 0; i += MMAP_READAHEAD) {
+        size_t n = map->npages - i < MMAP_READAHEAD ? map->npages - i : MMAP_READAHEAD;
+        r = map_fetch(map, i, n, map->addr + i * page_size);
+        memset(map->present + i, 1, n);
+        memset(map->dirty + i, map->track_dirty, n);
+    }
+    if (!(map->prot & PROT_WRITE)) {
+        int saved = errno;
+        mprotect(map->addr, map->length, map->prot);
+        errno = saved;
+    }
+    return r;
+}
+
+/**
+ * @brief register a mapping with userfaultfd, starting the fault handler
+ * thread on first use.
+ *
+ * @param map remote mapping
+ * @return 0 on success, -1 if userfaultfd is not usable
+ */
+int uffd_register(remote_map *map) {
+    pthread_mutex_lock(&map_lock);
+    if (uffd == -1) {
+        // UFFD_USER_MODE_ONLY is not enough, syscalls such as write()
+        // on a mapped buffer fault in kernel mode and would get EFAULT
+        uffd = syscall(SYS_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+        // the faulting thread's id is where a failed fetch sends SIGBUS
+        struct uffdio_api api = { .api = UFFD_API, .features = UFFD_FEATURE_PAGEFAULT_FLAG_WP | UFFD_FEATURE_THREAD_ID };
+        if (uffd >= 0 && ioctl(uffd, UFFDIO_API, &api) < 0) {
+            // retry without write-protect support
+            orig_close(uffd);
+            uffd = syscall(SYS_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+            api.features = UFFD_FEATURE_THREAD_ID;
+            if (uffd >= 0 && ioctl(uffd, UFFDIO_API, &api) < 0) {
+                orig_close(uffd);
+                uffd = -2;
+            }
+        }
+        pthread_t tid;
+        if (uffd >= 0 && pthread_create(&tid, NULL, fault_handler, NULL) == 0) {
+            pthread_detach(tid);
+            uffd_wp = (api.features & UFFD_FEATURE_PAGEFAULT_FLAG_WP) != 0;
+            fprintf(stderr, "lib: userfaultfd ready, write-protect %d\n", uffd_wp);
+        } else {
+            uffd = -2;
+        }
+    }
+    pthread_mutex_unlock(&map_lock);
+    if (uffd < 0) {
+        return -1;
+    }
+
+    struct uffdio_register reg = {
+        .range = { (unsigned long) map->addr, map->length },
+        .mode = UFFDIO_REGISTER_MODE_MISSING,
+    };
+    if (map->track_dirty && uffd_wp) {
+        reg.mode |= UFFDIO_REGISTER_MODE_WP;
+    }
+    return ioctl(uffd, UFFDIO_REGISTER, &reg);
+}
+
+/**
+ * @brief serve one page fault on a remote mapping.
+ *
+ * Missing pages are fetched together with up to MMAP_READAHEAD following
+ * pages that are not present yet. Write-protect faults mark the page
+ * dirty and let the write through. If the fetch fails the faulting thread
+ * gets SIGBUS, like for an I/O error under a file mapping, and the pages
+ * stay missing so a retried access fetches them again.
+ *
+ * @param addr faulting address
+ * @param flags UFFD_PAGEFAULT_FLAG_*
+ * @param tid faulting thread
+ */
+void handle_page_fault(char *addr, u_int64_t flags, pid_t tid) {
+    pthread_mutex_lock(&map_lock);
+    remote_map *map = map_find(addr);
+    if (map == NULL) {
+        // unmapped under us, nothing to serve
+        pthread_mutex_unlock(&map_lock);
+        return;
+    }
+    size_t page = (addr - map->addr) / page_size;
+    char *page_addr = map->addr + page * page_size;
+
+    if (flags & UFFD_PAGEFAULT_FLAG_WP) {
+        map->dirty[page] = 1;
+        struct uffdio_writeprotect wp = {
+            .range = { (unsigned long) page_addr, page_size },
+            .mode = 0,
+        };
+        ioctl(uffd, UFFDIO_WRITEPROTECT, &wp);
+        pthread_mutex_unlock(&map_lock);
+        return;
+    }
+
+    size_t npages = 1;
+    while (npages < MMAP_READAHEAD && page + npages < map->npages && !map->present[page + npages] &&
+           map->mapped[page + npages]) {
+        ++npages;
+    }
+    // fetch without the lock, munmap and msync need not wait on it
+    ++map->users;
+    pthread_mutex_unlock(&map_lock);
+    char *buf;
+    if (posix_memalign((void **) &buf, page_size, npages * page_size) != 0) err(1, 0);
+    if (map_fetch(map, page, npages, buf) < 0) {
+        // the wake lets a fault taken inside a syscall see the signal too
+        syscall(SYS_tgkill, getpid(), tid, SIGBUS);
+        struct uffdio_range range = { (unsigned long) page_addr, page_size };
+        ioctl(uffd, UFFDIO_WAKE, &range);
+        free(buf);
+        remote_map **held = malloc(sizeof(remote_map *));
+        held[0] = map;
+        map_unhold(held, 1, NULL, 0);
+        return;
+    }
+
+    struct uffdio_copy copy = {
+        .dst = (unsigned long) page_addr,
+        .src = (unsigned long) buf,
+        .len = npages * page_size,
+        .mode = map->track_dirty && uffd_wp ? UFFDIO_COPY_MODE_WP : 0,
+    };
+    pthread_mutex_lock(&map_lock);
+    if (ioctl(uffd, UFFDIO_COPY, &copy) < 0 && errno == EEXIST) {
+        // raced with another fault on the same page, just wake it
+        struct uffdio_range range = { (unsigned long) page_addr, page_size };
+        ioctl(uffd, UFFDIO_WAKE, &range);
+    }
+    if (copy.copy > 0) {
+        memset(map->present + page, 1, copy.copy / page_size);
+        if (map->track_dirty && !uffd_wp) {
+            memset(map->dirty + page, 1, copy.copy / page_size);
+        }
+    }
+    pthread_mutex_unlock(&map_lock);
+    free(buf);
+    remote_map **held = malloc(sizeof(remote_map *));
+    held[0] = map;
+    map_unhold(held, 1, NULL, 0);
+}
+
+/**
+ * @brief fault handler thread, serves faults on all remote mappings.
+ */
+void *fault_handler(void *arg) {
+    struct pollfd pfd = { .fd = uffd, .events = POLLIN };
+    struct uffd_msg msg;
+    while (1) {
+        if (poll(&pfd, 1, -1) < 0) {
+            if (errno == EINTR) continue;
+            err(1, 0);
+        }
+        if (orig_read(uffd, &msg, sizeof(msg)) != sizeof(msg)) {
+            continue;
+        }
+        if (msg.event != UFFD_EVENT_PAGEFAULT) {
+            continue;
+        }
+        handle_page_fault((char *) msg.arg.pagefault.address, msg.arg.pagefault.flags,
+                          msg.arg.pagefault.feat.ptid);
+    }
+    return NULL;
+}
+
+/**
+ * @brief buffer a sequential write of a dedup file. Once DEDUP_BUF bytes
+ * are held, every complete chunk is sent.
+ *
+ * @param file remote file
+ * @param buf data to write
+ * @param count bytes to write
+ * @return count, or -1 with errno set if an earlier flush failed
+ */
+ssize_t dedup_write(remote_file *file, const void *buf, size_t count) {
+    if (file->wbuf_len > 0 && file->wbuf_off + (off_t) file->wbuf_len != file->offset) {
+        // not sequential, what is held goes out at its own offset first
+        dedup_flush(file, true);
+    }
+    if (file->wbuf_err) {
+        errno = file->wbuf_err;
+        file->wbuf_err = 0;
+        return -1;
+    }
+    // what is held goes out in one write, keep it to IO_MAX
+    if (count > IO_MAX - file->wbuf_len) {
+        count = IO_MAX - file->wbuf_len;
+    }
+    if (file->wbuf_len == 0) {
+        file->wbuf_off = file->offset;
+        file->next_dirty = dirty_list;
+        dirty_list = file;
+    }
+    if (file->wbuf_len + count > file->wbuf_cap) {
+        file->wbuf_cap = file->wbuf_len + count > DEDUP_BUF ? file->wbuf_len + count : DEDUP_BUF;
+        file->wbuf = realloc(file->wbuf, file->wbuf_cap);
+    }
+    memcpy(file->wbuf + file->wbuf_len, buf, count);
+    file->wbuf_len += count;
+    file->offset += count;
+    if (file->wbuf_len >= DEDUP_BUF) {
+        // a failure is kept for the next call, this write is already taken
+        dedup_flush(file, false);
+    }
+    return count;
+}
+
+/**
+ * @brief send the held back writes of a file. Without final the bytes
+ * after the last chunk boundary stay, the next write may extend that chunk.
+ *
+ * @param file remote file
+ * @param final send everything
+ * @return 0 on success, -1 with the error kept in file->wbuf_err
+ */
+int dedup_flush(remote_file *file, bool final) {
+    if (file->delta) {
+        return final ? delta_commit(file) : 0;
+    }
+    if (file->wbuf_len == 0) {
+        return 0;
+    }
+    u_int32_t n = 0;
+    chunk_ref *refs = malloc(sizeof(chunk_ref) * (file->wbuf_len / CDC_MIN + 2));
+    size_t pos = 0;
+    while (pos < file->wbuf_len) {
+        size_t cut = cdc_cut((unsigned char *) file->wbuf + pos, file->wbuf_len - pos);
+        if (!final && pos + cut == file->wbuf_len && cut < CDC_MAX) {
+            break;
+        }
+        chunk_hash(file->wbuf + pos, cut, refs[n].hash);
+        refs[n].len = cut;
+        ++n;
+        pos += cut;
+    }
+
+    int r = 0;
+    if (n > 0) {
+        int new_err = 0;
+        ssize_t w = rpc_dedup_write(file, file->wbuf, refs, n, file->wbuf_off, &new_err);
+        if (w != (ssize_t) pos) {
+            file->wbuf_err = w < 0 ? new_err : EIO;
+            r = -1;
+        }
+        memmove(file->wbuf, file->wbuf + pos, file->wbuf_len - pos);
+        file->wbuf_len -= pos;
+        file->wbuf_off += pos;
+    }
+    free(refs);
+
+    if (file->wbuf_len == 0) {
+        dirty_remove(file);
+    }
+    return r;
+}
+
+/**
+ * @brief take a file off the list of files with held back writes.
+ *
+ * @param file remote file
+ */
+void dirty_remove(remote_file *file) {
+    remote_file **p;
+    for (p = &dirty_list; *p != NULL; p = &(*p)->next_dirty) {
+        if (*p == file) {
+            *p = file->next_dirty;
+            break;
+        }
+    }
+    file->next_dirty = NULL;
+}
+
+/**
+ * @brief send everything held back for a file before another call on it.
+ *
+ * @param file remote file
+ * @return 0 on success, -1 with errno set if a flush failed
+ */
+int dedup_sync(remote_file *file) {
+    dedup_flush(file, true);
+    if (file->wbuf_err) {
+        errno = file->wbuf_err;
+        file->wbuf_err = 0;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief send what is held back for files opened with this path, before
+ * a call that looks at the path. Errors wait for the file's own next call.
+ *
+ * @param path path as given by the caller
+ */
+void dedup_sync_path(const char *path) {
+    remote_file *file = dirty_list;
+    while (file != NULL) {
+        remote_file *next = file->next_dirty;
+        if (strcmp(file->path, path) == 0) {
+            dedup_flush(file, true);
+        }
+        file = next;
+    }
+}
+
+/**
+ * @brief send what is held back for every file.
+ */
+void dedup_sync_all() {
+    while (dirty_list != NULL) {
+        remote_file *file = dirty_list;
+        dedup_flush(file, true);
+        if (dirty_list == file) {
+            // flush left it dirty, don't spin on it
+            dirty_list = file->next_dirty;
+            file->next_dirty = NULL;
+        }
+    }
+}
+
+/**
+ * @brief write into the held new content of a delta file.
+ *
+ * @param file remote file
+ * @param buf data to write
+ * @param count bytes to write
+ * @return count
+ */
+ssize_t delta_write(remote_file *file, const void *buf, size_t count) {
+    size_t end = file->offset + count;
+    if (end > file->wbuf_cap) {
+        size_t cap = file->wbuf_cap ? file->wbuf_cap : BUFFERLEN;
+        while (cap < end) {
+            cap *= 2;
+        }
+        file->wbuf = realloc(file->wbuf, cap);
+        file->wbuf_cap = cap;
+    }
+    if ((size_t) file->offset > file->wbuf_len) {
+        // a hole, like a write past EOF
+        memset(file->wbuf + file->wbuf_len, 0, file->offset - file->wbuf_len);
+    }
+    memcpy(file->wbuf + file->offset, buf, count);
+    if (end > file->wbuf_len) {
+        file->wbuf_len = end;
+    }
+    file->offset = end;
+    return count;
+}
+
+/**
+ * a run of the new content: literal bytes of wbuf, or old blocks
+ */
+typedef struct delta_op {
+    u_int32_t type;
+    size_t a;   // literal: offset in wbuf, copy: first old block
+    size_t b;   // literal: length, copy: number of blocks
+} delta_op;
+
+/**
+ * @brief replace the old content with the held new content. The server
+ * sends checksums of its old blocks, the new content is matched against
+ * them with a rolling checksum, and only the unmatched bytes plus block
+ * numbers go back.
+ *
+ * @param file remote file in delta mode
+ * @return 0 on success, -1 with the error kept in file->wbuf_err
+ */
+int delta_commit(remote_file *file) {
+    const unsigned char *p = (const unsigned char *) file->wbuf;
+    size_t len = file->wbuf_len;
+
+    // checksums of the old content, none if the server can't read it
+    rpc_resp *resp = rpc_sums(file->shard, 0, file->remote_fd);
+
+    int r;
+    u_int32_t block = 0, nblocks = 0, i;
+    size_t off = mem_read_data(resp->data, 0, &r, sizeof(int));
+    if (r == 0) {
+        off = mem_read_int32(resp->data, off, &block);
+        off = mem_read_int32(resp->data, off, &nblocks);
+    }
+    u_int32_t *weak = malloc(sizeof(u_int32_t) * (nblocks + 1));
+    unsigned char *strong = malloc(CHUNK_HASH_LEN * (nblocks + 1));
+    for (i = 0; i < nblocks; i++) {
+        off = mem_read_int32(resp->data, off, &weak[i]);
+        off = mem_read_data(resp->data, off, strong + (size_t) i * CHUNK_HASH_LEN, CHUNK_HASH_LEN);
+    }
+    free(resp->data);
+    free(resp);
+
+    // open addressing on the weak sum, slot holds block + 1
+    u_int32_t slots = 16;
+    while (slots < nblocks * 2) {
+        slots *= 2;
+    }
+    u_int32_t *table = calloc(slots, sizeof(u_int32_t));
+    for (i = 0; i < nblocks; i++) {
+        u_int32_t h = (weak[i] * 2654435761u) & (slots - 1);
+        while (table[h] != 0) {
+            h = (h + 1) & (slots - 1);
+        }
+        table[h] = i + 1;
+    }
+
+    size_t nops = 0, cap = 64;
+    delta_op *ops = malloc(sizeof(delta_op) * cap);
+    size_t pos = 0, lit = 0;
+    u_int32_t a = 0, b = 0;
+    bool rolled = false;
+    while (nblocks > 0 && pos + block <= len) {
+        if (!rolled) {
+            u_int32_t w = rolling_sum(p + pos, block);
+            a = w & 0xffff;
+            b = w >> 16;
+            rolled = true;
+        }
+        u_int32_t w = (a & 0xffff) | (b << 16);
+        u_int32_t h = (w * 2654435761u) & (slots - 1);
+        int match = -1;
+        bool hashed = false;
+        unsigned char hash[CHUNK_HASH_LEN];
+        for (; table[h] != 0; h = (h + 1) & (slots - 1)) {
+            u_int32_t k = table[h] - 1;
+            if (weak[k] != w) {
+                continue;
+            }
+            if (!hashed) {
+                chunk_hash(p + pos, block, hash);
+                hashed = true;
+            }
+            if (memcmp(strong + (size_t) k * CHUNK_HASH_LEN, hash, CHUNK_HASH_LEN) == 0) {
+                match = k;
+                break;
+            }
+        }
+        if (match >= 0) {
+            if (nops + 2 > cap) {
+                cap *= 2;
+                ops = realloc(ops, sizeof(delta_op) * cap);
+            }
+            if (pos > lit) {
+                ops[nops++] = (delta_op) {DELTA_LITERAL, lit, pos - lit};
+            }
+            if (nops > 0 && ops[nops - 1].type == DELTA_COPY && ops[nops - 1].a + ops[nops - 1].b == (size_t) match) {
+                ++ops[nops - 1].b;
+            } else {
+                ops[nops++] = (delta_op) {DELTA_COPY, match, 1};
+            }
+            pos += block;
+            lit = pos;
+            rolled = false;
+            continue;
+        }
+        if (pos + block >= len) {
+            break;
+        }
+        // slide the window one byte
+        a = a - p[pos] + p[pos + block];
+        b = b - block * p[pos] + a;
+        ++pos;
+    }
+    if (nops + 1 > cap) {
+        ops = realloc(ops, sizeof(delta_op) * (cap + 1));
+    }
+    if (len > lit) {
+        ops[nops++] = (delta_op) {DELTA_LITERAL, lit, len - lit};
+    }
+    free(table);
+    free(weak);
+    free(strong);
+
+    // header, then per op its fields and for literals the bytes from wbuf
+    char *hdr = malloc(2 * sizeof(u_int32_t) + sizeof(u_int64_t) + sizeof(u_int32_t) * 3);
+    size_t hdr_size = call_delta_marshal(hdr + 2 * sizeof(u_int32_t), file->remote_fd, len, block, nops);
+    char *opbuf = malloc(sizeof(u_int32_t) * 3 * (nops + 1));
+    struct iovec *req = malloc(sizeof(struct iovec) * (2 * nops + 1));
+    int iovcnt = 1;
+    size_t opoff = 0, sent = 0, literal = 0;
+    for (i = 0; i < nops; i++) {
+        size_t start = opoff;
+        opoff = mem_write_int32(opbuf, opoff, ops[i].type);
+        opoff = mem_write_int32(opbuf, opoff, ops[i].type == DELTA_LITERAL ? ops[i].b : ops[i].a);
+        if (ops[i].type == DELTA_COPY) {
+            opoff = mem_write_int32(opbuf, opoff, ops[i].b);
+        }
+        if (iovcnt > 1 && (char *) req[iovcnt - 1].iov_base + req[iovcnt - 1].iov_len == opbuf + start) {
+            req[iovcnt - 1].iov_len += opoff - start;
+        } else {
+            req[iovcnt].iov_base = opbuf + start;
+            req[iovcnt].iov_len = opoff - start;
+            ++iovcnt;
+        }
+        sent += opoff - start;
+        if (ops[i].type == DELTA_LITERAL) {
+            req[iovcnt].iov_base = file->wbuf + ops[i].a;
+            req[iovcnt].iov_len = ops[i].b;
+            ++iovcnt;
+            sent += ops[i].b;
+            literal += ops[i].b;
+        }
+    }
+    mem_write_int32(hdr, 0, OP_DELTA);
+    mem_write_int32(hdr, sizeof(u_int32_t), hdr_size + sent);
+    req[0].iov_base = hdr;
+    req[0].iov_len = hdr_size + 2 * sizeof(u_int32_t);
+
+    resp = send_request_iov(file->shard, req, iovcnt, 0, NULL, 0);
+    ssize_t w;
+    int new_err = resp->err_no;
+    mem_read_data(resp->data, 0, &w, sizeof(ssize_t));
+    free(resp->data);
+    free(resp);
+    free(req);
+    free(opbuf);
+    free(hdr);
+    free(ops);
+
+    fprintf(stderr, "lib: delta - %zu literal bytes of %zu, %u old blocks of %u\n", literal, len, nblocks, block);
+    attr_cache_invalidate(file->path);
+    file->delta = 0;
+    file->wbuf_len = 0;
+    dirty_remove(file);
+    if (w != (ssize_t) len) {
+        file->wbuf_err = w < 0 ? new_err : EIO;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief length of the next content-defined chunk, a gear hash boundary
+ * between CDC_MIN and CDC_MAX bytes. Boundaries depend on the bytes only,
+ * so an insert early in a file leaves the later chunks as they were.
+ *
+ * @param p data
+ * @param n bytes available
+ * @return chunk length, n if no boundary was found in n bytes
+ */
+size_t cdc_cut(const unsigned char *p, size_t n) {
+    if (n <= CDC_MIN) {
+        return n;
+    }
+    size_t max = n < CDC_MAX ? n : CDC_MAX;
+    u_int64_t h = 0;
+    size_t i;
+    for (i = CDC_MIN - 64; i < max; i++) {
+        h = (h << 1) + gear[p[i]];
+        if (i >= CDC_MIN && (h & CDC_MASK) == 0) {
+            return i + 1;
+        }
+    }
+    return max;
+}
+
+/**
+ * @brief write chunks at offset, naming them by hash first and then
+ * sending only the ones the server lacks. Falls back to a plain pwrite
+ * if the server keeps no chunk store.
+ *
+ * @param file remote file
+ * @param data the chunks back to back
+ * @param refs chunk hashes and lengths
+ * @param n number of chunks
+ * @param offset file offset of the first chunk
+ * @param err_no errno from the server
+ * @return bytes written, or -1 on error
+ */
+ssize_t rpc_dedup_write(remote_file *file, const char *data, const chunk_ref *refs, u_int32_t n,
+                        off_t offset, int *err_no) {
+    size_t total = 0;
+    u_int32_t i;
+    for (i = 0; i < n; i++) {
+        total += refs[i].len;
+    }
+    off_t new_off;
+    if (!dedup_writes) {
+        return rpc_pwrite(file->shard, file->remote_fd, data, total, offset, &new_off, err_no);
+    }
+    size_t hdr_max = sizeof(u_int32_t) * (4 + n) + sizeof(off_t) + (CHUNK_HASH_LEN + sizeof(u_int32_t)) * n;
+
+    struct rpc_frame* frame = malloc(sizeof(rpc_resp));
+    frame->opcode = OP_CHUNKQ;
+    frame->payload = malloc(hdr_max);
+    frame->payload_size = call_chunkq_marshal(frame->payload, file->remote_fd, offset, refs, n);
+    char *rpc_buf = malloc(frame->payload_size + 2 * sizeof(u_int32_t));
+    size_t frame_size = marshal_frame(rpc_buf, frame);
+    rpc_resp *resp = send_request(file->shard, rpc_buf, frame_size);
+
+    ssize_t r;
+    u_int32_t nmissing;
+    *err_no = resp->err_no;
+    size_t off = mem_read_data(resp->data, 0, &r, sizeof(ssize_t));
+    off = mem_read_data(resp->data, off, &new_off, sizeof(off_t));
+    off = mem_read_int32(resp->data, off, &nmissing);
+    u_int32_t *missing = malloc(sizeof(u_int32_t) * (nmissing + 1));
+    for (i = 0; i < nmissing; i++) {
+        off = mem_read_int32(resp->data, off, &missing[i]);
+    }
+    free(resp->data);
+    free(resp);
+    free(rpc_buf);
+
+    size_t sent = 0;
+    if (r >= 0 && nmissing > 0) {
+        // header, then the missing chunks straight from data, runs of
+        // neighbouring chunks as one piece
+        size_t *start = malloc(sizeof(size_t) * (n + 1));
+        start[0] = 0;
+        for (i = 0; i < n; i++) {
+            start[i + 1] = start[i] + refs[i].len;
+        }
+        struct iovec *req = malloc(sizeof(struct iovec) * (nmissing + 1));
+        char *hdr = malloc(hdr_max + 2 * sizeof(u_int32_t));
+        size_t hdr_size = call_chunkw_marshal(hdr + 2 * sizeof(u_int32_t), file->remote_fd, offset,
+                                              refs, n, missing, nmissing);
+        int iovcnt = 1;
+        for (i = 0; i < nmissing; i++) {
+            u_int32_t k = missing[i];
+            if (iovcnt > 1 && (char *) req[iovcnt - 1].iov_base + req[iovcnt - 1].iov_len == data + start[k]) {
+                req[iovcnt - 1].iov_len += refs[k].len;
+            } else {
+                req[iovcnt].iov_base = (char *) data + start[k];
+                req[iovcnt].iov_len = refs[k].len;
+                ++iovcnt;
+            }
+            sent += refs[k].len;
+        }
+        mem_write_int32(hdr, 0, OP_CHUNKW);
+        mem_write_int32(hdr, sizeof(u_int32_t), hdr_size + sent);
+        req[0].iov_base = hdr;
+        req[0].iov_len = hdr_size + 2 * sizeof(u_int32_t);
+
+        resp = send_request_iov(file->shard, req, iovcnt, 0, NULL, 0);
+        *err_no = resp->err_no;
+        off = mem_read_data(resp->data, 0, &r, sizeof(ssize_t));
+        mem_read_data(resp->data, off, &new_off, sizeof(off_t));
+        free(resp->data);
+        free(resp);
+        free(hdr);
+        free(req);
+        free(start);
+    }
+    free(missing);
+    free(frame->payload);
+    free(frame);
+
+    if (r < 0 && (*err_no == ENOTSUP || *err_no == EAGAIN || *err_no == EINVAL)) {
+        if (*err_no == ENOTSUP) {
+            fprintf(stderr, "lib: server keeps no chunk store, dedup off\n");
+            dedup_writes = 0;
+        }
+        return rpc_pwrite(file->shard, file->remote_fd, data, total, offset, &new_off, err_no);
+    }
+    fprintf(stderr, "lib: dedup write - sent %zu of %zu bytes in %u chunks\n", sent, total, n);
+    return r;
+}
+
+/**
+ * @brief check whether a local fd stands for a remote file.
+ *
+ * @param fd local file descriptor
+ * @return true if fd was handed out by open() for a remote file
+ */
+bool is_remote_fd(int fd) {
+    if (fd < 0 || fd >= MAX_FD) {
+        return false;
+    }
+    return (fd_bitmap[fd / 64] >> (fd % 64)) & 1;
+}
+
+/**
+ * @brief reserve a local fd for a remote fd.
+ *
+ * The local fd is a dup of placeholder_fd, so the kernel will not hand
+ * the same number to any local open/socket/pipe while the remote file
+ * is open.
+ *
+ * @param shard shard holding the file
+ * @param remote_fd fd on the server side
+ * @param path path the file was opened with
+ * @return reserved local fd, or -1 with errno set on error
+ */
+int fd_table_insert(int shard, int remote_fd, const char *path) {
+    int fd = fcntl(placeholder_fd, F_DUPFD_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    if (fd >= MAX_FD) {
+        orig_close(fd);
+        errno = EMFILE;
+        return -1;
+    }
+    remote_file *file = malloc(sizeof(remote_file));
+    file->shard = shard;
+    file->remote_fd = remote_fd;
+    file->replica_fd[0] = remote_fd;
+    int i;
+    for (i = 1; i < MAX_REPLICAS; i++) {
+        file->replica_fd[i] = -1;
+    }
+    file->flags = 0;
+    file->offset = 0;
+    file->refs = 1;
+    file->path = strdup(path);
+    file->dir_buf = NULL;
+    file->dir_len = 0;
+    file->dir_pos = 0;
+    file->dir_at = 0;
+    file->dedup = 0;
+    file->delta = 0;
+    file->wbuf = NULL;
+    file->wbuf_len = 0;
+    file->wbuf_cap = 0;
+    file->wbuf_off = 0;
+    file->wbuf_err = 0;
+    file->open_err = 0;
+    file->clean = 0;
+    file->cached = NULL;
+    file->cached_len = 0;
+    file->next_dirty = NULL;
+    fd_table[fd] = file;
+    fd_bitmap[fd / 64] |= (u_int64_t) 1 << (fd % 64);
+    return fd;
+}
+
+/**
+ * @brief release a local fd reserved by fd_table_insert().
+ * The remote_file itself is released by remote_file_release().
+ *
+ * @param fd local file descriptor
+ */
+void fd_table_remove(int fd) {
+    fd_bitmap[fd / 64] &= ~((u_int64_t) 1 << (fd % 64));
+    fd_table[fd] = NULL;
+    orig_close(fd);
+}
+
+/**
+ * @brief drop a reference to a remote file, closing it on the server
+ * once neither a local fd nor a mapping refers to it.
+ *
+ * @param file remote file
+ * @param err_no errno from the server
+ * @return return value of close() on the server, or 0 if still referenced
+ */
+int remote_file_release(remote_file *file, int *err_no) {
+    if (--file->refs > 0) {
+        return 0;
+    }
+    if (file->cached != NULL) {
+        // the server never had it open
+        free(file->cached);
+        free(file->path);
+        free(file);
+        return 0;
+    }
+    shard *sh = &shards[file->shard];
+    dedup_flush(file, true);
+    // a speculative open that failed left nothing to close
+    int r = file->open_err ? -1 :
+            remote_close(file->shard, 0, file->remote_fd, err_no, !(file->clean && pipelined(file->shard)));
+    if (r < 0 && file->open_err) {
+        *err_no = file->open_err;
+    }
+    int i;
+    for (i = 1; i < sh->nreplicas; i++) {
+        if (file->replica_fd[i] >= 0) {
+            remote_close(file->shard, i, file->replica_fd[i], NULL, true);
+        }
+    }
+    if (pipelined(file->shard)) {
+        // an open still in flight has no file left to fill in
+        pthread_mutex_lock(&sh->r[0].lock);
+        if (sh->r[0].opening == file) {
+            sh->r[0].opening = NULL;
+        }
+        pthread_mutex_unlock(&sh->r[0].lock);
+    }
+    free(file->path);
+    free(file->dir_buf);
+    free(file->wbuf);
+    free(file);
+    --sh->opened_fd;
+    // pipelined connections stay, closing one would drop the replies to
+    // the calls still on it
+    if (sh->opened_fd == 0 && !pipelined(sh - shards)) {
+        fprintf(stderr, "lib: close system call - closing socket\n");
+        // the server's promises end with its session
+        attr_cache_break(sh - shards, NULL, 0);
+        // close socket here? when close is succeeded and all fd closed
+        for (i = 0; i < sh->nreplicas; i++) {
+            pthread_mutex_lock(&sh->r[i].lock);
+            if (sh->r[i].sockfd >= 0) {
+                orig_close(sh->r[i].sockfd);
+                sh->r[i].sockfd = -1;
+            }
+            // replies to lost hedges went with the socket
+            __atomic_sub_fetch(&sh->r[i].outstanding, sh->r[i].owed, __ATOMIC_RELAXED);
+            sh->r[i].owed = 0;
+            sh->r[i].opening_at = -1;
+            pthread_mutex_unlock(&sh->r[i].lock);
+        }
+    }
+    return r;
+}
+
+/**
+ * @brief fill the shard table. servers15440 holds a comma separated list of
+ * host:port[|host:port...][=prefix] entries, the entry without a prefix
+ * takes every path no other prefix matches. Servers joined by '|' export
+ * the same content, the first one takes the writes. Without it the single
+ * server15440/serverport15440 server takes every path.
+ */
+void init_shards() {
+    int i, j;
+    char *list = getenv("servers15440");
+    nshards = 0;
+    if (list == NULL) {
+        char *serverip;
+        char *serverport;
+
+        // Get environment variable indicating the ip address of the server
+        serverip = getenv("server15440");
+        if (serverip) fprintf(stderr, "Got environment variable server15440: %s\n", serverip);
+        else {
+            fprintf(stderr, "Environment variable server15440 not found.  Using 127.0.0.1\n");
+            serverip = "127.0.0.1";
+        }
+
+        // Get environment variable indicating the port of the server
+        serverport = getenv("serverport15440");
+        if (serverport) fprintf(stderr, "Got environment variable serverport15440: %s\n", serverport);
+        else {
+            fprintf(stderr, "Environment variable serverport15440 not found.  Using 15440\n");
+            serverport = "15440";
+        }
+        shards[0].r[0].host = strdup(serverip);
+        shards[0].r[0].port = (unsigned short)atoi(serverport);
+        shards[0].nreplicas = 1;
+        shards[0].prefix = NULL;
+        nshards = 1;
+    } else {
+        fprintf(stderr, "Got environment variable servers15440: %s\n", list);
+        char *copy = strdup(list);
+        char *save = NULL;
+        for (char *tok = strtok_r(copy, ",", &save); tok != NULL; tok = strtok_r(NULL, ",", &save)) {
+            if (nshards == MAX_SHARDS) {
+                fprintf(stderr, "lib: more than %d servers, ignoring %s\n", MAX_SHARDS, tok);
+                continue;
+            }
+            char *prefix = strchr(tok, '=');
+            if (prefix != NULL) *prefix++ = '\0';
+            shard *sh = &shards[nshards];
+            sh->nreplicas = 0;
+            char *save_r = NULL;
+            for (char *host = strtok_r(tok, "|", &save_r); host != NULL; host = strtok_r(NULL, "|", &save_r)) {
+                char *port = strrchr(host, ':');
+                if (port == NULL || sh->nreplicas == MAX_REPLICAS) {
+                    fprintf(stderr, "lib: bad server entry %s\n", host);
+                    continue;
+                }
+                *port++ = '\0';
+                sh->r[sh->nreplicas].host = strdup(host);
+                sh->r[sh->nreplicas].port = (unsigned short)atoi(port);
+                ++sh->nreplicas;
+            }
+            if (sh->nreplicas == 0) {
+                continue;
+            }
+            sh->prefix = NULL;
+            if (prefix != NULL && *prefix != '\0') {
+                sh->prefix = malloc(strlen(prefix) + 1);
+                attr_path_normalize(sh->prefix, prefix);
+            }
+            ++nshards;
+        }
+        free(copy);
+        if (nshards == 0) {
+            fprintf(stderr, "lib: no usable entry in servers15440\n");
+            exit(1);
+        }
+    }
+    for (i = 0; i < nshards; i++) {
+        shards[i].opened_fd = 0;
+        for (j = 0; j < shards[i].nreplicas; j++) {
+            replica *r = &shards[i].r[j];
+            r->sockfd = -1;
+            r->outstanding = 0;
+            r->owed = 0;
+            r->opens = 0;
+            r->opening_at = -1;
+            r->opening = NULL;
+            pthread_mutex_init(&r->lock, NULL);
+            fprintf(stderr, "lib: shard [%d] replica [%d] %s:%u owns %s\n", i, j, r->host, r->port,
+                    shards[i].prefix ? shards[i].prefix : "(default)");
+        }
+    }
+
+    char *pct = getenv("hedge15440");
+    if (pct != NULL) {
+        hedge_pct = atoi(pct);
+        if (hedge_pct < 0 || hedge_pct > 100) hedge_pct = HEDGE_PERCENTILE;
+    }
+    for (i = 0; i < 2; i++) {
+        latencies[i].count = 0;
+        latencies[i].threshold = -1;
+    }
+}
+
+/**
+ * @brief check whether path is prefix itself or lies below it. Both are
+ * normalized.
+ */
+bool path_under(const char *path, const char *prefix) {
+    size_t len = strlen(prefix);
+    if (strncmp(path, prefix, len) != 0) {
+        return false;
+    }
+    return path[len] == '\0' || path[len] == '/' || (len > 0 && prefix[len - 1] == '/');
+}
+
+/**
+ * @brief pick the shard owning a path, the longest matching prefix wins.
  *
- * @param dt dirtreenode struct
+ * @param path path as given by the caller
+ * @return shard index, the default shard if no prefix matches
  */
-void freedirtree(struct dirtreenode* dt) {
-    size_t i;
-    for (i = 0; i < dt->num_subdirs; i++) {
-        freedirtree(dt->subdirs[i]);
+int route_path(const char *path) {
+    if (nshards == 1) {
+        return 0;
     }
-    free(dt->name);
-    free(dt->subdirs);
-    free(dt);
+    char *key = malloc(strlen(path) + 1);
+    attr_path_normalize(key, path);
+    int best = -1;
+    int fallback = 0;
+    size_t best_len = 0;
+    int i;
+    for (i = nshards - 1; i >= 0; i--) {
+        if (shards[i].prefix == NULL) {
+            fallback = i;
+            continue;
+        }
+        size_t len = strlen(shards[i].prefix);
+        if (len >= best_len && path_under(key, shards[i].prefix)) {
+            best = i;
+            best_len = len;
+        }
+    }
+    free(key);
+    return best < 0 ? fallback : best;
 }
 
 /**
- * @brief init client for teach rpc call.
- * @return A -1 is returned if an error occurs, otherwise the return value
- * is a descriptor referencing the socket.
+ * @brief connect to one replica of a shard. Connections are made on the
+ * first call that needs them, or ahead of time by prewarm().
+ *
+ * @param shard shard to connect to
+ * @param replica replica of the shard
+ * @return socket fd, or -1 with errno set if the server can't be reached
  */
-int init_client() {
-    char *serverip;
-    char *serverport;
-    unsigned short port;
+int init_client(int shard, int replica) {
     int sockfd, rv;
     struct sockaddr_in srv;
 
-    // Get environment variable indicating the ip address of the server
-    serverip = getenv("server15440");
-    if (serverip) fprintf(stderr, "Got environment variable server15440: %s\n", serverip);
-    else {
-        fprintf(stderr, "Environment variable server15440 not found.  Using 127.0.0.1\n");
-        serverip = "127.0.0.1";
-    }
-
-    // Get environment variable indicating the port of the server
-    serverport = getenv("serverport15440");
-    if (serverport) fprintf(stderr, "Got environment variable serverport15440: %s\n", serverport);
-    else {
-        fprintf(stderr, "Environment variable serverport15440 not found.  Using 15440\n");
-        serverport = "15440";
+    if (broker_path != NULL) {
+        sockfd = broker_connect(shard, replica);
+        if (sockfd >= 0) {
+            return sockfd;
+        }
+        // no broker running, talk to the server directly
     }
-    port = (unsigned short)atoi(serverport);
 
     // Create socket
-    sockfd = socket(AF_INET, SOCK_STREAM, 0);	// TCP/IP socket
-    if (sockfd<0) err(1, 0);			// in case of error
+    sockfd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);	// TCP/IP socket
+    if (sockfd<0) return -1;			// in case of error
+
+    // every call is a small request waiting on its reply, don't let Nagle
+    // hold back the tail of a frame for a delayed ACK
+    int on = 1;
+    setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    // buffers are sized before connect so the window scale fits them
+    if (sock_buf > 0) {
+        setsockopt(sockfd, SOL_SOCKET, SO_SNDBUF, &sock_buf, sizeof(sock_buf));
+        setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &sock_buf, sizeof(sock_buf));
+    }
+    // have the spinning receives poll the device queue too; raising it
+    // past net.core.busy_read takes CAP_NET_ADMIN, without it they only
+    // check the socket
+    if (busy_poll_us > 0) {
+        setsockopt(sockfd, SOL_SOCKET, SO_BUSY_POLL, &busy_poll_us, sizeof(busy_poll_us));
+    }
 
     // setup address structure to point to server
     memset(&srv, 0, sizeof(srv));			// clear it first
     srv.sin_family = AF_INET;			// IP family
-    srv.sin_addr.s_addr = inet_addr(serverip);	// IP address of server
-    srv.sin_port = htons(port);			// server port
+    srv.sin_addr.s_addr = inet_addr(shards[shard].r[replica].host);	// IP address of server
+    srv.sin_port = htons(shards[shard].r[replica].port);			// server port
 
     // actually connect to the server
     rv = connect(sockfd, (struct sockaddr*)&srv, sizeof(struct sockaddr));
-    if (rv<0) err(1,0);
+    if (rv<0) {
+        int saved = errno;
+        orig_close(sockfd);
+        errno = saved;
+        return -1;
+    }
 
     return sockfd;
 }
 
 /**
- * @brief get socket id from init_client().
+ * @brief connect to the host's broker and name the server this
+ * connection is for. The broker relays frames unchanged.
+ *
+ * @param shard shard to connect to
+ * @param replica replica of the shard
+ * @return socket fd, or -1 if no broker listens on broker_path
+ */
+int broker_connect(int shard, int replica) {
+    struct sockaddr_un sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sun_family = AF_UNIX;
+    strncpy(sa.sun_path, broker_path, sizeof(sa.sun_path) - 1);
+    int sockfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sockfd < 0) {
+        return -1;
+    }
+    char hello[BROKER_HELLO_SIZE];
+    broker_hello_marshal(hello, inet_addr(shards[shard].r[replica].host), shards[shard].r[replica].port);
+    if (connect(sockfd, (struct sockaddr *) &sa, sizeof(sa)) < 0 ||
+        send(sockfd, hello, sizeof(hello), MSG_NOSIGNAL) != sizeof(hello)) {
+        orig_close(sockfd);
+        return -1;
+    }
+    return sockfd;
+}
+
+/**
+ * @brief connect every replica in the background, for programs known to
+ * use the server soon (prewarm15440). Failures are left to the first
+ * call that needs the connection.
+ *
+ * @param arg unused
+ * @return NULL
+ */
+void *prewarm(void *arg) {
+    int i, j;
+    for (i = 0; i < nshards; i++) {
+        for (j = 0; j < shards[i].nreplicas; j++) {
+            replica *r = &shards[i].r[j];
+            pthread_mutex_lock(&r->lock);
+            if (r->sockfd < 0) {
+                r->sockfd = init_client(i, j);
+            }
+            pthread_mutex_unlock(&r->lock);
+        }
+    }
+    fprintf(stderr, "lib: prewarm connected %d shards\n", nshards);
+    return NULL;
+}
+
+/**
+ * @brief get socket id from init_client(). The caller holds the replica's
+ * lock. Without pipelining replies nobody waits for are read off first,
+ * with it they are read after the caller's request is sent.
+ *
+ * @param shard shard to talk to
+ * @param replica replica of the shard
  * @return A -1 is returned if an error occurs, otherwise the return value
  * is a descriptor referencing the socket.
  */
-int get_socket_fd() {
+int get_socket_fd(int shard, int replica) {
+    struct replica *r = &shards[shard].r[replica];
     // reconnect if needed
-    if (_sockfd < 0) {
-        fprintf(stderr, ">> connect: init client<<\n");
-        _sockfd = init_client();
+    if (r->sockfd < 0) {
+        fprintf(stderr, ">> connect: init client [%d:%d]<<\n", shard, replica);
+        r->sockfd = init_client(shard, replica);
+        if (r->sockfd < 0) {
+            return -1;
+        }
+        r->opens = 0;
+    }
+    if (!pipelining) {
+        owed_drain(r, true);
+    }
+    return r->sockfd;
+}
+
+/**
+ * @brief read replies owed on a connection, in the order the server sends
+ * them. The caller holds the replica's lock.
+ *
+ * @param r replica
+ * @param all every owed reply, or only up to a speculative open's
+ */
+void owed_drain(replica *r, bool all) {
+    while (r->owed > 0 && (all || r->opening_at >= 0)) {
+        // a reply nobody waits for, if the request got lost so be it
+        rpc_resp *resp = recv_resp(r->sockfd);
+        if (r->opening_at == 0) {
+            open_resolve(r->opening, resp);
+            r->opening = NULL;
+        }
+        if (r->opening_at >= 0) {
+            --r->opening_at;
+        }
+        if (resp != NULL) {
+            free(resp->data);
+            free(resp);
+        }
+        --r->owed;
+        __atomic_sub_fetch(&r->outstanding, 1, __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * @brief fill in the server's fd for a speculative open, or its error.
+ *
+ * @param file file the open was for, NULL if it is closed already
+ * @param resp the open's reply, NULL if it was lost
+ */
+void open_resolve(remote_file *file, rpc_resp *resp) {
+    if (file == NULL) {
+        return;
+    }
+    int fd = -1;
+    if (resp != NULL) {
+        mem_read_data(resp->data, 0, &fd, sizeof(int));
+    }
+    fprintf(stderr, "lib: open system call - got fd from server %d, pipelined\n", fd);
+    file->remote_fd = fd;
+    file->replica_fd[0] = fd;
+    if (fd < 0) {
+        file->open_err = resp != NULL ? resp->err_no : EIO;
+    }
+}
+
+/**
+ * @brief check whether a file's speculative open failed, sets errno to
+ * the open's error if so.
+ *
+ * @param file remote file
+ * @return true if the server could not open it
+ */
+bool open_failed(remote_file *file) {
+    if (file->open_err == 0) {
+        return false;
     }
-    return _sockfd;
+    errno = file->open_err;
+    return true;
+}
+
+/**
+ * @brief check whether calls to a shard are pipelined.
+ *
+ * @param shard shard
+ * @return true if opens and read-only closes don't wait for the server
+ */
+bool pipelined(int shard) {
+    return pipelining && shards[shard].nreplicas == 1;
 }
 
 /**
@@ -638,10 +4106,21 @@ int get_socket_fd() {
  * @param size size of data
  */
 void send_all(int sockfd, const void *data, size_t size) {
-    int frame_size = (int)size;
+    if (size > FRAME_MAX) {
+        // the flags share the size word
+        errno = EMSGSIZE;
+        err(1, 0);
+    }
+    int frame_size = (int)size | (frame_crc ? FRAME_CRC : 0);
     char buf[MAXMSGLEN];
     ssize_t rv;
-    size_t pending = size;
+    u_int32_t sum = 0;
+    size_t total = size;
+    if (frame_crc) {
+        sum = crc32c(crc32c(0, &frame_size, sizeof(int)), data, size);
+        total += sizeof(u_int32_t);
+    }
+    size_t pending = total;
     fprintf(stderr, "client send_all data [%zu]\n", size);
 
     // size of package first
@@ -649,8 +4128,11 @@ void send_all(int sockfd, const void *data, size_t size) {
     while(pending > 0) {
         // actual data size to be sent in this round
         size_t len = pending > MAXMSGLEN - off? MAXMSGLEN - off: pending;
-        // fill in buffer
-        off = mem_write_data(buf, off, data + (size - pending), len);
+        // fill in buffer, the trailer goes in the same send as the data end
+        size_t pos = total - pending;
+        size_t n = pos >= size ? 0 : (len < size - pos ? len : size - pos);
+        off = mem_write_data(buf, off, data + pos, n);
+        off = mem_write_data(buf, off, (char *) &sum + (pos + n - size), len - n);
         // send, may end up in multiple sends
         size_t sent = 0;
         while((rv = send(sockfd, buf + sent, off - sent, 0)) > 0) {
@@ -668,78 +4150,728 @@ void send_all(int sockfd, const void *data, size_t size) {
 }
 
 /**
- * @brief send request to server.
+ * @brief tell the server its last response arrived corrupt.
+ *
+ * @param sockfd socket fd
+ */
+void send_nack(int sockfd) {
+    int word = FRAME_NACK;
+    if (send(sockfd, &word, sizeof(int), 0) < 0) err(1, 0);
+}
+
+/**
+ * @brief count one more corrupt frame of a request, past CRC_RETRIES the
+ * link is not worth trusting.
+ *
+ * @param tries corrupt frames so far
+ */
+void frame_retry(int *tries) {
+    if (++*tries > CRC_RETRIES) {
+        errno = EBADMSG;
+        err(1, 0);
+    }
+    fprintf(stderr, "lib: frame checksum mismatch, try [%d]\n", *tries);
+}
+
+/**
+ * @brief send request to the primary server of a shard.
+ *
+ * @param shard shard the request goes to
  * @return A -1 is returned if an error occurs, otherwise the return value
  * is a descriptor referencing the socket.
  */
-rpc_resp* send_request(const char *msg, size_t msg_sz) {
-    int sockfd = get_socket_fd();
+rpc_resp* send_request(int shard, const char *msg, size_t msg_sz) {
+    return send_request_to(shard, 0, msg, msg_sz);
+}
+
+/**
+ * @brief send request to one replica of a shard.
+ *
+ * @param shard shard the request goes to
+ * @param replica replica of the shard
+ * @return response from the server
+ */
+rpc_resp* send_request_to(int shard, int replica, const char *msg, size_t msg_sz) {
+    struct replica *r = &shards[shard].r[replica];
+    __atomic_add_fetch(&r->outstanding, 1, __ATOMIC_RELAXED);
+    // one request in flight at a time, the fault handler shares the socket
+    pthread_mutex_lock(&r->lock);
+    int sockfd = get_socket_fd(shard, replica);
     if (sockfd<0) err(1,0);
-    ssize_t rv;
-    char buf[MAXMSGLEN];
 
     // send to server
     send_all(sockfd, msg, msg_sz);
+    owed_drain(r, true);
+
+    rpc_resp *resp;
+    int tries = 0;
+    while ((resp = recv_resp(sockfd)) == NULL) {
+        frame_retry(&tries);
+        send_all(sockfd, msg, msg_sz);
+    }
+    pthread_mutex_unlock(&r->lock);
+    __atomic_sub_fetch(&r->outstanding, 1, __ATOMIC_RELAXED);
+    return resp;
+}
 
-    // receive response
-    rv=recv(sockfd, buf, MAXMSGLEN, 0);
-    fprintf(stderr, "client starts receiving response\n");
+/**
+ * @brief send an open request to one replica of a shard. Opens are counted
+ * per connection, a speculative open is known to the server by its number
+ * until the reply is read.
+ *
+ * @param shard shard the request goes to
+ * @param replica replica of the shard
+ * @param ahead file to hand the server's fd to once the reply is read, or
+ * NULL to wait for the reply
+ * @return response from the server, NULL for a speculative open
+ */
+rpc_resp* send_open(int shard, int replica, const char *msg, size_t msg_sz, remote_file *ahead) {
+    struct replica *r = &shards[shard].r[replica];
+    __atomic_add_fetch(&r->outstanding, 1, __ATOMIC_RELAXED);
+    pthread_mutex_lock(&r->lock);
+    int sockfd = get_socket_fd(shard, replica);
+    if (sockfd<0) err(1,0);
+    if (ahead != NULL) {
+        // one speculative open in flight per connection
+        owed_drain(r, false);
+    }
 
-    int frame_size = 0;
-    ssize_t received = rv;
+    send_all(sockfd, msg, msg_sz);
+    u_int32_t seq = r->opens++;
+    if (ahead != NULL) {
+        ahead->remote_fd = FD_PENDING(seq);
+        ahead->replica_fd[0] = ahead->remote_fd;
+        r->opening = ahead;
+        r->opening_at = r->owed;
+        ++r->owed;
+        pthread_mutex_unlock(&r->lock);
+        return NULL;
+    }
+    owed_drain(r, true);
 
-    // receive bytes of size sizeof(int) to indicate size of frame
-    while(received < sizeof(int)) {
-        rv = recv(sockfd, buf + received, MAXMSGLEN - received, 0);
-        if (rv < 0) err(1,0);
-        received += rv;
+    rpc_resp *resp;
+    int tries = 0;
+    while ((resp = recv_resp(sockfd)) == NULL) {
+        frame_retry(&tries);
+        send_all(sockfd, msg, msg_sz);
     }
+    pthread_mutex_unlock(&r->lock);
+    __atomic_sub_fetch(&r->outstanding, 1, __ATOMIC_RELAXED);
+    return resp;
+}
 
-    memcpy(&frame_size, buf, sizeof(int));
+/**
+ * @brief send a request without waiting for its reply, which is read off
+ * the connection with the reply to a later request.
+ *
+ * @param shard shard the request goes to
+ * @param replica replica of the shard
+ */
+void send_ahead(int shard, int replica, const char *msg, size_t msg_sz) {
+    struct replica *r = &shards[shard].r[replica];
+    __atomic_add_fetch(&r->outstanding, 1, __ATOMIC_RELAXED);
+    pthread_mutex_lock(&r->lock);
+    int sockfd = get_socket_fd(shard, replica);
+    if (sockfd<0) err(1,0);
+    send_all(sockfd, msg, msg_sz);
+    ++r->owed;
+    pthread_mutex_unlock(&r->lock);
+}
 
-    if (frame_size <= 0) {
-        fprintf(stderr, "client error - invalid frame size? [%d]\n", frame_size);
-        err(1,0);
+/**
+ * @brief send a side effect free request to the least loaded replica, and
+ * once it is slower than the hedge threshold send it to a second replica
+ * as well. The first reply wins, the other is read off that connection
+ * before its next request.
+ *
+ * @param shard shard the request goes to
+ * @param kind LAT_STAT or LAT_READ, each has its own threshold
+ * @param msgs frame for each replica, NULL where the replica can't serve it;
+ * set to NULL for a replica found unable to
+ * @param sizes size of each frame
+ * @param file file the frames read from, NULL if they name no fd
+ * @return response from the server
+ */
+rpc_resp* send_hedged(int shard, int kind, char *msgs[], const size_t sizes[], remote_file *file) {
+    struct shard *sh = &shards[shard];
+    int first = pick_replica(sh, msgs, -1);
+    if (first < 0) err(1, 0);
+    if (sh->nreplicas == 1) {
+        return send_request_to(shard, first, msgs[first], sizes[first]);
     }
-    fprintf(stderr, "client - frame size [%d], received size [%zd]\n", frame_size, received);
 
-    // receive the rest of bytes until end
-    char *data = malloc(frame_size);
+    struct timespec start, end;
+    replica *a;
+    int sockfd;
+    while (1) {
+        a = &sh->r[first];
+        __atomic_add_fetch(&a->outstanding, 1, __ATOMIC_RELAXED);
+        pthread_mutex_lock(&a->lock);
+        sockfd = replica_ready(shard, first, file, msgs[first]);
+        if (sockfd >= 0) {
+            break;
+        }
+        // down, or the file won't open there; the primary always serves
+        pthread_mutex_unlock(&a->lock);
+        __atomic_sub_fetch(&a->outstanding, 1, __ATOMIC_RELAXED);
+        msgs[first] = NULL;
+        first = pick_replica(sh, msgs, -1);
+        if (first < 0) err(1, 0);
+    }
+    // poll below must see nothing but the reply to this request
+    owed_drain(a, true);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    send_all(sockfd, msgs[first], sizes[first]);
 
-    // copy residue bytes first from last recv
-    size_t off = mem_write_data(data, 0, buf + sizeof(int), received - sizeof(int));
+    struct pollfd pfd[2] = {{sockfd, POLLIN, 0}, {-1, POLLIN, 0}};
+    int second = -1;
+    long delay = hedge_delay(kind);
+    int other = delay < 0 ? -1 : pick_replica(sh, msgs, first);
+    if (other >= 0) {
+        struct timespec ts = {delay / 1000000, (delay % 1000000) * 1000};
+        // a busy second replica is no help, and waiting on its lock while
+        // holding ours could deadlock against another hedging thread
+        if (ppoll(pfd, 1, &ts, NULL) == 0 && pthread_mutex_trylock(&sh->r[other].lock) == 0) {
+            pfd[1].fd = replica_ready(shard, other, file, msgs[other]);
+            if (pfd[1].fd >= 0) {
+                second = other;
+                __atomic_add_fetch(&sh->r[second].outstanding, 1, __ATOMIC_RELAXED);
+                owed_drain(&sh->r[second], true);
+                send_all(pfd[1].fd, msgs[second], sizes[second]);
+                fprintf(stderr, "lib: hedging to replica [%d] after %ld us\n", second, delay);
+            } else {
+                pthread_mutex_unlock(&sh->r[other].lock);
+            }
+        }
+    }
 
-    while(off < frame_size) {
-        rv = recv(sockfd, buf, MAXMSGLEN, 0);
-        if (rv < 0) {
-            free(data);
-            err(1, 0);
+    int won = first;
+    if (second >= 0) {
+        while (poll(pfd, 2, -1) < 0) {
+            if (errno != EINTR) err(1, 0);
+        }
+        if (pfd[0].revents == 0) {
+            won = second;
+        }
+    }
+    rpc_resp *resp;
+    int tries = 0;
+    while ((resp = recv_resp(pfd[won == first ? 0 : 1].fd)) == NULL) {
+        frame_retry(&tries);
+        send_all(pfd[won == first ? 0 : 1].fd, msgs[won], sizes[won]);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    if (second >= 0) {
+        // the loser still counts as outstanding until its reply is read
+        int lost = won == first ? second : first;
+        ++sh->r[lost].owed;
+        __atomic_sub_fetch(&sh->r[won].outstanding, 1, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&sh->r[second].lock);
+    } else {
+        __atomic_sub_fetch(&a->outstanding, 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&a->lock);
+
+    latency_record(kind, (end.tv_sec - start.tv_sec) * 1000000 + (end.tv_nsec - start.tv_nsec) / 1000);
+    return resp;
+}
+
+/**
+ * @brief get a replica ready for a hedgeable request, with its lock held:
+ * connected, and for a read the file opened there the first time a read
+ * picks it. The fd is filled into the frame then. A replica that can't be
+ * reached or can't open the file is not asked about the file again.
+ *
+ * @param shard shard
+ * @param replica replica of the shard
+ * @param file file the frame reads from, NULL if it names no fd
+ * @param msg frame for the replica
+ * @return socket fd, or -1 if the replica can't serve the request
+ */
+int replica_ready(int shard, int replica, remote_file *file, char *msg) {
+    int sockfd = get_socket_fd(shard, replica);
+    if (file == NULL || replica == 0) {
+        return sockfd;
+    }
+    // every call on an fd has it first in the payload
+    int fd;
+    mem_read_data(msg, 2 * sizeof(u_int32_t), &fd, sizeof(int));
+    if (fd != REPLICA_UNOPENED) {
+        return sockfd;
+    }
+    if (sockfd >= 0 && file->replica_fd[replica] == REPLICA_UNOPENED) {
+        struct rpc_frame frame;
+        char payload[BUFFERLEN];
+        char buf[BUFFERLEN];
+        frame.opcode = OP_OPEN;
+        frame.payload = payload;
+        frame.payload_size = call_open_marshal(payload, file->path, file->flags, 0);
+        size_t frame_size = marshal_frame(buf, &frame);
+        send_all(sockfd, buf, frame_size);
+        ++shards[shard].r[replica].opens;
+        owed_drain(&shards[shard].r[replica], true);
+        rpc_resp *resp;
+        int tries = 0;
+        while ((resp = recv_resp(sockfd)) == NULL) {
+            frame_retry(&tries);
+            send_all(sockfd, buf, frame_size);
+        }
+        mem_read_data(resp->data, 0, &file->replica_fd[replica], sizeof(int));
+        free(resp->data);
+        free(resp);
+        fprintf(stderr, "lib: opened on replica [%d] as %d\n", replica, file->replica_fd[replica]);
+    }
+    if (sockfd < 0 || file->replica_fd[replica] < 0) {
+        file->replica_fd[replica] = -1;
+        return -1;
+    }
+    mem_write_data(msg, 2 * sizeof(u_int32_t), &file->replica_fd[replica], sizeof(int));
+    return sockfd;
+}
+
+/**
+ * @brief pick the replica with the fewest outstanding requests, ties go
+ * round robin.
+ *
+ * @param sh shard
+ * @param msgs frame for each replica, NULL where the replica can't serve it
+ * @param skip replica not to pick, -1 for none
+ * @return replica index, or -1 if there is none
+ */
+int pick_replica(shard *sh, char *const msgs[], int skip) {
+    int best = -1;
+    int best_load = 0;
+    unsigned int start = __atomic_fetch_add(&replica_rr, 1, __ATOMIC_RELAXED);
+    int i;
+    for (i = 0; i < sh->nreplicas; i++) {
+        int j = (start + i) % sh->nreplicas;
+        if (j == skip || msgs[j] == NULL) {
+            continue;
+        }
+        int load = __atomic_load_n(&sh->r[j].outstanding, __ATOMIC_RELAXED);
+        if (best < 0 || load < best_load) {
+            best = j;
+            best_load = load;
+        }
+    }
+    return best;
+}
+
+/**
+ * @brief current hedge delay for a kind of request.
+ *
+ * @param kind LAT_STAT or LAT_READ
+ * @return delay in microseconds, or -1 if hedging is off or there are too
+ * few samples yet
+ */
+long hedge_delay(int kind) {
+    if (hedge_pct == 0) {
+        return -1;
+    }
+    pthread_mutex_lock(&lat_lock);
+    long delay = latencies[kind].threshold;
+    pthread_mutex_unlock(&lat_lock);
+    return delay;
+}
+
+static int cmp_long(const void *a, const void *b) {
+    long x = *(const long *) a, y = *(const long *) b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * @brief add a latency sample, the threshold is recomputed every 16 samples
+ * from the last LAT_SAMPLES.
+ *
+ * @param kind LAT_STAT or LAT_READ
+ * @param us latency in microseconds
+ */
+void latency_record(int kind, long us) {
+    lat_ring *ring = &latencies[kind];
+    pthread_mutex_lock(&lat_lock);
+    ring->us[ring->count % LAT_SAMPLES] = us;
+    ++ring->count;
+    if (ring->count >= LAT_MIN_SAMPLES && ring->count % 16 == 0) {
+        int n = ring->count < LAT_SAMPLES ? ring->count : LAT_SAMPLES;
+        long sorted[LAT_SAMPLES];
+        memcpy(sorted, ring->us, sizeof(long) * n);
+        qsort(sorted, n, sizeof(long), cmp_long);
+        ring->threshold = sorted[(n - 1) * hedge_pct / 100];
+    }
+    pthread_mutex_unlock(&lat_lock);
+}
+
+/**
+ * @brief receive a response from server. A response failing its checksum
+ * is asked for again.
+ *
+ * @param sockfd socket fd
+ * @return unmarshaled response, or NULL if the request reached the server
+ * corrupt and has to be sent again
+ */
+rpc_resp* recv_resp(int sockfd) {
+    int tries = 0;
+
+    while (1) {
+        busy_wait(sockfd);
+        callback_drain(sockfd, true);
+        // receive response, no further than its own frame: pipelined
+        // replies and callback frames may follow it
+        int frame_size = 0;
+        int word;
+        recv_all(sockfd, &word, sizeof(int));
+        fprintf(stderr, "client starts receiving response\n");
+        if (word & FRAME_NACK) {
+            return NULL;
         }
-        off = mem_write_data(data, off, buf, rv);
+        frame_size = FRAME_SIZE(word);
+        bool crc = (word & FRAME_CRC) != 0;
+
+        if (frame_size <= 0) {
+            fprintf(stderr, "client error - invalid frame size? [%d]\n", frame_size);
+            err(1,0);
+        }
+        fprintf(stderr, "client - frame size [%d]\n", frame_size);
+
+        // receive the rest of bytes until end
+        size_t total = frame_size + (crc ? sizeof(u_int32_t) : 0);
+        char *data = malloc(total);
+        recv_all(sockfd, data, total);
+        fprintf(stderr, "client finished receiving resp frame: [%d]\n", frame_size);
+
+        if (crc) {
+            u_int32_t sum;
+            memcpy(&sum, data + frame_size, sizeof(u_int32_t));
+            if (sum != crc32c(crc32c(0, &word, sizeof(int)), data, frame_size)) {
+                free(data);
+                frame_retry(&tries);
+                send_nack(sockfd);
+                continue;
+            }
+        }
+
+        // unmarshal
+        rpc_resp *resp =malloc(sizeof(rpc_resp));
+        read_resp(data, resp);
+        fprintf(stderr, "resp size: [%u]\n", resp->size);
+        free(data);
+        return resp;
     }
-    fprintf(stderr, "client finished receiving resp frame: [%d]\n", frame_size);
+}
 
-    // unmarshal
-    rpc_resp *resp =malloc(sizeof(rpc_resp));
-    read_resp(data, resp);
-    fprintf(stderr, "resp size: [%u]\n", resp->size);
-    free(data);
+
+/**
+ * @brief send a request given as an iovec table, such as a frame header
+ * followed by the caller's own buffers, without gathering it first.
+ *
+ * @param shard shard the request goes to
+ * @param iov request pieces, sent in order as one frame
+ * @param iovcnt number of pieces
+ * @param head bytes of the response data kept in resp->data
+ * @param rx_iov buffers receiving the rest of the response data, or NULL
+ * @param rx_iovcnt number of receive buffers
+ * @return response from the server
+ */
+rpc_resp* send_request_iov(int shard, const struct iovec *iov, int iovcnt, size_t head,
+                           const struct iovec *rx_iov, int rx_iovcnt) {
+    struct replica *r = &shards[shard].r[0];
+    // the caller's buffers may be in a remote mapping
+    map_touch(iov, iovcnt);
+    map_touch(rx_iov, rx_iovcnt);
+    __atomic_add_fetch(&r->outstanding, 1, __ATOMIC_RELAXED);
+    pthread_mutex_lock(&r->lock);
+    int sockfd = get_socket_fd(shard, 0);
+    if (sockfd<0) err(1,0);
+
+    send_all_iov(sockfd, iov, iovcnt);
+    owed_drain(r, true);
+
+    rpc_resp *resp;
+    int tries = 0;
+    while ((resp = rx_iov == NULL ? recv_resp(sockfd) : recv_resp_iov(sockfd, head, rx_iov, rx_iovcnt)) == NULL) {
+        frame_retry(&tries);
+        send_all_iov(sockfd, iov, iovcnt);
+    }
+    pthread_mutex_unlock(&r->lock);
+    __atomic_sub_fetch(&r->outstanding, 1, __ATOMIC_RELAXED);
     return resp;
 }
 
+/**
+ * @brief advance an iovec table past n bytes.
+ *
+ * @param iov iovec table, the first entry is adjusted in place
+ * @param iovcnt number of entries left
+ * @param n bytes consumed
+ */
+void iov_advance(struct iovec **iov, int *iovcnt, size_t n) {
+    while (*iovcnt > 0 && n >= (*iov)->iov_len) {
+        n -= (*iov)->iov_len;
+        ++*iov;
+        --*iovcnt;
+    }
+    if (*iovcnt > 0) {
+        (*iov)->iov_base = (char *) (*iov)->iov_base + n;
+        (*iov)->iov_len -= n;
+    }
+}
+
+/**
+ * @brief send all data in an iovec table to server, prefixed by the
+ * frame size and followed by the checksum like send_all().
+ *
+ * @param sockfd socket fd
+ * @param iov data to be sent
+ * @param iovcnt number of entries
+ */
+void send_all_iov(int sockfd, const struct iovec *iov, int iovcnt) {
+    int frame_size = 0;
+    size_t size = 0;
+    int i;
+    struct iovec *vec = malloc(sizeof(struct iovec) * (iovcnt + 2));
+    vec[0].iov_base = &frame_size;
+    vec[0].iov_len = sizeof(int);
+    for (i = 0; i < iovcnt; i++) {
+        vec[i + 1] = iov[i];
+        size += iov[i].iov_len;
+    }
+    if (size > FRAME_MAX) {
+        errno = EMSGSIZE;
+        err(1, 0);
+    }
+    frame_size = (int) size;
+    fprintf(stderr, "client send_all_iov data [%d] in [%d] pieces\n", frame_size, iovcnt);
+
+    int pending = iovcnt + 1;
+    u_int32_t sum;
+    if (frame_crc) {
+        frame_size |= FRAME_CRC;
+        sum = crc32c(0, &frame_size, sizeof(int));
+        for (i = 0; i < iovcnt; i++) {
+            sum = crc32c(sum, iov[i].iov_base, iov[i].iov_len);
+        }
+        vec[pending].iov_base = &sum;
+        vec[pending].iov_len = sizeof(u_int32_t);
+        ++pending;
+    }
+    struct iovec *cur = vec;
+    while (pending > 0) {
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = cur;
+        msg.msg_iovlen = pending > IOV_MAX ? IOV_MAX : pending;
+        ssize_t rv = sendmsg(sockfd, &msg, 0);
+        if (rv < 0) err(1, 0);
+        iov_advance(&cur, &pending, rv);
+    }
+    free(vec);
+}
+
+/**
+ * @brief receive exactly size bytes.
+ *
+ * @param sockfd socket fd
+ * @param data buffer
+ * @param size bytes to receive
+ */
+void recv_all(int sockfd, void *data, size_t size) {
+    size_t off = 0;
+    while (off < size) {
+        ssize_t rv = recv(sockfd, (char *) data + off, size - off, 0);
+        if (rv <= 0) err(1, 0);
+        off += rv;
+    }
+}
+
+/**
+ * @brief spin on a socket until the next frame starts to arrive or
+ * busy_poll_us runs out, so a fast reply doesn't wait on the scheduler to
+ * wake the thread up. The blocking receive that follows takes it from
+ * there either way.
+ *
+ * @param sockfd socket fd
+ */
+void busy_wait(int sockfd) {
+    if (busy_poll_us <= 0) {
+        return;
+    }
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    char c;
+    while (recv(sockfd, &c, 1, MSG_PEEK | MSG_DONTWAIT) < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if ((now.tv_sec - start.tv_sec) * 1000000L + (now.tv_nsec - start.tv_nsec) / 1000 >= busy_poll_us) {
+            return;
+        }
+    }
+}
+
+/**
+ * @brief receive a response, scattering its data past the first head
+ * bytes directly into the caller's buffers. A response failing its
+ * checksum is asked for again into the same buffers.
+ *
+ * @param sockfd socket fd
+ * @param head bytes of the response data kept in resp->data
+ * @param iov buffers for the rest of the data
+ * @param iovcnt number of buffers
+ * @return response, resp->data holds the first head bytes only, or NULL
+ * if the request reached the server corrupt and has to be sent again
+ */
+rpc_resp* recv_resp_iov(int sockfd, size_t head, const struct iovec *iov, int iovcnt) {
+    int tries = 0;
+    while (1) {
+        int word;
+        busy_wait(sockfd);
+        callback_drain(sockfd, true);
+        recv_all(sockfd, &word, sizeof(int));
+        if (word & FRAME_NACK) {
+            return NULL;
+        }
+        rpc_resp *resp = malloc(sizeof(rpc_resp));
+        recv_all(sockfd, &resp->err_no, sizeof(int));
+        recv_all(sockfd, &resp->size, sizeof(u_int32_t));
+
+        size_t n = resp->size < head ? resp->size : head;
+        resp->data = malloc(head);
+        recv_all(sockfd, resp->data, n);
+
+        // no further than the data, a trailer may follow it
+        struct iovec *vec = malloc(sizeof(struct iovec) * iovcnt);
+        size_t pending = resp->size - n;
+        size_t rest = pending;
+        int left = 0;
+        while (left < iovcnt && rest > 0) {
+            vec[left] = iov[left];
+            if (vec[left].iov_len > rest) {
+                vec[left].iov_len = rest;
+            }
+            rest -= vec[left].iov_len;
+            ++left;
+        }
+        struct iovec *cur = vec;
+        while (pending > 0 && left > 0) {
+            struct msghdr msg;
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = cur;
+            msg.msg_iovlen = left > IOV_MAX ? IOV_MAX : left;
+            ssize_t rv = recvmsg(sockfd, &msg, 0);
+            if (rv <= 0) err(1, 0);
+            pending -= rv;
+            iov_advance(&cur, &left, rv);
+        }
+        free(vec);
+        fprintf(stderr, "client finished receiving resp frame: [%d]\n", FRAME_SIZE(word));
+
+        if (word & FRAME_CRC) {
+            u_int32_t sum, want;
+            recv_all(sockfd, &want, sizeof(u_int32_t));
+            sum = crc32c(0, &word, sizeof(int));
+            sum = crc32c(sum, &resp->err_no, sizeof(int));
+            sum = crc32c(sum, &resp->size, sizeof(u_int32_t));
+            sum = crc32c(sum, resp->data, n);
+            int i;
+            rest = resp->size - n;
+            for (i = 0; i < iovcnt && rest > 0; i++) {
+                size_t k = iov[i].iov_len < rest ? iov[i].iov_len : rest;
+                sum = crc32c(sum, iov[i].iov_base, k);
+                rest -= k;
+            }
+            if (sum != want) {
+                free(resp->data);
+                free(resp);
+                frame_retry(&tries);
+                send_nack(sockfd);
+                continue;
+            }
+        }
+        return resp;
+    }
+}
+
 /**
  * @brief init program.
  * This function is automatically called when program is started
  */
 void _init(void) {
+    int i;
+    orig_open = dlsym(RTLD_NEXT,"open");
     orig_close = dlsym(RTLD_NEXT,"close");
     orig_write = dlsym(RTLD_NEXT,"write");
     orig_read = dlsym(RTLD_NEXT,"read");
+    orig_lseek = dlsym(RTLD_NEXT,"lseek");
+    orig_getdirentries = dlsym(RTLD_NEXT,"getdirentries");
+    orig_mmap = dlsym(RTLD_NEXT,"mmap");
+    orig_munmap = dlsym(RTLD_NEXT,"munmap");
+    orig_msync = dlsym(RTLD_NEXT,"msync");
+    orig_readv = dlsym(RTLD_NEXT,"readv");
+    orig_writev = dlsym(RTLD_NEXT,"writev");
+    orig_preadv = dlsym(RTLD_NEXT,"preadv");
+    orig_pwritev = dlsym(RTLD_NEXT,"pwritev");
+    orig_copy_file_range = dlsym(RTLD_NEXT,"copy_file_range");
+    orig_sendfile = dlsym(RTLD_NEXT,"sendfile");
+    page_size = sysconf(_SC_PAGESIZE);
 
     fprintf(stderr, "Init mylib\n");
-    _sockfd = init_client();
-    min_fd = INT_MAX;
-    opened_fd = 0;
+    init_shards();
+    durable_writes = getenv("durable15440") != NULL;
+    dedup_writes = getenv("dedup15440") != NULL;
+    delta_writes = getenv("delta15440") != NULL;
+    frame_crc = getenv("crc15440") != NULL;
+    char *sockbuf = getenv("sockbuf15440");
+    sock_buf = sockbuf ? atoi(sockbuf) : 0;
+    char *busypoll = getenv("busypoll15440");
+    busy_poll_us = busypoll ? atoi(busypoll) : 0;
+    // a spinning receive holds the only CPU the other end needs to answer
+    if (sysconf(_SC_NPROCESSORS_ONLN) < 2) {
+        busy_poll_us = 0;
+    }
+    broker_path = getenv("broker15440");
+    callbacks_on = getenv("callbacks15440") != NULL;
+    attr_ttl_on = getenv("attrcache15440") != NULL;
+    pipelining = getenv("pipeline15440") != NULL && !frame_crc && broker_path == NULL;
+    char *prefetch = getenv("prefetch15440");
+    prefetch_budget = prefetch ? (size_t) atol(prefetch) : 0;
+    // gear table for chunk boundaries, any fixed random table works as
+    // long as it doesn't change between runs
+    u_int64_t seed = 0x2545f4914f6cdd1dULL;
+    for (i = 0; i < 256; i++) {
+        seed += 0x9e3779b97f4a7c15ULL;
+        u_int64_t z = seed;
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        gear[i] = z ^ (z >> 31);
+    }
+    // connect on first use, processes that never touch a remote file
+    // don't pay for a handshake or fail for want of a server
+    if (getenv("prewarm15440") != NULL) {
+        pthread_t t;
+        if (pthread_create(&t, NULL, prewarm, NULL) == 0) {
+            pthread_detach(t);
+        }
+    }
+
+    // every remote fd reserves a dup of this one
+    placeholder_fd = orig_open("/dev/null", O_RDONLY | O_CLOEXEC);
+    if (placeholder_fd < 0) err(1, 0);
 }
 
 
+
+void _fini(void) {
+    int i;
+    // writes still held back go out before the process is gone, later
+    // ones (stdio flushing at exit) are sent as they come
+    dedup_sync_all();
+    dedup_writes = 0;
+    // replies to pipelined calls, so the server doesn't answer a closed socket
+    for (i = 0; i < nshards; i++) {
+        replica *r = &shards[i].r[0];
+        pthread_mutex_lock(&r->lock);
+        if (r->sockfd >= 0) {
+            owed_drain(r, true);
+        }
+        pthread_mutex_unlock(&r->lock);
+    }
+}
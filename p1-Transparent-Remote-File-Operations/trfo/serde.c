@@ -11,7 +11,12 @@
 #include <string.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdint.h>
 #include "serde.h"
+#if defined(__x86_64__)
+#include <cpuid.h>
+#include <nmmintrin.h>
+#endif
 
 /**
  * mem operator, return next offset after write/read
@@ -73,6 +78,310 @@ size_t mem_read_tree(struct dirtreenode* tree, const char *buf, size_t off) {
     return off;
 }
 
+size_t mem_tree_size(const struct dirtreenode* tree) {
+    size_t size = sizeof(u_int32_t) + sizeof(size_t) + strlen(tree->name) + 1;
+    size_t i;
+    for (i = 0; i < tree->num_subdirs; i++) {
+        size += mem_tree_size(tree->subdirs[i]);
+    }
+    return size;
+}
+
+// FNV-1a over names and shape, children in order
+u_int64_t tree_hash_from(const struct dirtreenode* tree, u_int64_t h) {
+    const unsigned char *p;
+    size_t i;
+    for (p = (const unsigned char *) tree->name; *p; p++) {
+        h = (h ^ *p) * 0x100000001b3ULL;
+    }
+    h = (h ^ '/') * 0x100000001b3ULL;
+    h = (h ^ (u_int64_t) tree->num_subdirs) * 0x100000001b3ULL;
+    for (i = 0; i < tree->num_subdirs; i++) {
+        h = tree_hash_from(tree->subdirs[i], h);
+    }
+    return h;
+}
+
+u_int64_t tree_hash(const struct dirtreenode* tree) {
+    u_int64_t h = tree_hash_from(tree, 0xcbf29ce484222325ULL);
+    // 0 means "no tree" on the wire
+    return h == 0 ? 1 : h;
+}
+
+static const u_int32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#define ROTR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+// one 64 byte block into the state
+static void sha256_block(u_int32_t *st, const unsigned char *p) {
+    u_int32_t w[64], a, b, c, d, e, f, g, h;
+    int i;
+    for (i = 0; i < 16; i++) {
+        w[i] = (u_int32_t) p[4 * i] << 24 | (u_int32_t) p[4 * i + 1] << 16 | (u_int32_t) p[4 * i + 2] << 8 | p[4 * i + 3];
+    }
+    for (i = 16; i < 64; i++) {
+        u_int32_t s0 = ROTR32(w[i - 15], 7) ^ ROTR32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        u_int32_t s1 = ROTR32(w[i - 2], 17) ^ ROTR32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+    a = st[0]; b = st[1]; c = st[2]; d = st[3];
+    e = st[4]; f = st[5]; g = st[6]; h = st[7];
+    for (i = 0; i < 64; i++) {
+        u_int32_t t1 = h + (ROTR32(e, 6) ^ ROTR32(e, 11) ^ ROTR32(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+        u_int32_t t2 = (ROTR32(a, 2) ^ ROTR32(a, 13) ^ ROTR32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+    st[0] += a; st[1] += b; st[2] += c; st[3] += d;
+    st[4] += e; st[5] += f; st[6] += g; st[7] += h;
+}
+
+void chunk_hash(const void *data, size_t len, unsigned char *out) {
+    u_int32_t st[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+    };
+    const unsigned char *p = data;
+    unsigned char tail[128];
+    size_t i, full = len & ~(size_t) 63;
+    for (i = 0; i < full; i += 64) {
+        sha256_block(st, p + i);
+    }
+    // padding: 0x80, zeros, then the bit length big endian
+    size_t rest = len - full;
+    size_t tail_len = rest < 56 ? 64 : 128;
+    memset(tail, 0, tail_len);
+    memcpy(tail, p + full, rest);
+    tail[rest] = 0x80;
+    u_int64_t bits = (u_int64_t) len * 8;
+    for (i = 0; i < 8; i++) {
+        tail[tail_len - 1 - i] = bits >> (8 * i);
+    }
+    for (i = 0; i < tail_len; i += 64) {
+        sha256_block(st, tail + i);
+    }
+    for (i = 0; i < 8; i++) {
+        out[4 * i] = st[i] >> 24;
+        out[4 * i + 1] = st[i] >> 16;
+        out[4 * i + 2] = st[i] >> 8;
+        out[4 * i + 3] = st[i];
+    }
+}
+
+u_int32_t rolling_sum(const unsigned char *p, size_t len) {
+    u_int32_t a = 0, b = 0;
+    size_t i;
+    for (i = 0; i < len; i++) {
+        a += p[i];
+        b += (u_int32_t) (len - i) * p[i];
+    }
+    return (a & 0xffff) | (b << 16);
+}
+
+/**
+ * CRC32C, the Castagnoli polynomial reflected
+**/
+
+#define CRC32C_POLY  0x82f63b78
+// lane lengths of the interleaved hardware loop, powers of two
+#define CRC32C_LONG  8192
+#define CRC32C_SHORT 256
+
+static u_int32_t crc32c_table[8][256];
+static u_int32_t crc32c_long[4][256];
+static u_int32_t crc32c_short[4][256];
+static u_int32_t (*crc32c_impl)(u_int32_t crc, const unsigned char *p, size_t len);
+
+static u_int32_t crc32c_sw(u_int32_t crc, const unsigned char *p, size_t len) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    while (len > 0 && ((uintptr_t) p & 7) != 0) {
+        crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+        --len;
+    }
+    // slicing by 8
+    while (len >= 8) {
+        u_int64_t w;
+        memcpy(&w, p, 8);
+        w ^= crc;
+        crc = crc32c_table[7][w & 0xff] ^ crc32c_table[6][(w >> 8) & 0xff] ^
+              crc32c_table[5][(w >> 16) & 0xff] ^ crc32c_table[4][(w >> 24) & 0xff] ^
+              crc32c_table[3][(w >> 32) & 0xff] ^ crc32c_table[2][(w >> 40) & 0xff] ^
+              crc32c_table[1][(w >> 48) & 0xff] ^ crc32c_table[0][w >> 56];
+        p += 8;
+        len -= 8;
+    }
+#endif
+    while (len > 0) {
+        crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+        --len;
+    }
+    return crc;
+}
+
+// multiply a vector by a 32x32 matrix over GF(2)
+static u_int32_t gf2_times(const u_int32_t *mat, u_int32_t vec) {
+    u_int32_t sum = 0;
+    while (vec) {
+        if (vec & 1) {
+            sum ^= *mat;
+        }
+        vec >>= 1;
+        ++mat;
+    }
+    return sum;
+}
+
+static void gf2_square(u_int32_t *square, const u_int32_t *mat) {
+    int n;
+    for (n = 0; n < 32; n++) {
+        square[n] = gf2_times(mat, mat[n]);
+    }
+}
+
+// tables that advance a crc over len zero bytes, len a power of two
+static void crc32c_zeros(u_int32_t zeros[4][256], size_t len) {
+    u_int32_t odd[32], even[32];
+    u_int32_t row = 1;
+    int n;
+    // one zero bit, then square up to one zero byte and on
+    odd[0] = CRC32C_POLY;
+    for (n = 1; n < 32; n++) {
+        odd[n] = row;
+        row <<= 1;
+    }
+    gf2_square(even, odd);
+    gf2_square(odd, even);
+    u_int32_t *op = odd;
+    while (1) {
+        gf2_square(even, odd);
+        op = even;
+        len >>= 1;
+        if (len == 0) {
+            break;
+        }
+        gf2_square(odd, even);
+        op = odd;
+        len >>= 1;
+        if (len == 0) {
+            break;
+        }
+    }
+    for (n = 0; n < 256; n++) {
+        zeros[0][n] = gf2_times(op, n);
+        zeros[1][n] = gf2_times(op, n << 8);
+        zeros[2][n] = gf2_times(op, n << 16);
+        zeros[3][n] = gf2_times(op, (u_int32_t) n << 24);
+    }
+}
+
+static inline u_int32_t crc32c_shift(u_int32_t zeros[4][256], u_int32_t crc) {
+    return zeros[0][crc & 0xff] ^ zeros[1][(crc >> 8) & 0xff] ^
+           zeros[2][(crc >> 16) & 0xff] ^ zeros[3][crc >> 24];
+}
+
+#if defined(__x86_64__)
+// three independent crc32 streams keep the instruction's pipeline full,
+// their crcs are joined by shifting over the lanes after them
+__attribute__((target("sse4.2")))
+static u_int32_t crc32c_hw(u_int32_t crc, const unsigned char *p, size_t len) {
+    u_int64_t crc0 = crc, crc1, crc2;
+    u_int64_t w0, w1, w2;
+    while (len > 0 && ((uintptr_t) p & 7) != 0) {
+        crc0 = _mm_crc32_u8(crc0, *p++);
+        --len;
+    }
+    while (len >= 3 * CRC32C_LONG) {
+        const unsigned char *end = p + CRC32C_LONG;
+        crc1 = crc2 = 0;
+        do {
+            memcpy(&w0, p, 8);
+            memcpy(&w1, p + CRC32C_LONG, 8);
+            memcpy(&w2, p + 2 * CRC32C_LONG, 8);
+            crc0 = _mm_crc32_u64(crc0, w0);
+            crc1 = _mm_crc32_u64(crc1, w1);
+            crc2 = _mm_crc32_u64(crc2, w2);
+            p += 8;
+        } while (p < end);
+        crc0 = crc32c_shift(crc32c_long, crc0) ^ crc1;
+        crc0 = crc32c_shift(crc32c_long, crc0) ^ crc2;
+        p += 2 * CRC32C_LONG;
+        len -= 3 * CRC32C_LONG;
+    }
+    while (len >= 3 * CRC32C_SHORT) {
+        const unsigned char *end = p + CRC32C_SHORT;
+        crc1 = crc2 = 0;
+        do {
+            memcpy(&w0, p, 8);
+            memcpy(&w1, p + CRC32C_SHORT, 8);
+            memcpy(&w2, p + 2 * CRC32C_SHORT, 8);
+            crc0 = _mm_crc32_u64(crc0, w0);
+            crc1 = _mm_crc32_u64(crc1, w1);
+            crc2 = _mm_crc32_u64(crc2, w2);
+            p += 8;
+        } while (p < end);
+        crc0 = crc32c_shift(crc32c_short, crc0) ^ crc1;
+        crc0 = crc32c_shift(crc32c_short, crc0) ^ crc2;
+        p += 2 * CRC32C_SHORT;
+        len -= 3 * CRC32C_SHORT;
+    }
+    while (len >= 8) {
+        memcpy(&w0, p, 8);
+        crc0 = _mm_crc32_u64(crc0, w0);
+        p += 8;
+        len -= 8;
+    }
+    while (len > 0) {
+        crc0 = _mm_crc32_u8(crc0, *p++);
+        --len;
+    }
+    return crc0;
+}
+#endif
+
+// pick the implementation on first use, racing callers build the same tables
+static void crc32c_init() {
+    u_int32_t (*impl)(u_int32_t, const unsigned char *, size_t) = crc32c_sw;
+    int n, k;
+    for (n = 0; n < 256; n++) {
+        u_int32_t crc = n;
+        for (k = 0; k < 8; k++) {
+            crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+        }
+        crc32c_table[0][n] = crc;
+    }
+    for (n = 0; n < 256; n++) {
+        u_int32_t crc = crc32c_table[0][n];
+        for (k = 1; k < 8; k++) {
+            crc = crc32c_table[0][crc & 0xff] ^ (crc >> 8);
+            crc32c_table[k][n] = crc;
+        }
+    }
+#if defined(__x86_64__)
+    unsigned int eax, ebx, ecx, edx;
+    if (__get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & bit_SSE4_2)) {
+        crc32c_zeros(crc32c_long, CRC32C_LONG);
+        crc32c_zeros(crc32c_short, CRC32C_SHORT);
+        impl = crc32c_hw;
+    }
+#endif
+    __atomic_store_n(&crc32c_impl, impl, __ATOMIC_RELEASE);
+}
+
+u_int32_t crc32c(u_int32_t crc, const void *data, size_t len) {
+    if (__atomic_load_n(&crc32c_impl, __ATOMIC_ACQUIRE) == NULL) {
+        crc32c_init();
+    }
+    return ~crc32c_impl(~crc, data, len);
+}
+
 /**
  * frame
 **/
@@ -84,8 +393,7 @@ bool read_frame(const char *in, struct rpc_frame *frame) {
     if (frame->payload_size <= 0) {
         return false;
     }
-    frame->payload = malloc(frame->payload_size);
-    mem_read_data(in, off, frame->payload, frame->payload_size);
+    frame->payload = (char *) in + off;
     return true;
 }
 
@@ -121,6 +429,31 @@ size_t marshal_resp(char *out, const struct rpc_resp *resp) {
  * operator
  */
 
+// the FIXED ones, from their field lists in serde.h
+#define RPC_FIELD_WRITE(type, field) off = mem_write_data(out, off, &field, sizeof(type));
+#define RPC_FIELD_READ(type, field)  off = mem_read_data(in, off, field, sizeof(type));
+#define RPC_DEFINE_FIXED(OP, name) \
+size_t call_##name##_marshal(char *out CALL_##OP(RPC_FIELD_PARAM)) { \
+    size_t off = 0; \
+    CALL_##OP(RPC_FIELD_WRITE) \
+    return off; \
+} \
+\
+bool call_##name##_unmarshal(const char *in CALL_##OP(RPC_FIELD_OUT)) { \
+    size_t off = 0; \
+    CALL_##OP(RPC_FIELD_READ) \
+    return off == CALL_##OP##_SIZE; \
+} \
+\
+size_t call_##name##_frame(char *out CALL_##OP(RPC_FIELD_PARAM)) { \
+    size_t off = mem_write_int32(out, 0, OP_##OP); \
+    off = mem_write_int32(out, off, CALL_##OP##_SIZE); \
+    return off + call_##name##_marshal(out + off CALL_##OP(RPC_FIELD_ARG)); \
+}
+#define RPC_DEFINE_VAR(OP, name)
+#define RPC_DEFINE(OP, code, name, kind, shape) RPC_DEFINE_##shape(OP, name)
+RPC_OPS(RPC_DEFINE)
+
 size_t call_open_marshal(char *out, const char *pathname, u_int32_t flags, u_int16_t mode) {
     size_t path_len = strlen(pathname) + 1;
     size_t off = 0;
@@ -141,17 +474,6 @@ bool call_open_unmarshal(const char *in, char *pathname, u_int32_t *flags, u_int
     return true;
 }
 
-size_t call_close_marshal(char *out, int fd) {
-    size_t off = 0;
-    off = mem_write_int32(out, off, fd);
-    return off;
-}
-
-bool call_close_unmarshal(const char *in, int *fd) {
-    mem_read_int32(in, 0, (u_int32_t *) fd);
-    return true;
-}
-
 size_t call_write_marshal(char *out, int fd, const void *buf, size_t count) {
     size_t off = 0;
     off = mem_write_int32(out, off, fd);
@@ -160,60 +482,101 @@ size_t call_write_marshal(char *out, int fd, const void *buf, size_t count) {
     return off;
 }
 
-char* call_write_unmarshal(const char *in, int *fd, size_t *count) {
+const char *call_write_unmarshal(const char *in, int *fd, size_t *count) {
     size_t off = 0;
     off = mem_read_int32(in, off, (u_int32_t *) fd);
     off = mem_read_data(in, off, count, sizeof(size_t));
-    char* buf = malloc(*count);
-    mem_read_data(in, off, buf, *count);
-    return buf;
+    return in + off;
 }
 
-size_t call_read_marshal(char *out, int fd, size_t count) {
+// pwrite(int fd, const void *buf, size_t count, off_t offset)
+size_t call_pwrite_marshal(char *out, int fd, const void *buf, size_t count, off_t offset) {
     size_t off = 0;
     off = mem_write_int32(out, off, fd);
+    off = mem_write_data(out, off, &offset, sizeof(off_t));
     off = mem_write_data(out, off, &count, sizeof(size_t));
+    off = mem_write_data(out, off, buf, count);
     return off;
 }
 
-bool call_read_unmarshal(const char *in, int *fd, size_t *count) {
+const char *call_pwrite_unmarshal(const char *in, int *fd, size_t *count, off_t *offset) {
     size_t off = 0;
     off = mem_read_int32(in, off, (u_int32_t *) fd);
-    mem_read_data(in, off, count, sizeof(size_t));
-    return true;
+    off = mem_read_data(in, off, offset, sizeof(off_t));
+    off = mem_read_data(in, off, count, sizeof(size_t));
+    return in + off;
 }
 
-// lseek(int fd, off_t offset, int whence)
-size_t call_lseek_marshal(char *out, int fd, off_t offset, int whence) {
+size_t call_preadv_marshal(char *out, int fd, const struct iovec *iov, int iovcnt, off_t offset) {
     size_t off = 0;
+    int i;
     off = mem_write_int32(out, off, fd);
-    off = mem_write_data(out, off, &offset,sizeof(off_t));
-    off = mem_write_data(out, off, &whence, sizeof(int));
+    off = mem_write_data(out, off, &offset, sizeof(off_t));
+    off = mem_write_int32(out, off, iovcnt);
+    for (i = 0; i < iovcnt; i++) {
+        off = mem_write_data(out, off, &iov[i].iov_len, sizeof(size_t));
+    }
     return off;
 }
 
-bool call_lseek_unmarshal(const char *in, int *fd, off_t *offset, int *whence) {
+struct iovec *call_preadv_unmarshal(const char *in, int *fd, int *iovcnt, off_t *offset) {
     size_t off = 0;
+    int i;
     off = mem_read_int32(in, off, (u_int32_t *) fd);
     off = mem_read_data(in, off, offset, sizeof(off_t));
-    mem_read_data(in, off, whence, sizeof(int));
-    return true;
+    off = mem_read_int32(in, off, (u_int32_t *) iovcnt);
+    struct iovec *iov = malloc(sizeof(struct iovec) * *iovcnt);
+    for (i = 0; i < *iovcnt; i++) {
+        iov[i].iov_base = NULL;
+        off = mem_read_data(in, off, &iov[i].iov_len, sizeof(size_t));
+    }
+    return iov;
+}
+
+size_t call_pwritev_marshal(char *out, int fd, const struct iovec *iov, int iovcnt, off_t offset) {
+    return call_preadv_marshal(out, fd, iov, iovcnt, offset);
+}
+
+struct iovec *call_pwritev_unmarshal(const char *in, int *fd, int *iovcnt, off_t *offset) {
+    struct iovec *iov = call_preadv_unmarshal(in, fd, iovcnt, offset);
+    size_t off = sizeof(u_int32_t) * 2 + sizeof(off_t) + sizeof(size_t) * *iovcnt;
+    int i;
+    for (i = 0; i < *iovcnt; i++) {
+        iov[i].iov_base = (char *) in + off;
+        off += iov[i].iov_len;
+    }
+    return iov;
+}
+
+size_t iov_cap(struct iovec *iov, int *iovcnt, size_t max) {
+    size_t count = 0;
+    int i;
+    for (i = 0; i < *iovcnt && count < max; i++) {
+        if (iov[i].iov_len > max - count) {
+            iov[i].iov_len = max - count;
+        }
+        count += iov[i].iov_len;
+    }
+    *iovcnt = i;
+    return count;
 }
 
-size_t call_stat_marshal(char *out, int ver, const char *path) {
+size_t call_stat_marshal(char *out, int ver, const char *path, u_int32_t watch) {
     size_t off = 0;
     size_t path_len = strlen(path) + 1;
     off = mem_write_int32(out, off, ver);
     off = mem_write_data(out, off, &path_len, sizeof(size_t));
     off = mem_write_data(out, off, path, path_len);
+    off = mem_write_int32(out, off, watch);
     return off;
 }
-bool call_stat_unmarshal(const char *in, int *var, char *path) {
+bool call_stat_unmarshal(const char *in, int *var, char *path, u_int32_t *watch) {
     size_t off = 0;
     size_t path_len = 0;
     off = mem_read_int32(in, off, (u_int32_t *) var);
     off = mem_read_data(in, off, &path_len, sizeof(size_t));
-    mem_read_data(in, off, path, path_len);
+    off = mem_read_data(in, off, path, path_len);
+    mem_read_int32(in, off, watch);
     return true;
 }
 
@@ -233,33 +596,161 @@ bool call_unlink_unmarshal(const char *in, char *pathname) {
     return true;
 }
 
-size_t call_getdirentries_marshal(char *out, int fd, size_t nbytes, off_t basep) {
+size_t call_dirtreenode_marshal(char *out, const char *path) {
     size_t off = 0;
-    off = mem_write_int32(out, off, fd);
-    off = mem_write_data(out, off, &basep, sizeof(off_t));
-    off = mem_write_data(out, off, &nbytes, sizeof(size_t));
+    u_int32_t path_len = strlen(path) + 1;
+    off = mem_write_int32(out, off, path_len);
+    off = mem_write_data(out, off, path, path_len);
     return off;
 }
-
-bool call_getdirentries_unmarshal(const char *in, int *fd, size_t *nbytes, off_t *basep) {
+bool call_dirtreenode_unmarshal(char *in, char *path) {
     size_t off = 0;
-    off = mem_read_int32(in, off, (u_int32_t *) fd);
-    off = mem_read_data(in, off, basep, sizeof(off_t));
-    mem_read_data(in, off, nbytes, sizeof(size_t));
+    u_int32_t path_len = 0;
+    off = mem_read_int32(in, off, &path_len);
+    mem_read_data(in, off, path, path_len);
     return true;
 }
 
-size_t call_dirtreenode_marshal(char *out, const char *path) {
+size_t call_treev_marshal(char *out, const char *path, u_int64_t have) {
     size_t off = 0;
     u_int32_t path_len = strlen(path) + 1;
+    off = mem_write_data(out, off, &have, sizeof(u_int64_t));
     off = mem_write_int32(out, off, path_len);
     off = mem_write_data(out, off, path, path_len);
     return off;
 }
-bool call_dirtreenode_unmarshal(char *in, char *path) {
+
+bool call_treev_unmarshal(const char *in, char *path, u_int64_t *have) {
     size_t off = 0;
     u_int32_t path_len = 0;
+    off = mem_read_data(in, off, have, sizeof(u_int64_t));
     off = mem_read_int32(in, off, &path_len);
     mem_read_data(in, off, path, path_len);
     return true;
 }
+
+size_t call_chunkq_marshal(char *out, int fd, off_t offset, const chunk_ref *refs, u_int32_t n) {
+    size_t off = 0;
+    u_int32_t i;
+    off = mem_write_int32(out, off, fd);
+    off = mem_write_data(out, off, &offset, sizeof(off_t));
+    off = mem_write_int32(out, off, n);
+    for (i = 0; i < n; i++) {
+        off = mem_write_data(out, off, refs[i].hash, CHUNK_HASH_LEN);
+        off = mem_write_int32(out, off, refs[i].len);
+    }
+    return off;
+}
+
+chunk_ref *call_chunkq_unmarshal(const char *in, int *fd, off_t *offset, u_int32_t *n) {
+    size_t off = 0;
+    u_int32_t i;
+    off = mem_read_int32(in, off, (u_int32_t *) fd);
+    off = mem_read_data(in, off, offset, sizeof(off_t));
+    off = mem_read_int32(in, off, n);
+    chunk_ref *refs = malloc(sizeof(chunk_ref) * (*n + 1));
+    for (i = 0; i < *n; i++) {
+        off = mem_read_data(in, off, refs[i].hash, CHUNK_HASH_LEN);
+        off = mem_read_int32(in, off, &refs[i].len);
+    }
+    return refs;
+}
+
+size_t call_chunkw_marshal(char *out, int fd, off_t offset, const chunk_ref *refs, u_int32_t n,
+                           const u_int32_t *missing, u_int32_t nmissing) {
+    size_t off = call_chunkq_marshal(out, fd, offset, refs, n);
+    u_int32_t i;
+    off = mem_write_int32(out, off, nmissing);
+    for (i = 0; i < nmissing; i++) {
+        off = mem_write_int32(out, off, missing[i]);
+    }
+    return off;
+}
+
+chunk_ref *call_chunkw_unmarshal(const char *in, int *fd, off_t *offset, u_int32_t *n,
+                                 u_int32_t **missing, u_int32_t *nmissing, const char **data) {
+    chunk_ref *refs = call_chunkq_unmarshal(in, fd, offset, n);
+    size_t off = sizeof(u_int32_t) * 2 + sizeof(off_t) + (CHUNK_HASH_LEN + sizeof(u_int32_t)) * *n;
+    u_int32_t i;
+    off = mem_read_int32(in, off, nmissing);
+    *missing = malloc(sizeof(u_int32_t) * (*nmissing + 1));
+    for (i = 0; i < *nmissing; i++) {
+        off = mem_read_int32(in, off, &(*missing)[i]);
+    }
+    *data = in + off;
+    return refs;
+}
+
+size_t call_delta_marshal(char *out, int fd, u_int64_t new_len, u_int32_t block, u_int32_t nops) {
+    size_t off = 0;
+    off = mem_write_int32(out, off, fd);
+    off = mem_write_data(out, off, &new_len, sizeof(u_int64_t));
+    off = mem_write_int32(out, off, block);
+    off = mem_write_int32(out, off, nops);
+    return off;
+}
+
+bool call_delta_unmarshal(const char *in, int *fd, u_int64_t *new_len, u_int32_t *block, u_int32_t *nops,
+                          size_t *ops_off) {
+    size_t off = 0;
+    off = mem_read_int32(in, off, (u_int32_t *) fd);
+    off = mem_read_data(in, off, new_len, sizeof(u_int64_t));
+    off = mem_read_int32(in, off, block);
+    off = mem_read_int32(in, off, nops);
+    *ops_off = off;
+    return true;
+}
+
+size_t call_mread_marshal(char *out, const char *const paths[], u_int32_t n, u_int32_t max) {
+    size_t off = 0;
+    u_int32_t i;
+    off = mem_write_int32(out, off, max);
+    off = mem_write_int32(out, off, n);
+    for (i = 0; i < n; i++) {
+        u_int32_t path_len = strlen(paths[i]) + 1;
+        off = mem_write_int32(out, off, path_len);
+        off = mem_write_data(out, off, paths[i], path_len);
+    }
+    return off;
+}
+
+const char **call_mread_unmarshal(const char *in, u_int32_t *n, u_int32_t *max) {
+    size_t off = 0;
+    u_int32_t i;
+    off = mem_read_int32(in, off, max);
+    off = mem_read_int32(in, off, n);
+    const char **paths = malloc(sizeof(char *) * (*n + 1));
+    for (i = 0; i < *n; i++) {
+        u_int32_t path_len;
+        off = mem_read_int32(in, off, &path_len);
+        paths[i] = in + off;
+        off += path_len;
+    }
+    return paths;
+}
+
+size_t broker_hello_marshal(char *out, u_int32_t addr, u_int16_t port) {
+    size_t off = 0;
+    off = mem_write_int32(out, off, addr);
+    off = mem_write_int16(out, off, port);
+    return off;
+}
+
+bool broker_hello_unmarshal(const char *in, u_int32_t *addr, u_int16_t *port) {
+    size_t off = 0;
+    off = mem_read_int32(in, off, addr);
+    off = mem_read_int16(in, off, port);
+    return true;
+}
+
+size_t callback_marshal(char *out, const file_id *ids, u_int32_t n) {
+    size_t off = mem_write_int32(out, 0, n);
+    return mem_write_data(out, off, ids, sizeof(file_id) * n);
+}
+
+file_id *callback_unmarshal(const char *in, u_int32_t *n) {
+    size_t off = mem_read_int32(in, 0, n);
+    file_id *ids = malloc(sizeof(file_id) * (*n + 1));
+    mem_read_data(in, off, ids, sizeof(file_id) * *n);
+    return ids;
+}
@@ -13,17 +13,108 @@
 #include <stdbool.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include "../include/dirtree.h"
 
-#define OP_OPEN    0x01
-#define OP_WRITE   0x02
-#define OP_CLOSE   0x03
-#define OP_READ    0x04
-#define OP_LSEEK   0x05
-#define OP_STAT    0x06
-#define OP_UNLINK  0x07
-#define OP_GETDIR  0x08
-#define OP_GETTRR  0x09
+/*
+ * every RPC, one row each: X(OP, opcode, name, kind, shape)
+ *   name   its codec is call_<name>_marshal/unmarshal, its server handler
+ *          do_<name>
+ *   kind   META calls jump the server's queue of bulk slices, BULK don't
+ *   shape  FIXED requests are the fields CALL_<OP>(F) lists, in wire order;
+ *          their codecs, CALL_<OP>_SIZE and a call_<name>_frame() building
+ *          the whole frame are generated from it. VAR ones are written by
+ *          hand below
+ */
+#define RPC_OPS(X) \
+    X(OPEN,    0x01, open,          META, VAR)   \
+    X(WRITE,   0x02, write,         BULK, VAR)   \
+    X(CLOSE,   0x03, close,         META, FIXED) \
+    X(READ,    0x04, read,          BULK, FIXED) \
+    X(LSEEK,   0x05, lseek,         META, FIXED) \
+    X(STAT,    0x06, stat,          META, VAR)   \
+    X(UNLINK,  0x07, unlink,        META, VAR)   \
+    X(GETDIR,  0x08, getdirentries, META, FIXED) \
+    X(GETTRR,  0x09, dirtreenode,   META, VAR)   \
+    X(PREAD,   0x0a, pread,         BULK, FIXED) \
+    X(PWRITE,  0x0b, pwrite,        BULK, VAR)   \
+    X(PGREAD,  0x0c, pgread,        BULK, FIXED) \
+    X(PREADV,  0x0d, preadv,        BULK, VAR)   \
+    X(PWRITEV, 0x0e, pwritev,       BULK, VAR)   \
+    X(DIRPLUS, 0x0f, readdirplus,   META, FIXED) \
+    X(TREEV,   0x10, treev,         META, VAR)   \
+    X(CHUNKQ,  0x11, chunkq,        BULK, VAR)   \
+    X(CHUNKW,  0x12, chunkw,        BULK, VAR)   \
+    X(SUMS,    0x13, sums,          BULK, FIXED) \
+    X(DELTA,   0x14, delta,         BULK, VAR)   \
+    X(MREAD,   0x15, mread,         BULK, VAR)   \
+    X(COPY,    0x16, copy,          BULK, FIXED)
+
+// int close(int fd)
+#define CALL_CLOSE(F)   F(int, fd)
+// ssize_t read(int fd, void *buf, size_t count)
+#define CALL_READ(F)    F(int, fd) F(size_t, count)
+// off_t lseek(int fd, off_t offset, int whence)
+#define CALL_LSEEK(F)   F(int, fd) F(off_t, offset) F(int, whence)
+// ssize_t getdirentries(int fd, char *buf, size_t nbytes, off_t *basep)
+#define CALL_GETDIR(F)  F(int, fd) F(off_t, basep) F(size_t, nbytes)
+// ssize_t pread(int fd, void *buf, size_t count, off_t offset)
+#define CALL_PREAD(F)   F(int, fd) F(size_t, count) F(off_t, offset)
+// read npages pages of page_size bytes starting at page first_page
+#define CALL_PGREAD(F)  F(int, fd) F(off_t, first_page) F(u_int32_t, npages) F(u_int32_t, page_size)
+// getdirentries() from a cursor, plus a stat record for every entry,
+// with callbacks on them if watch
+#define CALL_DIRPLUS(F) F(int, fd) F(off_t, cursor) F(size_t, nbytes) F(u_int32_t, watch)
+// block checksums of the file's current content
+#define CALL_SUMS(F)    F(int, fd)
+// ssize_t copy_file_range(int fd_in, off_t *off_in, int fd_out, off_t *off_out, size_t len, 0)
+// between two files of the same server, at explicit offsets
+#define CALL_COPY(F)    F(int, fd_in) F(off_t, off_in) F(int, fd_out) F(off_t, off_out) F(size_t, len)
+
+#define RPC_OPCODE(OP, code, name, kind, shape) OP_##OP = code,
+enum { RPC_OPS(RPC_OPCODE) };
+
+#define RPC_FIELD_PARAM(type, field) , type field
+#define RPC_FIELD_OUT(type, field)   , type *field
+#define RPC_FIELD_ARG(type, field)   , field
+#define RPC_FIELD_SIZE(type, field)  + sizeof(type)
+
+#define RPC_SIZE_FIXED(OP)   CALL_##OP##_SIZE = 0 CALL_##OP(RPC_FIELD_SIZE),
+#define RPC_SIZE_VAR(OP)
+#define RPC_SIZE(OP, code, name, kind, shape) RPC_SIZE_##shape(OP)
+enum { RPC_OPS(RPC_SIZE) };
+// bytes of a FIXED request's frame, opcode and payload size included
+#define CALL_FRAME_SIZE(OP) (2 * sizeof(u_int32_t) + CALL_##OP##_SIZE)
+
+// OP_TREEV reply kinds and delta op types
+#define TREE_UNCHANGED 0
+#define TREE_FULL      1
+#define TREE_DELTA     2
+// OP_DELTA op types
+#define DELTA_LITERAL  0
+#define DELTA_COPY     1
+
+#define TREE_OP_DEL    0
+#define TREE_OP_ADD    1
+
+// flags in the size word in front of every frame, the size is the low bits
+#define FRAME_CRC      0x40000000   // a u32 CRC32C of the frame follows it
+#define FRAME_NACK     0x20000000   // no frame, the last one arrived corrupt
+#define FRAME_CALLBACK 0x80000000   // server to client only, not a reply but
+                                    // callbacks it breaks, see callback_marshal
+#define FRAME_MAX      0x1fffffff
+#define FRAME_SIZE(w)  ((w) & FRAME_MAX)
+// most data bytes one read or write RPC carries, the rest of FRAME_MAX is
+// room for its headers; reads and writes over it return short counts
+#define IO_MAX         ((size_t) 0x1c000000)
+
+// remote fd naming the result of an open whose reply the client has not
+// read yet, by the open's number on the connection; the server remembers
+// the last PENDING_OPENS results
+#define PENDING_OPENS       64
+#define FD_PENDING(seq)     (-2 - (int) ((seq) % PENDING_OPENS))
+#define FD_IS_PENDING(fd)   ((fd) <= -2 && (fd) > -2 - PENDING_OPENS)
+#define FD_PENDING_SLOT(fd) (-2 - (fd))
 
 typedef struct rpc_frame {
     u_int32_t opcode;
@@ -31,6 +122,20 @@ typedef struct rpc_frame {
     char *payload;
 } rpc_frame;
 
+// a content-defined chunk of a dedup write, named by its SHA-256; any
+// client's bytes may be reused for it, so the name must not be forgeable
+#define CHUNK_HASH_LEN 32
+typedef struct chunk_ref {
+    unsigned char hash[CHUNK_HASH_LEN];
+    u_int32_t len;
+} chunk_ref;
+
+// a file as the server knows it, what attribute callbacks are held on
+typedef struct file_id {
+    u_int64_t dev;
+    u_int64_t ino;
+} file_id;
+
 typedef struct rpc_resp {
     int err_no;
     u_int32_t size;
@@ -48,8 +153,18 @@ size_t mem_read_data(const char *data, size_t off, void *out, size_t size);
 
 size_t mem_write_tree(const struct dirtreenode* tree, char *buf, size_t off);
 size_t mem_read_tree(struct dirtreenode* tree, const char *buf, size_t off);
+size_t mem_tree_size(const struct dirtreenode* tree);
+
+// content hash of a tree, used as its version
+u_int64_t tree_hash(const struct dirtreenode* tree);
+// SHA-256 of a chunk or block, CHUNK_HASH_LEN bytes into out
+void chunk_hash(const void *data, size_t len, unsigned char *out);
+// rsync weak checksum of a block, a in the low and b in the high 16 bits
+u_int32_t rolling_sum(const unsigned char *p, size_t len);
+// CRC32C of data continuing from crc, start with 0
+u_int32_t crc32c(u_int32_t crc, const void *data, size_t len);
 
-// rpc frame
+// rpc frame, the payload points into in
 bool read_frame(const char *in, struct rpc_frame* frame);
 size_t marshal_frame(char *out, const struct rpc_frame *frame);
 
@@ -58,40 +173,89 @@ void read_resp(const char *in, struct rpc_resp* resp);
 size_t marshal_resp(char *out, const struct rpc_resp *resp);
 
 // rpc operator
+// the FIXED ones, generated
+#define RPC_DECLARE_FIXED(OP, name) \
+    size_t call_##name##_marshal(char *out CALL_##OP(RPC_FIELD_PARAM)); \
+    bool call_##name##_unmarshal(const char *in CALL_##OP(RPC_FIELD_OUT)); \
+    size_t call_##name##_frame(char *out CALL_##OP(RPC_FIELD_PARAM));
+#define RPC_DECLARE_VAR(OP, name)
+#define RPC_DECLARE(OP, code, name, kind, shape) RPC_DECLARE_##shape(OP, name)
+RPC_OPS(RPC_DECLARE)
+
 // int open(const char *pathname, int flags, ...)
 size_t call_open_marshal(char *out, const char *pathname, u_int32_t flags, u_int16_t m);
 bool call_open_unmarshal(const char* in, char *pathname, u_int32_t *flags, u_int16_t* m);
 
-// int close(int fd)
-size_t call_close_marshal(char *out, int fd);
-bool call_close_unmarshal(const char *in, int *fd);
-
 // ssize_t write(int fd, const void *buf, size_t count)
+// unmarshal returns the data in place, pointing into in
 size_t call_write_marshal(char *out, int fd, const void *buf, size_t count);
-char *call_write_unmarshal(const char *in, int *fd, size_t *count);
+const char *call_write_unmarshal(const char *in, int *fd, size_t *count);
 
-// ssize_t read(int fd, void *buf, size_t count)
-size_t call_read_marshal(char *out, int fd, size_t count);
-bool call_read_unmarshal(const char *in, int *fd, size_t *count);
+// ssize_t pwrite(int fd, const void *buf, size_t count, off_t offset)
+// unmarshal returns the data in place, pointing into in
+size_t call_pwrite_marshal(char *out, int fd, const void *buf, size_t count, off_t offset);
+const char *call_pwrite_unmarshal(const char *in, int *fd, size_t *count, off_t *offset);
 
-// off_t lseek(int fd, off_t offset, int whence)
-size_t call_lseek_marshal(char *out, int fd, off_t offset, int whence);
-bool call_lseek_unmarshal(const char *in, int *fd, off_t *offset, int *whence);
+// ssize_t preadv(int fd, const struct iovec *iov, int iovcnt, off_t offset)
+// only the iovec lengths are sent, the reply data follows the header
+size_t call_preadv_marshal(char *out, int fd, const struct iovec *iov, int iovcnt, off_t offset);
+// frame header plus the marshalled preadv/pwritev header for n iovecs
+#define CALL_PREADV_HDR_SIZE(n) \
+    (2 * sizeof(u_int32_t) + 2 * sizeof(u_int32_t) + sizeof(off_t) + sizeof(size_t) * (n))
+struct iovec *call_preadv_unmarshal(const char *in, int *fd, int *iovcnt, off_t *offset);
+
+// ssize_t pwritev(int fd, const struct iovec *iov, int iovcnt, off_t offset)
+// marshals the header only, the iovec data is sent right after it;
+// unmarshal returns iovecs pointing into in
+size_t call_pwritev_marshal(char *out, int fd, const struct iovec *iov, int iovcnt, off_t offset);
+struct iovec *call_pwritev_unmarshal(const char *in, int *fd, int *iovcnt, off_t *offset);
+// cut an iovec table down to max bytes in place, returns the bytes left
+size_t iov_cap(struct iovec *iov, int *iovcnt, size_t max);
 
 //int __xstat(int ver, const char *path, struct stat *stat_buf)
-size_t call_stat_marshal(char *out, int ver, const char *path);
-bool call_stat_unmarshal(const char *in, int *var, char *path);
+// watch asks for a callback on the result, the reply says if one was set
+size_t call_stat_marshal(char *out, int ver, const char *path, u_int32_t watch);
+bool call_stat_unmarshal(const char *in, int *var, char *path, u_int32_t *watch);
 
 //int unlink(const char *pathname)
 size_t call_unlink_marshal(char *out, const char *pathname);
 bool call_unlink_unmarshal(const char *in, char *pathname);
 
-// ssize_t getdirentries(int fd, char *buf, size_t nbytes, off_t *basep)
-size_t call_getdirentries_marshal(char *out, int fd, size_t nbytes, off_t basep);
-bool call_getdirentries_unmarshal(const char *in, int *fd, size_t *nbytes, off_t *basep);
-
 // struct dirtreenode* getdirtree(const char *path)
 size_t call_dirtreenode_marshal(char *out, const char *path);
 bool call_dirtreenode_unmarshal(char *in, char *path);
 
+// getdirtree(path) for a client already holding the tree with version have
+size_t call_treev_marshal(char *out, const char *path, u_int64_t have);
+bool call_treev_unmarshal(const char *in, char *path, u_int64_t *have);
+// pwrite(fd, <chunks>, offset) with the chunks named by hash only
+size_t call_chunkq_marshal(char *out, int fd, off_t offset, const chunk_ref *refs, u_int32_t n);
+chunk_ref *call_chunkq_unmarshal(const char *in, int *fd, off_t *offset, u_int32_t *n);
+// the same write plus the chunks the server asked for. marshals the header
+// and the index list only, the chunk data is sent right after it;
+// unmarshal points data into in
+size_t call_chunkw_marshal(char *out, int fd, off_t offset, const chunk_ref *refs, u_int32_t n,
+                           const u_int32_t *missing, u_int32_t nmissing);
+chunk_ref *call_chunkw_unmarshal(const char *in, int *fd, off_t *offset, u_int32_t *n,
+                                 u_int32_t **missing, u_int32_t *nmissing, const char **data);
+// replace the file's content with new_len bytes rebuilt from nops ops,
+// marshals the header only, the ops follow it; ops_off is where they start
+size_t call_delta_marshal(char *out, int fd, u_int64_t new_len, u_int32_t block, u_int32_t nops);
+bool call_delta_unmarshal(const char *in, int *fd, u_int64_t *new_len, u_int32_t *block, u_int32_t *nops,
+                          size_t *ops_off);
+// the whole content and stat of n files by path, files over max bytes are
+// skipped; unmarshal returns paths pointing into in
+size_t call_mread_marshal(char *out, const char *const paths[], u_int32_t n, u_int32_t max);
+const char **call_mread_unmarshal(const char *in, u_int32_t *n, u_int32_t *max);
+
+// first message on a broker connection, the server it is meant for
+#define BROKER_HELLO_SIZE (sizeof(u_int32_t) + sizeof(u_int16_t))
+size_t broker_hello_marshal(char *out, u_int32_t addr, u_int16_t port);
+bool broker_hello_unmarshal(const char *in, u_int32_t *addr, u_int16_t *port);
+
+// FRAME_CALLBACK payload, the files whose callbacks are broken; none
+// means all of them
+size_t callback_marshal(char *out, const file_id *ids, u_int32_t n);
+file_id *callback_unmarshal(const char *in, u_int32_t *n);
+
 #endif
\ No newline at end of file
@@ -13,32 +13,313 @@
 #include <unistd.h>
 #include <sys/stat.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
 #include <sys/socket.h>
 #include <string.h>
 #include <err.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <dirent.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <poll.h>
 #include "serde.h"
 
 #define MAXMSGLEN   4096
 #define MAXTREESIZE 40960
 #define FD_OFFSET   1000
+#define MAXDIRPLUS  (1 << 20)
+#define MAXSNAPSHOT 8
+#define MAXCOMMIT   256
+#define COMMITPATH  48
+#define DURABLE_DATA 1          // O_DSYNC, synced with fdatasync
+#define DURABLE_FULL 2          // O_SYNC, synced with fsync
+#define SUMS_MIN    512
+#define SUMS_MAX    65536
+#define SLICE       (64 << 10)
+#define MAXCLIENTS  64
+#define CB_SLOTS    65536
+#define CB_PROBE    16
+#define CB_QUEUE    64
+#define CB_PUSH_MS  1000        // longest a writer waits on a holder's breaks
+#define FC_BLOCK    4096
+#define FC_MAXBLOCKS 16
+#define FC_ENTRIES  4096
+#define FC_PROBE    8
+#define FC_SKETCH   16384
+#define FC_MISS     (-2)
+#define RA_RECORDS  16
+#define RA_RANDOM   4
+#define RA_QUEUE    64
+#define MAXMREAD    (4 << 20)
+#define MAXEXTENTS  64
+
+// last tree sent to this client per root, for OP_TREEV deltas
+typedef struct tree_snapshot {
+    char *root;
+    u_int64_t hash;
+    struct dirtreenode *tree;
+} tree_snapshot;
+
+tree_snapshot snapshots[MAXSNAPSHOT];
+int next_snapshot;
+
+// writers of every connection wait here for a shared fdatasync batch,
+// lives in memory shared by all the forked session processes
+typedef struct commit_group {
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+    u_int64_t next_ticket;      // last ticket handed out
+    u_int64_t synced;           // every ticket up to here is durable
+    u_int64_t failures;         // batches in which some file failed to sync
+    pid_t leader;               // process running the current batch, 0 if none
+    int npending;               // the batch running stays here until it is done
+    char pending[MAXCOMMIT][COMMITPATH];   // /proc/<pid>/fd/<fd> of each waiting writer
+    unsigned char level[MAXCOMMIT];        // DURABLE_* of each
+} commit_group;
+
+commit_group *group;
+bool group_on;                  // groupcommit15440, else each writer syncs its own fd
+long commit_window_us;
+
+// directory of chunks uploaded by dedup writes, named by their SHA-256,
+// a session uses the subdirectory of its client host; dedup writes are
+// refused when chunkstore15440 is unset
+char *chunk_store;
+
+// DURABLE_* of fds opened with O_SYNC/O_DSYNC, their writes are acked
+// after a group commit
+unsigned char *durable;
+int durable_cap;
+
+// results of this session's last opens, for requests a pipelining client
+// sends before the open's reply came back (FD_PENDING)
+int opened[PENDING_OPENS];
+u_int32_t nopened;
+
+// bulk reads and writes of every connection take turns in slices of at
+// most SLICE bytes, deficit round robin across client hosts; metadata
+// calls go first. Shared by the forked sessions like the commit group.
+typedef struct sched_client {
+    in_addr_t addr;
+    int sessions;               // connections from this host, 0 for a free slot
+    int waiting;                // of them waiting for a slice
+    long deficit;               // bytes it may still run this round
+    size_t inflight;            // bytes of its slices running now
+} sched_client;
+
+// what one session holds, so the server can take it back if the session
+// dies without cleaning up
+typedef struct sched_session {
+    pid_t pid;                  // 0 for a free entry
+    int client;                 // its host in c[]
+    size_t held;                // bytes of the slice it is running
+    bool waiting;               // for a slice
+    bool meta;                  // in a metadata call
+} sched_session;
+
+typedef struct fair_sched {
+    pthread_mutex_t lock;
+    pthread_cond_t turn_cv;
+    int width;                  // slices running at once, 0 turns scheduling off
+    size_t inflight_max;        // bytes one host may have running
+    int meta;                   // metadata calls in progress
+    int running;                // slices running
+    int cursor;                 // round robin position
+    int turn;                   // host picked for the next slice, -1 if none
+    sched_client c[MAXCLIENTS];
+    sched_session s[MAXCLIENTS];
+} fair_sched;
+
+fair_sched *sched;
+int sched_slot = -1;            // this session's host, -1 if unscheduled
+sched_session *sched_me;        // this session's entry, NULL if unscheduled
+
+// attribute callbacks: a session whose client asks for them promises to
+// report changes to the files it stat'ed for it, so the client caches them
+// until told otherwise. A write, unlink or truncating open breaks the
+// callbacks of the other sessions on the file, each of them pushes the
+// breaks to its client before its next reply or wait for a request, and
+// the writer's reply waits for those pushes. Shared by the forked sessions
+// like the commit group.
+typedef struct callback {
+    file_id id;
+    u_int64_t holders;          // bit per session slot, 0 for a free entry
+} callback;
+
+typedef struct cb_session {
+    pid_t pid;                  // 0 for a free slot
+    bool overflow;              // breaks were dropped, the client drops all
+    u_int32_t nqueued;
+    file_id queue[CB_QUEUE];    // breaks not pushed yet
+    u_int64_t queued;           // breaks ever queued, dropped ones included
+    u_int64_t pushed;           // of those, sent to the client
+} cb_session;
+
+typedef struct callback_table {
+    pthread_mutex_t lock;
+    pthread_cond_t pushed_cv;   // a session pushed its breaks or went away
+    u_int64_t epoch;            // bumped for every callback set
+    cb_session s[MAXCLIENTS];
+    callback slots[CB_SLOTS];   // open addressing, CB_PROBE entries per file
+} callback_table;
+
+callback_table *callbacks;
+int cb_slot = -1;               // this session's slot, -1 until its client watches
+int cb_sessfd = -1;             // this session's socket, breaks are pushed on it
+sigset_t cb_waitmask;           // signal mask while waiting for a request
+u_int64_t *cb_seen;             // epoch of the last break per fd, see callback_fd
+int cb_seen_cap;
+
+// contents of small hot files, so reads of them are copied from memory.
+// Keyed by file and mtime; a file is admitted on its second recent read
+// and only if a scan of colder files can't push out warmer ones. Shared by
+// the forked sessions like the commit group, the data lives in fc_arena in
+// FC_BLOCK blocks.
+typedef struct fc_entry {
+    file_id id;
+    struct timespec mtime;
+    off_t size;
+    bool used;
+    u_int8_t ref;               // clock counter, hits raise it to 3
+    u_int32_t nblocks;
+    u_int32_t block[FC_MAXBLOCKS];
+} fc_entry;
+
+typedef struct file_cache {
+    pthread_mutex_t lock;
+    u_int32_t nblocks;          // blocks in the arena, 0 turns the cache off
+    u_int32_t nfree;
+    u_int32_t hand;             // clock hand over the entries
+    u_int32_t sketch_adds;      // reads counted since the sketch was halved
+    u_int8_t sketch[FC_SKETCH]; // recent reads per file hash, saturating
+    fc_entry e[FC_ENTRIES];
+    u_int32_t free_blocks[];    // stack of free blocks
+} file_cache;
+
+file_cache *fcache;
+char *fc_arena;
+unsigned char *fc_readable;     // per fd, opened for reading
+int fc_readable_cap;
+
+// readahead: reads on each fd are matched against a sequential or a
+// strided stream. sequential streams get FADV_SEQUENTIAL, the kernel
+// reads those ahead well on its own; for strided streams the records the
+// client will ask for next are pulled into the page cache by a background
+// thread; fds read at random get FADV_RANDOM so the kernel stops reading
+// ahead for them. readahead15440=0 turns it off
+typedef struct ra_state {
+    off_t last;                 // offset of the last read
+    off_t next;                 // where a sequential read would start
+    off_t stride;               // distance between the last two reads
+    int streak;                 // reads in a row matching the stream
+    int misses;                 // reads in a row matching nothing
+    int advice;                 // POSIX_FADV_* last set on the fd
+    off_t ahead;                // next record the thread will fetch
+} ra_state;
+
+// ranges for the readahead thread, count records of len bytes stride apart
+typedef struct ra_job {
+    int fd;                     // a dup, the session may close its fd meanwhile
+    off_t off;
+    size_t len;
+    off_t stride;
+    int count;
+} ra_job;
+
+bool ra_on;
+ra_state *ra;
+int ra_cap;
+ra_job ra_jobs[RA_QUEUE];
+int ra_head, ra_count;
+bool ra_started;
+pthread_mutex_t ra_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t ra_cv = PTHREAD_COND_INITIALIZER;
+
+// busypoll15440: microseconds a session spins for the next request before
+// sleeping, and SO_BUSY_POLL on its socket; unset sleeps right away
+int busy_poll_us;
+
+// per session receive buffer, page aligned and reused across frames so
+// write data lands once and is handed to the kernel from where it landed
+char *rx_pool;
+size_t rx_cap;
+long page_size;
 
 void handle_session(int sessfd);
-void send_all(int sessfd, const void *data, size_t size);
+char *rx_buffer(size_t lead, size_t total);
+size_t bulk_lead(const char *hdr, size_t have);
+void send_all(int sessfd, const void *data, size_t size, bool crc, bool sliced);
 int pack_fd(int fd);
 int unpack_fd(int fd);
 rpc_resp * handle(const struct rpc_frame* frame);
-rpc_resp * do_open(const rpc_frame* frame);
-rpc_resp * do_close(const rpc_frame* frame);
-rpc_resp * do_write(const rpc_frame* frame);
-rpc_resp * do_read(const rpc_frame* frame);
-rpc_resp * do_lseek(const rpc_frame* frame);
-rpc_resp * do_stat(const rpc_frame* frame);
-rpc_resp * do_unlink(const rpc_frame* frame);
-rpc_resp * do_getdirentries(const rpc_frame *frame);
-rpc_resp * do_dirtreenode(const rpc_frame *frame);
+// do_<name>() for every op in RPC_OPS
+#define RPC_HANDLER(OP, code, name, kind, shape) rpc_resp * do_##name(const rpc_frame* frame);
+RPC_OPS(RPC_HANDLER)
+int data_extents(int fd, off_t offset, size_t count, off_t *ext, off_t *end);
+off_t offset_after_write(int fd, off_t offset, ssize_t r);
+char *chunk_path(const chunk_ref *ref);
+bool chunk_present(const chunk_ref *ref);
+int chunk_put(const chunk_ref *ref, const char *data);
+void chunk_scope(in_addr_t addr);
+ssize_t chunk_write(int fd, off_t offset, const chunk_ref *refs, u_int32_t n, const char **given);
+int delta_apply(const char *ops, u_int32_t nops, u_int32_t block, int old_fd, int out_fd, char *out_buf,
+                u_int64_t new_len);
+size_t tree_diff(const struct dirtreenode *old, const struct dirtreenode *new,
+                 const char *prefix, char **out, size_t *cap, size_t off, u_int32_t *nops);
+char *ensure_cap(char *buf, size_t *cap, size_t need);
+void group_init();
+void group_lock();
+int group_commit(int fd, int level);
+int durable_sync(int fd, int level);
+void group_reap(pid_t pid);
+ssize_t durable_ack(int fd, ssize_t r);
+void set_durable(int fd, int on);
+void shared_sync_init(pthread_mutex_t *lock, pthread_cond_t *cond);
+void shared_lock(pthread_mutex_t *lock);
+void sched_init();
+void sched_join(in_addr_t addr);
+void sched_reap(pid_t pid);
+void reap_sessions();
+void reap_signal(int sig);
+void sched_meta(bool begin);
+bool op_is_meta(u_int32_t opcode);
+void sched_pick();
+void sched_acquire(size_t bytes);
+void sched_release();
+ssize_t sched_io(int fd, void *buf, size_t count, off_t offset, bool write_op);
+ssize_t sched_iov(int fd, struct iovec *iov, int iovcnt, off_t offset, bool write_op);
+void callback_init();
+bool callback_join();
+void callback_leave();
+void callback_reap(pid_t pid);
+void callback_signal(int sig);
+callback *callback_find(const file_id *id, bool insert);
+void callback_notify(callback *cb, u_int64_t keep);
+int callback_statat(int dirfd, const char *path, struct stat *st);
+void callback_break(dev_t dev, ino_t ino);
+void callback_break_parent(const char *path);
+void callback_fd(int fd);
+void callback_fd_reset(int fd);
+bool callback_wait(int sessfd);
+void busy_wait(int sessfd);
+void callback_push(int sessfd);
+void fcache_init();
+void fcache_track(int fd, int on);
+ssize_t fcache_read(int fd, char *buf, size_t count, off_t offset);
+u_int8_t *fcache_sketch(const file_id *id);
+fc_entry *fcache_find(const file_id *id, fc_entry **home);
+void fcache_evict(fc_entry *e);
+bool fcache_admit(const struct stat *st, const char *data, fc_entry *home);
+void ra_reset(int fd);
+void ra_observe(int fd, off_t off, size_t len);
+void ra_queue(int fd, off_t off, size_t len, off_t stride, int count);
+void *ra_worker(void *arg);
 
 int main(int argc, char**argv) {
     fprintf(stderr, "-----rpc server-----\n");
@@ -57,6 +338,15 @@ int main(int argc, char**argv) {
 	sockfd = socket(AF_INET, SOCK_STREAM, 0);	// TCP/IP socket
 	if (sockfd<0) err(1, 0);			// in case of error
 	
+	// accepted sockets inherit the buffer sizes, set before listen so the
+	// window scale fits them
+	char *sockbuf = getenv("sockbuf15440");
+	if (sockbuf) {
+		int size = atoi(sockbuf);
+		setsockopt(sockfd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+		setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+	}
+
 	// setup address structure to indicate server port
 	memset(&srv, 0, sizeof(srv));			// clear it first
 	srv.sin_family = AF_INET;			// IP family
@@ -70,19 +360,67 @@ int main(int argc, char**argv) {
 	// start listening for connections
 	rv = listen(sockfd, 5);
 	if (rv<0) err(1,0);
+
+    // a client gone mid reply must fail send(), so the session exits
+    // through err() and gives its scheduler share back
+    signal(SIGPIPE, SIG_IGN);
+    // dead sessions are reaped and their shared state taken back in the
+    // loop below; SIGCHLD only gets through while waiting for a client
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = reap_signal;
+    sigaction(SIGCHLD, &sa, NULL);
+    sigset_t block, accept_mask;
+    sigemptyset(&block);
+    sigaddset(&block, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &block, &accept_mask);
+    sigdelset(&accept_mask, SIGCHLD);
+    page_size = sysconf(_SC_PAGESIZE);
+
+    // shared by the session processes forked below
+    group_init();
+    sched_init();
+    callback_init();
+    fcache_init();
+    char *ra_env = getenv("readahead15440");
+    ra_on = ra_env == NULL || atoi(ra_env) != 0;
+    char *busypoll = getenv("busypoll15440");
+    busy_poll_us = busypoll ? atoi(busypoll) : 0;
+    // a spinning receive holds the only CPU the other end needs to answer
+    if (sysconf(_SC_NPROCESSORS_ONLN) < 2) {
+        busy_poll_us = 0;
+    }
+    chunk_store = getenv("chunkstore15440");
+    if (chunk_store != NULL && mkdir(chunk_store, 0700) < 0 && errno != EEXIST) err(1, 0);
     fprintf(stderr, "===== server started on port %d\n", port);
 	// main server loop, handle clients one at a time, quit after 10 clients
 	while(1) {
+		reap_sessions();
 		// wait for next client, get session socket
 		sa_size = sizeof(struct sockaddr_in);
         fprintf(stderr, "listening...\n");
+		struct pollfd pfd = { .fd = sockfd, .events = POLLIN };
+		if (ppoll(&pfd, 1, NULL, &accept_mask) < 0) {
+			if (errno == EINTR) continue;
+			err(1, 0);
+		}
 		sessfd = accept(sockfd, (struct sockaddr *)&cli, &sa_size);
         fprintf(stderr, "\n===\nnew connection (%d)\n", sessfd);
 		if (sessfd<0) err(1,0);
+		// replies end in a partial segment, don't wait on the client's ACK
+		int on = 1;
+		setsockopt(sessfd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+		if (busy_poll_us > 0) {
+			setsockopt(sessfd, SOL_SOCKET, SO_BUSY_POLL, &busy_poll_us, sizeof(busy_poll_us));
+		}
         rv = fork();
         if (rv == 0) { // child process
             fprintf(stderr, "fork child - handling request...\n");
             close(sockfd);
+            signal(SIGCHLD, SIG_DFL);
+            sigprocmask(SIG_UNBLOCK, &block, NULL);
+            sched_join(cli.sin_addr.s_addr);
+            chunk_scope(cli.sin_addr.s_addr);
             handle_session(sessfd);
             close(sessfd);
             fprintf(stderr, "request end...\n");
@@ -105,137 +443,243 @@ int pack_fd(int fd) {
 }
 
 int unpack_fd(int fd) {
+    if (FD_IS_PENDING(fd)) {
+        return opened[FD_PENDING_SLOT(fd)];
+    }
     if (fd < 0) {
         return fd;
     }
     return fd - FD_OFFSET;
 }
 
-// send all bytes in data
-void send_all(int sessfd, const void *data, size_t size) {
-    int frame_size = (int)size;
+// send all bytes in data, with a CRC32C trailer if crc; a sliced reply
+// takes scheduled turns like the bulk I/O that produced it
+void send_all(int sessfd, const void *data, size_t size, bool crc, bool sliced) {
+    if (size > FRAME_MAX) {
+        // the flags share the size word
+        errno = EMSGSIZE;
+        err(1, 0);
+    }
+    int frame_size = (int)size | (crc ? FRAME_CRC : 0);
     char buf[MAXMSGLEN];
     ssize_t rv;
-    size_t pending = size;
+    u_int32_t sum = 0;
+    size_t total = size;
+    if (crc) {
+        sum = crc32c(crc32c(0, &frame_size, sizeof(int)), data, size);
+        total += sizeof(u_int32_t);
+    }
+    size_t pending = total;
     fprintf(stderr, "server send_all data [%zu]\n", size);
 
     // size of package first
     size_t off = mem_write_data(buf, 0, &frame_size, sizeof(int));
+    size_t slice_left = 0;
     while(pending > 0) {
         // actual data size to be sent in this round
         size_t len = pending > MAXMSGLEN - off? MAXMSGLEN - off: pending;
-        // fill in buffer
-        off = mem_write_data(buf, off, data + (size - pending), len);
-        // send, may end up in multiple sends
+        if (sliced && slice_left == 0) {
+            sched_release();
+            slice_left = pending < SLICE ? pending : SLICE;
+            sched_acquire(slice_left);
+        }
+        slice_left = slice_left > len ? slice_left - len : 0;
+        // fill in buffer, the trailer goes in the same send as the data end
+        size_t pos = total - pending;
+        size_t n = pos >= size ? 0 : (len < size - pos ? len : size - pos);
+        off = mem_write_data(buf, off, data + pos, n);
+        off = mem_write_data(buf, off, (char *) &sum + (pos + n - size), len - n);
+        // send, may end up in multiple sends; never block holding a turn,
+        // a client that stops reading would keep it from everyone
         size_t sent = 0;
-        while((rv = send(sessfd, buf + sent, off - sent, 0)) > 0) {
-            sent += rv;
-            if (sent >= off) {
-                break;
+        while (sent < off) {
+            rv = send(sessfd, buf + sent, off - sent, sched_me != NULL && sched_me->held > 0 ? MSG_DONTWAIT : 0);
+            if (rv < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                size_t left = slice_left + off - sent;
+                sched_release();
+                struct pollfd pfd = { .fd = sessfd, .events = POLLOUT };
+                if (poll(&pfd, 1, -1) < 0 && errno != EINTR) err(1, 0);
+                sched_acquire(left);
+                continue;
             }
+            if (rv <= 0) err(1, 0);
+            sent += rv;
         }
-        if (rv < 0) err(1, 0);
         // update pending bytes and off
         pending -= len;
         off = 0;
     }
+    sched_release();
     fprintf(stderr, "server send_all finished\n");
 }
 
 void handle_session(int sessfd) {
     ssize_t rv;
     char buf[MAXMSGLEN];
+    // last response, sent again if the client got it corrupted
+    char *last = NULL;
+    size_t last_len = 0;
+    bool last_crc = false;
+    // bytes received past the last frame, a pipelining client sends its
+    // next requests before reading the reply
+    size_t received = 0;
     if (sessfd<0) err(1,0);
+    cb_sessfd = sessfd;
 
     // get messages and send replies to this client, until it goes away
-    while ( (rv=recv(sessfd, buf, MAXMSGLEN, 0)) > 0) {
+    while (received > 0 || (callback_wait(sessfd) && (rv=recv(sessfd, buf, MAXMSGLEN, 0)) > 0)) {
         fprintf(stderr, "server received new frame\n");
 
         int frame_size = 0;
-        ssize_t received = rv;
+        if (received == 0) {
+            received = rv;
+        }
 
         // receive bytes of size sizeof(int) to indicate size of frame
         while(received < sizeof(int)) {
             rv = recv(sessfd, buf + received, MAXMSGLEN - received, 0);
-            if (rv < 0) err(1,0);
+            if (rv <= 0) err(1,0);
             received += rv;
         }
 
-        memcpy(&frame_size, buf, sizeof(int));
+        int word;
+        memcpy(&word, buf, sizeof(int));
+        if (word & FRAME_NACK) {
+            fprintf(stderr, "server - response arrived corrupt, sending it again\n");
+            received -= sizeof(int);
+            memmove(buf, buf + sizeof(int), received);
+            if (last != NULL) {
+                send_all(sessfd, last, last_len, last_crc, false);
+            }
+            continue;
+        }
+        frame_size = FRAME_SIZE(word);
+        bool crc = (word & FRAME_CRC) != 0;
 
         if (frame_size <= 0) {
             fprintf(stderr, "server error - invalid frame size? [%d]\n", frame_size);
             err(1,0);
         }
 
-        // receive the rest of bytes until end
-        char *data = malloc(frame_size);
+        // receive the rest of bytes until end, into the pool and placed so
+        // the data of a write starts on a page
+        size_t total = frame_size + (crc ? sizeof(u_int32_t) : 0);
+        char *data = rx_buffer(bulk_lead(buf + sizeof(int), received - sizeof(int)), total);
 
-        // copy residue bytes first from last recv
-        size_t off = mem_write_data(data, 0, buf + sizeof(int), received - sizeof(int));
+        // copy residue bytes first from last recv, keep what belongs to
+        // the next frame
+        size_t n = received - sizeof(int) < total ? received - sizeof(int) : total;
+        size_t off = mem_write_data(data, 0, buf + sizeof(int), n);
+        received -= sizeof(int) + n;
+        memmove(buf, buf + sizeof(int) + n, received);
 
-        while(off < frame_size) {
-            rv = recv(sessfd, buf, MAXMSGLEN, 0);
-            if (rv < 0) {
+        while(off < total) {
+            rv = recv(sessfd, data + off, total - off, 0);
+            if (rv <= 0) {
                 err(1, 0);
             }
-            off = mem_write_data(data, off, buf, rv);
+            off += rv;
         }
         fprintf(stderr, "server finished receiving frame: [%d]\n", frame_size);
 
+        if (crc) {
+            u_int32_t sum;
+            memcpy(&sum, data + frame_size, sizeof(u_int32_t));
+            if (sum != crc32c(crc32c(0, &word, sizeof(int)), data, frame_size)) {
+                // nothing in it can be trusted, have the client send it again
+                fprintf(stderr, "server - frame checksum mismatch\n");
+                int nack = FRAME_NACK;
+                if (send(sessfd, &nack, sizeof(int), 0) < 0) err(1, 0);
+                continue;
+            }
+        }
+
         // unmarshal
         struct rpc_frame* frame = malloc(sizeof(rpc_frame));
         if(!read_frame(data, frame)) {
             free(frame);
-            free(data);
             err(1,0);
         }
 
-        // handle request
+        // handle request, metadata calls jump the queue of bulk slices
+        bool meta = op_is_meta(frame->opcode);
+        if (meta) {
+            sched_meta(true);
+        }
         rpc_resp * resp = handle(frame);
+        if (meta) {
+            sched_meta(false);
+        }
 
         // marshal resp
         char *out = malloc(resp->size + sizeof(rpc_resp));
         size_t len = marshal_resp(out, resp);
 
-        // send response
+        // send response, after breaks another session's call queued meanwhile
+        if (cb_slot >= 0) {
+            callback_push(sessfd);
+        }
         fprintf(stderr, "server response to client..[%zu]\n", len);
-        send_all(sessfd, out, len);	// should check return value
+        send_all(sessfd, out, len, crc, !meta);	// should check return value
 
         // free resource
         free(resp->data);
         free(resp);
-        free(out);
-        free(frame->payload);
+        free(last);
+        last = out;
+        last_len = len;
+        last_crc = crc;
         free(frame);
-        free(data);
     }
+    free(last);
     // either client closed connection, or error
     if (rv<0) err(1,0);
 }
 
+// room for a frame of total bytes in the session pool, offset so the
+// byte at lead is page aligned; grows the pool, never shrinks it
+char *rx_buffer(size_t lead, size_t total) {
+    size_t pad = (page_size - lead % page_size) % page_size;
+    if (pad + total > rx_cap) {
+        free(rx_pool);
+        rx_cap = (pad + total + page_size - 1) / page_size * page_size;
+        if (posix_memalign((void **) &rx_pool, page_size, rx_cap) != 0) err(1, 0);
+    }
+    return rx_pool + pad;
+}
+
+// bytes of a frame before its write data, from the have bytes of it
+// already received; 0 for frames carrying none or too little seen yet
+size_t bulk_lead(const char *hdr, size_t have) {
+    u_int32_t opcode, iovcnt;
+    size_t head = sizeof(u_int32_t) * 2;
+    if (have < head) {
+        return 0;
+    }
+    memcpy(&opcode, hdr, sizeof(u_int32_t));
+    switch (opcode) {
+        case OP_WRITE:
+            return head + sizeof(u_int32_t) + sizeof(size_t);
+        case OP_PWRITE:
+            return head + sizeof(u_int32_t) + sizeof(off_t) + sizeof(size_t);
+        case OP_PWRITEV:
+            head += sizeof(u_int32_t) + sizeof(off_t);
+            if (have < head + sizeof(u_int32_t)) {
+                return 0;
+            }
+            memcpy(&iovcnt, hdr + head, sizeof(u_int32_t));
+            return head + sizeof(u_int32_t) + sizeof(size_t) * iovcnt;
+        default:
+            return 0;
+    }
+}
+
 
 
 rpc_resp* handle(const struct rpc_frame* frame) {
     switch (frame->opcode) {
-        case OP_OPEN:
-            return do_open(frame);
-        case OP_CLOSE:
-            return do_close(frame);
-        case OP_WRITE:
-            return do_write(frame);
-        case OP_READ:
-            return do_read(frame);
-        case OP_LSEEK:
-            return do_lseek(frame);
-        case OP_STAT:
-            return do_stat(frame);
-        case OP_UNLINK:
-            return do_unlink(frame);
-        case OP_GETDIR:
-            return do_getdirentries(frame);
-        case OP_GETTRR:
-            return do_dirtreenode(frame);
+#define RPC_DISPATCH(OP, code, name, kind, shape) case OP_##OP: return do_##name(frame);
+        RPC_OPS(RPC_DISPATCH)
         default:
             err(1, 0);
     }
@@ -261,6 +705,129 @@ rpc_resp * do_dirtreenode(const rpc_frame *frame) {
     return resp;
 }
 
+rpc_resp * do_treev(const rpc_frame *frame) {
+    fprintf(stderr, "do treev\n");
+    char *path = malloc(MAXMSGLEN);
+    u_int64_t have;
+    rpc_resp *resp = malloc(sizeof(rpc_resp));
+    call_treev_unmarshal(frame->payload, path, &have);
+
+    struct dirtreenode* tree = getdirtree(path);
+    resp->err_no = errno;
+    if (tree == NULL) {
+        resp->size = 0;
+        resp->data = NULL;
+        free(path);
+        return resp;
+    }
+    u_int64_t hash = tree_hash(tree);
+
+    int i;
+    tree_snapshot *snap = NULL;
+    for (i = 0; i < MAXSNAPSHOT; i++) {
+        if (snapshots[i].root != NULL && strcmp(snapshots[i].root, path) == 0) {
+            snap = &snapshots[i];
+            break;
+        }
+    }
+
+    size_t cap = sizeof(u_int32_t) + sizeof(u_int64_t);
+    resp->data = malloc(cap);
+    size_t off;
+    if (hash == have) {
+        off = mem_write_int32(resp->data, 0, TREE_UNCHANGED);
+    } else if (snap != NULL && snap->hash == have) {
+        // ops follow [kind][hash][nops], nops is patched in at the end
+        u_int32_t nops = 0;
+        size_t head = sizeof(u_int32_t) * 2 + sizeof(u_int64_t);
+        resp->data = ensure_cap(resp->data, &cap, head);
+        off = tree_diff(snap->tree, tree, "", &resp->data, &cap, head, &nops);
+        size_t h = mem_write_int32(resp->data, 0, TREE_DELTA);
+        h = mem_write_data(resp->data, h, &hash, sizeof(u_int64_t));
+        mem_write_int32(resp->data, h, nops);
+    } else {
+        resp->data = ensure_cap(resp->data, &cap, cap + mem_tree_size(tree));
+        off = mem_write_int32(resp->data, 0, TREE_FULL);
+        off = mem_write_data(resp->data, off, &hash, sizeof(u_int64_t));
+        off = mem_write_tree(tree, resp->data, off);
+    }
+    resp->size = off;
+
+    // remember what the client holds now
+    if (snap == NULL) {
+        snap = &snapshots[next_snapshot];
+        next_snapshot = (next_snapshot + 1) % MAXSNAPSHOT;
+        free(snap->root);
+        if (snap->tree != NULL) freedirtree(snap->tree);
+        snap->root = strdup(path);
+    } else {
+        freedirtree(snap->tree);
+    }
+    snap->hash = hash;
+    snap->tree = tree;
+    fprintf(stderr, "op: treev return size %zu\n", off);
+    free(path);
+    return resp;
+}
+
+// grow buf to hold need bytes
+char *ensure_cap(char *buf, size_t *cap, size_t need) {
+    if (need <= *cap) {
+        return buf;
+    }
+    while (*cap < need) {
+        *cap *= 2;
+    }
+    return realloc(buf, *cap);
+}
+
+/**
+ * append ops turning old into new to *out at off, deletions of a parent
+ * come before its additions, and additions are in index order.
+ * paths are relative to the root, "" is the root itself.
+ */
+size_t tree_diff(const struct dirtreenode *old, const struct dirtreenode *new,
+                 const char *prefix, char **out, size_t *cap, size_t off, u_int32_t *nops) {
+    int i, j;
+    char *path = malloc(strlen(prefix) + MAXMSGLEN);
+    for (i = 0; i < old->num_subdirs; i++) {
+        for (j = 0; j < new->num_subdirs; j++) {
+            if (strcmp(old->subdirs[i]->name, new->subdirs[j]->name) == 0) break;
+        }
+        if (j == new->num_subdirs) {
+            sprintf(path, "%s%s%s", prefix, *prefix ? "/" : "", old->subdirs[i]->name);
+            u_int32_t path_len = strlen(path) + 1;
+            *out = ensure_cap(*out, cap, off + sizeof(u_int32_t) * 3 + path_len);
+            off = mem_write_int32(*out, off, TREE_OP_DEL);
+            off = mem_write_int32(*out, off, path_len);
+            off = mem_write_data(*out, off, path, path_len);
+            off = mem_write_int32(*out, off, 0);
+            ++*nops;
+        }
+    }
+    for (j = 0; j < new->num_subdirs; j++) {
+        for (i = 0; i < old->num_subdirs; i++) {
+            if (strcmp(old->subdirs[i]->name, new->subdirs[j]->name) == 0) break;
+        }
+        if (i == old->num_subdirs) {
+            u_int32_t path_len = strlen(prefix) + 1;
+            *out = ensure_cap(*out, cap, off + sizeof(u_int32_t) * 3 + path_len
+                              + mem_tree_size(new->subdirs[j]));
+            off = mem_write_int32(*out, off, TREE_OP_ADD);
+            off = mem_write_int32(*out, off, path_len);
+            off = mem_write_data(*out, off, prefix, path_len);
+            off = mem_write_int32(*out, off, j);
+            off = mem_write_tree(new->subdirs[j], *out, off);
+            ++*nops;
+        } else {
+            sprintf(path, "%s%s%s", prefix, *prefix ? "/" : "", new->subdirs[j]->name);
+            off = tree_diff(old->subdirs[i], new->subdirs[j], path, out, cap, off, nops);
+        }
+    }
+    free(path);
+    return off;
+}
+
 rpc_resp* do_getdirentries(const rpc_frame* frame) {
     fprintf(stderr, "do getdirentries\n");
     int fd;
@@ -268,7 +835,7 @@ rpc_resp* do_getdirentries(const rpc_frame* frame) {
     off_t basep = 0;
     rpc_resp *resp = malloc(sizeof(rpc_resp));
     fprintf(stderr, "frame size: [%d]\n", frame->payload_size);
-    call_getdirentries_unmarshal(frame->payload, &fd, &nbytes, &basep);
+    call_getdirentries_unmarshal(frame->payload, &fd, &basep, &nbytes);
     char *buf = malloc(nbytes);
     fd = unpack_fd(fd);
 
@@ -286,14 +853,79 @@ rpc_resp* do_getdirentries(const rpc_frame* frame) {
     return resp;
 }
 
+rpc_resp* do_readdirplus(const rpc_frame* frame) {
+    fprintf(stderr, "do readdirplus\n");
+    int fd;
+    size_t nbytes = 0;
+    off_t cursor = 0;
+    u_int32_t watch;
+    rpc_resp *resp = malloc(sizeof(rpc_resp));
+    call_readdirplus_unmarshal(frame->payload, &fd, &cursor, &nbytes, &watch);
+    fd = unpack_fd(fd);
+    if (nbytes > MAXDIRPLUS) {
+        nbytes = MAXDIRPLUS;
+    }
+
+    // the cursor is the client's position, not ours
+    char *buf = malloc(nbytes);
+    ssize_t r = -1;
+    off_t basep;
+    if (lseek(fd, cursor, SEEK_SET) >= 0) {
+        r = getdirentries(fd, buf, nbytes, &basep);
+    }
+    resp->err_no = errno;
+
+    // count entries first to size the response
+    u_int32_t nent = 0;
+    ssize_t pos = 0;
+    while (pos < r) {
+        pos += ((struct dirent *) (buf + pos))->d_reclen;
+        ++nent;
+    }
+
+    // [r][dirents][nent][(stat result, stat) per entry][promised]
+    u_int32_t promised = watch && nent > 0 && callback_join();
+    resp->data = malloc(sizeof(ssize_t) + (r > 0 ? r : 0) + sizeof(u_int32_t) * 2
+                        + nent * (sizeof(int) + sizeof(struct stat)));
+    size_t off = mem_write_data(resp->data, 0, &r, sizeof(ssize_t));
+    if (r > 0) {
+        off = mem_write_data(resp->data, off, buf, r);
+    }
+    off = mem_write_int32(resp->data, off, nent);
+    pos = 0;
+    while (pos < r) {
+        struct dirent *ent = (struct dirent *) (buf + pos);
+        struct stat st;
+        int sr = fstatat(fd, ent->d_name, &st, 0);
+        if (sr == 0 && promised) {
+            // an entry that can't be promised is not cached at all
+            sr = callback_statat(fd, ent->d_name, &st);
+        }
+        off = mem_write_int32(resp->data, off, sr);
+        off = mem_write_data(resp->data, off, &st, sizeof(struct stat));
+        pos += ent->d_reclen;
+    }
+    off = mem_write_int32(resp->data, off, promised);
+    resp->size = off;
+    fprintf(stderr, "op: readdirplus return %zd, %u entries\n", r, nent);
+    free(buf);
+    return resp;
+}
+
 rpc_resp* do_unlink(const rpc_frame* frame) {
     fprintf(stderr, "do unlink\n");
     char *pathname = malloc(MAXMSGLEN);
     rpc_resp *resp = malloc(sizeof(rpc_resp));
     fprintf(stderr, "frame size: [%d]\n", frame->payload_size);
     call_unlink_unmarshal(frame->payload, pathname);
+    struct stat st;
+    bool known = __atomic_load_n(&callbacks->epoch, __ATOMIC_ACQUIRE) > 1 && lstat(pathname, &st) == 0;
     int r = unlink(pathname);
     resp->err_no = errno;
+    if (r == 0 && known) {
+        callback_break(st.st_dev, st.st_ino);
+        callback_break_parent(pathname);
+    }
     resp->data = malloc(MAXMSGLEN);
     size_t off = mem_write_int32(resp->data, 0, r);
     resp->size = off;
@@ -309,14 +941,20 @@ rpc_resp* do_stat(const rpc_frame* frame) {
     struct stat stat_buf;
     rpc_resp *resp = malloc(sizeof(rpc_resp));
     fprintf(stderr, "frame size: [%d]\n", frame->payload_size);
-    call_stat_unmarshal(frame->payload, &ver, path);
+    u_int32_t watch;
+    call_stat_unmarshal(frame->payload, &ver, path, &watch);
     int r = __xstat(ver, path, &stat_buf);
     resp->err_no = errno;
+    u_int32_t promised = 0;
+    if (r >= 0 && watch && callback_join()) {
+        promised = callback_statat(AT_FDCWD, path, &stat_buf) == 0;
+    }
     resp->data = malloc(MAXMSGLEN);
     size_t off = mem_write_int32(resp->data, 0, r);
     if (r>= 0) {
         off = mem_write_data(resp->data, off, &stat_buf, sizeof(struct stat));
     }
+    off = mem_write_int32(resp->data, off, promised);
     resp->size = off;
     fprintf(stderr, "op: __xstat return %d\n", r);
     free(path);
@@ -352,8 +990,17 @@ rpc_resp* do_read(const rpc_frame* frame) {
     fprintf(stderr, "frame size: [%d]\n", frame->payload_size);
     call_read_unmarshal(frame->payload, &fd_in, &count);
     int fd = unpack_fd(fd_in);
+    // the reply must fit a frame, a short read is allowed
+    count = count < IO_MAX ? count : IO_MAX;
     char *buf = malloc(count);
-    ssize_t r = read(fd, buf, count);
+    off_t pos = lseek(fd, 0, SEEK_CUR);
+    ra_observe(fd, pos, count);
+    ssize_t r = pos < 0 ? FC_MISS : fcache_read(fd, buf, count, pos);
+    if (r == FC_MISS) {
+        r = sched_io(fd, buf, count, -1, false);
+    } else {
+        lseek(fd, pos + r, SEEK_SET);
+    }
     resp->err_no = errno;
     resp->data = malloc(r + sizeof(ssize_t));
     size_t off = 0;
@@ -368,56 +1015,1946 @@ rpc_resp* do_read(const rpc_frame* frame) {
     return resp;
 }
 
-rpc_resp* do_open(const rpc_frame* frame) {
-    fprintf(stderr, "do open\n");
-    char *pathname = malloc(MAXMSGLEN);
-    u_int32_t flag;
-    u_int16_t mode;
+rpc_resp* do_pread(const rpc_frame* frame) {
+    fprintf(stderr, "do pread\n");
+    int fd_in;
+    size_t count;
+    off_t offset;
     rpc_resp *resp = malloc(sizeof(rpc_resp));
 
     fprintf(stderr, "frame size: [%d]\n", frame->payload_size);
-    call_open_unmarshal(frame->payload, pathname, &flag, &mode);
-    int fd = open(pathname, (int)flag, mode);
-    int fd_out = pack_fd(fd);
+    call_pread_unmarshal(frame->payload, &fd_in, &count, &offset);
+    int fd = unpack_fd(fd_in);
+    count = count < IO_MAX ? count : IO_MAX;
+    char *buf = malloc(count);
+    ra_observe(fd, offset, count);
+    // data extents as (start, end) pairs, the holes between them are
+    // neither read nor sent
+    off_t ext[2 * MAXEXTENTS];
+    off_t end;
+    int n = -1;
+    int i;
+    ssize_t r = fcache_read(fd, buf, count, offset);
+    if (r == FC_MISS) {
+        n = data_extents(fd, offset, count, ext, &end);
+    }
+    if (n >= 0) {
+        size_t got = 0;
+        r = end - offset;
+        for (i = 0; i < n; i++) {
+            size_t len = ext[2 * i + 1] - ext[2 * i];
+            ssize_t k = sched_io(fd, buf + got, len, ext[2 * i], false);
+            if (k < 0) {
+                r = -1;
+                break;
+            }
+            got += k;
+            if ((size_t) k < len) {
+                // the file shrank meanwhile, it ends here
+                ext[2 * i + 1] = ext[2 * i] + k;
+                r = ext[2 * i + 1] - offset;
+                n = i + 1;
+                break;
+            }
+        }
+    } else {
+        if (r == FC_MISS) {
+            r = sched_io(fd, buf, count, offset, false);
+        }
+        n = 1;
+        ext[0] = offset;
+        ext[1] = offset + (r > 0 ? r : 0);
+    }
     resp->err_no = errno;
-    resp->size = sizeof(int);
+    if (r <= 0) {
+        n = 0;
+    }
+
+    // [r][n][(start from offset, length) per data extent][their data]
+    size_t data_len = 0;
+    for (i = 0; i < n; i++) {
+        data_len += ext[2 * i + 1] - ext[2 * i];
+    }
+    resp->data = malloc(sizeof(ssize_t) + sizeof(u_int32_t) + n * 2 * sizeof(u_int64_t) + data_len);
+    size_t off = 0;
+    off = mem_write_data(resp->data, off, &r, sizeof(ssize_t));
+    off = mem_write_int32(resp->data, off, n);
+    for (i = 0; i < n; i++) {
+        u_int64_t start = ext[2 * i] - offset;
+        u_int64_t len = ext[2 * i + 1] - ext[2 * i];
+        off = mem_write_data(resp->data, off, &start, sizeof(u_int64_t));
+        off = mem_write_data(resp->data, off, &len, sizeof(u_int64_t));
+    }
+    off = mem_write_data(resp->data, off, buf, data_len);
+    resp->size = off;
+    fprintf(stderr, "op: pread return %zd, %d extents %zu bytes\n", r, n, data_len);
+    free(buf);
+    return resp;
+}
+
+// the data extents of [offset, offset + count) as (start, end) pairs,
+// found with SEEK_DATA/SEEK_HOLE; *end is where the read stops. -1 if the
+// file has no holes or the filesystem can't tell, it is read whole then.
+// past MAXEXTENTS the rest goes as one extent, holes and all
+int data_extents(int fd, off_t offset, size_t count, off_t *ext, off_t *end) {
+    struct stat st;
+    if (offset < 0 || fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_blocks * 512 >= st.st_size ||
+        offset >= st.st_size) {
+        return -1;
+    }
+    *end = st.st_size - offset < (off_t) count ? st.st_size : offset + (off_t) count;
+    int n = 0;
+    off_t pos = offset;
+    while (pos < *end) {
+        off_t d = lseek(fd, pos, SEEK_DATA);
+        if (d < 0 && errno == ENXIO) {
+            // a hole up to the end of the file
+            break;
+        }
+        if (d < 0) {
+            return -1;
+        }
+        if (d >= *end) {
+            break;
+        }
+        if (n == MAXEXTENTS) {
+            ext[2 * n - 1] = *end;
+            break;
+        }
+        off_t h = lseek(fd, d, SEEK_HOLE);
+        if (h < 0) {
+            return -1;
+        }
+        ext[2 * n] = d;
+        ext[2 * n + 1] = h < *end ? h : *end;
+        ++n;
+        pos = h;
+    }
+    return n;
+}
+
+rpc_resp* do_pwrite(const rpc_frame* frame) {
+    fprintf(stderr, "do pwrite\n");
+    int fd_in;
+    size_t count;
+    off_t offset;
+    rpc_resp *resp = malloc(sizeof(rpc_resp));
+
+    const char *buf = call_pwrite_unmarshal(frame->payload, &fd_in, &count, &offset);
+    int fd = unpack_fd(fd_in);
+    ssize_t r = durable_ack(fd, sched_io(fd, (char *) buf, count, offset, true));
+    resp->err_no = errno;
+    if (r > 0) {
+        callback_fd(fd);
+    }
+    off_t new_off = offset_after_write(fd, offset, r);
+    resp->size = sizeof(ssize_t) + sizeof(off_t);
     resp->data = malloc(resp->size);
-    mem_write_data(resp->data, 0, &fd_out, resp->size);
-    fprintf(stderr, "op: open return fd %d\n", fd_out);
-    free(pathname);
+    size_t off = mem_write_data(resp->data, 0, &r, sizeof(ssize_t));
+    mem_write_data(resp->data, off, &new_off, sizeof(off_t));
+    fprintf(stderr, "op: pwrite return %ld\n", r);
     return resp;
 }
 
-rpc_resp* do_close(const rpc_frame* frame) {
-    fprintf(stderr, "do close\n");
+// O_APPEND writes land at the end regardless of offset, so report
+// where the client's offset should be after a write
+off_t offset_after_write(int fd, off_t offset, ssize_t r) {
+    struct stat st;
+    if (r <= 0) {
+        return offset;
+    }
+    if ((fcntl(fd, F_GETFL) & O_APPEND) && fstat(fd, &st) == 0) {
+        return st.st_size;
+    }
+    return offset + r;
+}
+
+rpc_resp* do_preadv(const rpc_frame* frame) {
+    fprintf(stderr, "do preadv\n");
+    int fd_in, iovcnt, i;
+    off_t offset;
+    rpc_resp *resp = malloc(sizeof(rpc_resp));
+
+    struct iovec *iov = call_preadv_unmarshal(frame->payload, &fd_in, &iovcnt, &offset);
+    int fd = unpack_fd(fd_in);
+
+    // scatter straight into the response, one preadv per slice
+    size_t count = iov_cap(iov, &iovcnt, IO_MAX);
+    resp->data = malloc(count + sizeof(ssize_t));
+    size_t off = sizeof(ssize_t);
+    for (i = 0; i < iovcnt; i++) {
+        iov[i].iov_base = resp->data + off;
+        off += iov[i].iov_len;
+    }
+    ra_observe(fd, offset, count);
+    ssize_t r = fcache_read(fd, resp->data + sizeof(ssize_t), count, offset);
+    if (r == FC_MISS) {
+        r = sched_iov(fd, iov, iovcnt, offset, false);
+    }
+    resp->err_no = errno;
+    mem_write_data(resp->data, 0, &r, sizeof(ssize_t));
+    resp->size = sizeof(ssize_t) + (r > 0 ? r : 0);
+    fprintf(stderr, "op: preadv return %zd\n", r);
+    free(iov);
+    return resp;
+}
+
+rpc_resp* do_pwritev(const rpc_frame* frame) {
+    fprintf(stderr, "do pwritev\n");
+    int fd_in, iovcnt;
+    off_t offset;
+    rpc_resp *resp = malloc(sizeof(rpc_resp));
+
+    struct iovec *iov = call_pwritev_unmarshal(frame->payload, &fd_in, &iovcnt, &offset);
+    int fd = unpack_fd(fd_in);
+    ssize_t r = durable_ack(fd, sched_iov(fd, iov, iovcnt, offset, true));
+    resp->err_no = errno;
+    if (r > 0) {
+        callback_fd(fd);
+    }
+    off_t new_off = offset_after_write(fd, offset, r);
+    resp->size = sizeof(ssize_t) + sizeof(off_t);
+    resp->data = malloc(resp->size);
+    size_t off = mem_write_data(resp->data, 0, &r, sizeof(ssize_t));
+    mem_write_data(resp->data, off, &new_off, sizeof(off_t));
+    fprintf(stderr, "op: pwritev return %zd\n", r);
+    free(iov);
+    return resp;
+}
+
+// dedup write, first round: write straight away if the store holds every
+// chunk, otherwise reply with the indexes of the ones it lacks
+rpc_resp* do_chunkq(const rpc_frame* frame) {
+    fprintf(stderr, "do chunkq\n");
     int fd_in;
+    off_t offset;
+    u_int32_t n, i;
     rpc_resp *resp = malloc(sizeof(rpc_resp));
 
-    call_close_unmarshal(frame->payload, &fd_in);
+    chunk_ref *refs = call_chunkq_unmarshal(frame->payload, &fd_in, &offset, &n);
     int fd = unpack_fd(fd_in);
-    int r = close(fd);
+    u_int32_t *missing = malloc(sizeof(u_int32_t) * (n + 1));
+    u_int32_t nmissing = 0;
+    ssize_t r = 0;
+    errno = 0;
+    if (chunk_store == NULL) {
+        r = -1;
+        errno = ENOTSUP;
+    } else {
+        for (i = 0; i < n; i++) {
+            if (!chunk_present(&refs[i])) {
+                missing[nmissing++] = i;
+            }
+        }
+        if (nmissing == 0) {
+            r = chunk_write(fd, offset, refs, n, NULL);
+        }
+    }
     resp->err_no = errno;
-    resp->size = sizeof(int);
+    if (r > 0) {
+        callback_fd(fd);
+    }
+    off_t new_off = offset_after_write(fd, offset, r);
+    resp->size = sizeof(ssize_t) + sizeof(off_t) + sizeof(u_int32_t) * (nmissing + 1);
     resp->data = malloc(resp->size);
-    mem_write_data(resp->data, 0, &r, resp->size);
-    fprintf(stderr, "op: close return %d\n", r);
+    size_t off = mem_write_data(resp->data, 0, &r, sizeof(ssize_t));
+    off = mem_write_data(resp->data, off, &new_off, sizeof(off_t));
+    off = mem_write_int32(resp->data, off, nmissing);
+    for (i = 0; i < nmissing; i++) {
+        off = mem_write_int32(resp->data, off, missing[i]);
+    }
+    fprintf(stderr, "op: chunkq %u chunks, %u missing, return %zd\n", n, nmissing, r);
+    free(missing);
+    free(refs);
     return resp;
 }
 
-rpc_resp* do_write(const rpc_frame* frame) {
-    fprintf(stderr, "do write\n");
+// dedup write, second round: store the chunks sent along and write
+rpc_resp* do_chunkw(const rpc_frame* frame) {
+    fprintf(stderr, "do chunkw\n");
     int fd_in;
+    off_t offset;
+    u_int32_t n, nmissing, i;
+    u_int32_t *missing;
+    const char *data;
     rpc_resp *resp = malloc(sizeof(rpc_resp));
-    size_t count;
 
-    char *buf = call_write_unmarshal(frame->payload, &fd_in, &count);
+    chunk_ref *refs = call_chunkw_unmarshal(frame->payload, &fd_in, &offset, &n, &missing, &nmissing, &data);
     int fd = unpack_fd(fd_in);
-    ssize_t r = write(fd, buf, count);
+    const char **given = calloc(n + 1, sizeof(char *));
+    ssize_t r = 0;
+    errno = 0;
+    for (i = 0; i < nmissing; i++) {
+        u_int32_t k = missing[i];
+        unsigned char hash[CHUNK_HASH_LEN];
+        if (k >= n) {
+            break;
+        }
+        // a chunk that doesn't match its name would poison the store
+        chunk_hash(data, refs[k].len, hash);
+        if (memcmp(hash, refs[k].hash, CHUNK_HASH_LEN) != 0) {
+            break;
+        }
+        chunk_put(&refs[k], data);
+        given[k] = data;
+        data += refs[k].len;
+    }
+    if (chunk_store == NULL) {
+        r = -1;
+        errno = ENOTSUP;
+    } else if (i < nmissing) {
+        r = -1;
+        errno = EINVAL;
+    } else {
+        r = chunk_write(fd, offset, refs, n, given);
+    }
     resp->err_no = errno;
-    resp->size = sizeof(ssize_t);
+    if (r > 0) {
+        callback_fd(fd);
+    }
+    off_t new_off = offset_after_write(fd, offset, r);
+    resp->size = sizeof(ssize_t) + sizeof(off_t);
     resp->data = malloc(resp->size);
-    mem_write_data(resp->data, 0, &r, resp->size);
-    fprintf(stderr, "op: write return %ld\n", r);
-    free(buf);
+    size_t off = mem_write_data(resp->data, 0, &r, sizeof(ssize_t));
+    mem_write_data(resp->data, off, &new_off, sizeof(off_t));
+    fprintf(stderr, "op: chunkw %u chunks, %u sent, return %zd\n", n, nmissing, r);
+    free(given);
+    free(missing);
+    free(refs);
     return resp;
 }
+
+char *chunk_path(const chunk_ref *ref) {
+    char *path = malloc(strlen(chunk_store) + 2 * CHUNK_HASH_LEN + 2);
+    size_t off = sprintf(path, "%s/", chunk_store);
+    int i;
+    for (i = 0; i < CHUNK_HASH_LEN; i++) {
+        off += sprintf(path + off, "%02x", ref->hash[i]);
+    }
+    return path;
+}
+
+// chunks are only shared between sessions of one client host, others
+// can neither reuse them nor learn from CHUNKQ what content is stored
+void chunk_scope(in_addr_t addr) {
+    if (chunk_store == NULL) {
+        return;
+    }
+    char host[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &addr, host, sizeof(host));
+    char *dir = malloc(strlen(chunk_store) + sizeof(host) + 2);
+    sprintf(dir, "%s/%s", chunk_store, host);
+    if (mkdir(dir, 0700) < 0 && errno != EEXIST) {
+        // dedup writes fail with ENOTSUP rather than use a shared store
+        free(dir);
+        chunk_store = NULL;
+        return;
+    }
+    chunk_store = dir;
+}
+
+bool chunk_present(const chunk_ref *ref) {
+    struct stat st;
+    char *path = chunk_path(ref);
+    bool ok = stat(path, &st) == 0 && st.st_size == ref->len;
+    free(path);
+    return ok;
+}
+
+// store a chunk, written to a temporary name first so other sessions
+// never see half of it
+int chunk_put(const chunk_ref *ref, const char *data) {
+    if (chunk_present(ref)) {
+        return 0;
+    }
+    char *path = chunk_path(ref);
+    char *tmp = malloc(strlen(path) + 16);
+    sprintf(tmp, "%s.%d", path, getpid());
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    int r = -1;
+    if (fd >= 0) {
+        r = write(fd, data, ref->len) == (ssize_t) ref->len ? 0 : -1;
+        close(fd);
+        if (r == 0) {
+            r = rename(tmp, path);
+        }
+        if (r < 0) {
+            unlink(tmp);
+        }
+    }
+    free(tmp);
+    free(path);
+    return r;
+}
+
+// gather the chunks, from given where set and from the store otherwise,
+// and write them at offset. EAGAIN if a stored chunk has gone away
+ssize_t chunk_write(int fd, off_t offset, const chunk_ref *refs, u_int32_t n, const char **given) {
+    size_t total = 0;
+    u_int32_t i;
+    for (i = 0; i < n; i++) {
+        total += refs[i].len;
+    }
+    char *buf = malloc(total + 1);
+    size_t off = 0;
+    for (i = 0; i < n; i++) {
+        if (given != NULL && given[i] != NULL) {
+            memcpy(buf + off, given[i], refs[i].len);
+        } else {
+            char *path = chunk_path(&refs[i]);
+            int cfd = open(path, O_RDONLY);
+            free(path);
+            ssize_t got = cfd < 0 ? -1 : pread(cfd, buf + off, refs[i].len, 0);
+            if (cfd >= 0) {
+                close(cfd);
+            }
+            if (got != (ssize_t) refs[i].len) {
+                free(buf);
+                errno = EAGAIN;
+                return -1;
+            }
+        }
+        off += refs[i].len;
+    }
+    ssize_t r = durable_ack(fd, sched_io(fd, buf, total, offset, true));
+    free(buf);
+    return r;
+}
+
+// rsync block checksums of the file behind fd, full blocks only. The
+// client may have it open write-only, so it is read through a fresh fd
+rpc_resp* do_sums(const rpc_frame* frame) {
+    fprintf(stderr, "do sums\n");
+    int fd_in;
+    char proc[COMMITPATH];
+    struct stat st;
+    rpc_resp *resp = malloc(sizeof(rpc_resp));
+
+    call_sums_unmarshal(frame->payload, &fd_in);
+    int fd = unpack_fd(fd_in);
+    snprintf(proc, COMMITPATH, "/proc/self/fd/%d", fd);
+    int old_fd = open(proc, O_RDONLY);
+    if (old_fd < 0 || fstat(old_fd, &st) < 0) {
+        resp->err_no = errno;
+        resp->size = sizeof(int);
+        resp->data = malloc(resp->size);
+        int r = -1;
+        mem_write_data(resp->data, 0, &r, sizeof(int));
+        if (old_fd >= 0) {
+            close(old_fd);
+        }
+        return resp;
+    }
+
+    // about sqrt(size) per block, like rsync
+    u_int32_t block = SUMS_MIN;
+    while (block < SUMS_MAX && (u_int64_t) block * block < (u_int64_t) st.st_size) {
+        block *= 2;
+    }
+    u_int32_t nblocks = st.st_size / block;
+    resp->size = sizeof(int) + sizeof(u_int32_t) * 2 + nblocks * (sizeof(u_int32_t) + CHUNK_HASH_LEN);
+    resp->data = malloc(resp->size);
+    int r = 0;
+    size_t off = mem_write_data(resp->data, 0, &r, sizeof(int));
+    off = mem_write_int32(resp->data, off, block);
+    size_t count_off = off;
+    off = mem_write_int32(resp->data, off, nblocks);
+
+    char *buf = malloc(block);
+    u_int32_t i;
+    for (i = 0; i < nblocks; i++) {
+        unsigned char hash[CHUNK_HASH_LEN];
+        if (sched_io(old_fd, buf, block, (off_t) i * block, false) != block) {
+            // shrank under us, the blocks so far still hold
+            mem_write_int32(resp->data, count_off, i);
+            break;
+        }
+        off = mem_write_int32(resp->data, off, rolling_sum((unsigned char *) buf, block));
+        chunk_hash(buf, block, hash);
+        off = mem_write_data(resp->data, off, hash, CHUNK_HASH_LEN);
+    }
+    resp->size = off;
+    resp->err_no = 0;
+    fprintf(stderr, "op: sums %u blocks of %u\n", i, block);
+    free(buf);
+    close(old_fd);
+    return resp;
+}
+
+// rebuild the file behind fd from literals and blocks of its old content
+// into a temporary file, rename it over the old one and point fd at it.
+// Where no temporary file can be made the result is built in memory and
+// written in place
+rpc_resp* do_delta(const rpc_frame* frame) {
+    fprintf(stderr, "do delta\n");
+    int fd_in;
+    u_int64_t new_len;
+    u_int32_t block, nops;
+    size_t ops_off;
+    char proc[COMMITPATH];
+    char path[PATH_MAX];
+    struct stat st;
+    rpc_resp *resp = malloc(sizeof(rpc_resp));
+
+    call_delta_unmarshal(frame->payload, &fd_in, &new_len, &block, &nops, &ops_off);
+    const char *ops = frame->payload + ops_off;
+    int fd = unpack_fd(fd_in);
+    snprintf(proc, COMMITPATH, "/proc/self/fd/%d", fd);
+    int old_fd = open(proc, O_RDONLY);
+    ssize_t len = readlink(proc, path, PATH_MAX - 32);
+    ssize_t r = -1;
+    errno = 0;
+
+    // an unlinked file has no path to rename over, the link reads
+    // "<path> (deleted)"; it is rewritten in place
+    int tmp_fd = -1;
+    char tmp[PATH_MAX + 32];
+    if (len > 0 && fstat(fd, &st) == 0 && st.st_nlink > 0) {
+        path[len] = '\0';
+        snprintf(tmp, sizeof(tmp), "%s.trfo.%d", path, getpid());
+        tmp_fd = open(tmp, O_RDWR | O_CREAT | O_EXCL, 0600);
+    }
+    if (tmp_fd >= 0) {
+        // the client's fd follows the new file with its own access mode,
+        // status flags included; it is reopened while the temp file is
+        // still owner-writable, the file's mode is set after
+        int fl = fcntl(fd, F_GETFL);
+        int new_fd = -1;
+        if (delta_apply(ops, nops, block, old_fd, tmp_fd, NULL, new_len) == 0 &&
+            (new_fd = open(tmp, fl & O_ACCMODE)) >= 0 &&
+            fchmod(tmp_fd, st.st_mode & 07777) == 0 &&
+            (fd >= durable_cap || !durable[fd] || durable_sync(tmp_fd, durable[fd]) == 0) &&
+            rename(tmp, path) == 0) {
+            fchown(tmp_fd, st.st_uid, st.st_gid);
+            dup2(new_fd, fd);
+            fcntl(fd, F_SETFL, fl & (O_APPEND | O_NONBLOCK));
+            r = new_len;
+            // the path is a new file now, callbacks were on the old one
+            callback_break(st.st_dev, st.st_ino);
+        } else {
+            int e = errno;
+            unlink(tmp);
+            errno = e;
+        }
+        if (new_fd >= 0) {
+            close(new_fd);
+        }
+        close(tmp_fd);
+    } else {
+        char *buf = malloc(new_len + 1);
+        if (delta_apply(ops, nops, block, old_fd, -1, buf, new_len) == 0 &&
+            ftruncate(fd, 0) == 0) {
+            r = durable_ack(fd, sched_io(fd, buf, new_len, 0, true));
+        }
+        free(buf);
+    }
+    resp->err_no = errno;
+    if (r >= 0 && tmp_fd < 0) {
+        callback_fd(fd);
+    }
+    if (old_fd >= 0) {
+        close(old_fd);
+    }
+    resp->size = sizeof(ssize_t);
+    resp->data = malloc(resp->size);
+    mem_write_data(resp->data, 0, &r, sizeof(ssize_t));
+    fprintf(stderr, "op: delta %u ops, return %zd\n", nops, r);
+    return resp;
+}
+
+// write the rebuilt content to out_fd, or to out_buf when out_fd is -1
+int delta_apply(const char *ops, u_int32_t nops, u_int32_t block, int old_fd, int out_fd, char *out_buf,
+                u_int64_t new_len) {
+    size_t off = 0;
+    u_int64_t pos = 0;
+    char *copy = NULL;
+    u_int32_t i;
+    for (i = 0; i < nops; i++) {
+        u_int32_t type, a, b;
+        off = mem_read_int32(ops, off, &type);
+        off = mem_read_int32(ops, off, &a);
+        const char *data;
+        size_t n;
+        if (type == DELTA_LITERAL) {
+            data = ops + off;
+            n = a;
+            off += a;
+        } else {
+            off = mem_read_int32(ops, off, &b);
+            n = (size_t) b * block;
+            copy = realloc(copy, n);
+            if (old_fd < 0 || sched_io(old_fd, copy, n, (off_t) a * block, false) != (ssize_t) n) {
+                free(copy);
+                errno = EIO;
+                return -1;
+            }
+            data = copy;
+        }
+        if (pos + n > new_len) {
+            free(copy);
+            errno = EINVAL;
+            return -1;
+        }
+        if (out_fd >= 0) {
+            if (sched_io(out_fd, (char *) data, n, pos, true) != (ssize_t) n) {
+                free(copy);
+                return -1;
+            }
+        } else {
+            memcpy(out_buf + pos, data, n);
+        }
+        pos += n;
+    }
+    free(copy);
+    if (pos != new_len) {
+        errno = EINVAL;
+        return -1;
+    }
+    return 0;
+}
+
+rpc_resp* do_pgread(const rpc_frame* frame) {
+    fprintf(stderr, "do pgread\n");
+    int fd_in;
+    off_t first_page;
+    u_int32_t npages, page_size;
+    rpc_resp *resp = malloc(sizeof(rpc_resp));
+
+    call_pgread_unmarshal(frame->payload, &fd_in, &first_page, &npages, &page_size);
+    int fd = unpack_fd(fd_in);
+    size_t count = (size_t) npages * page_size;
+    count = count < IO_MAX ? count : IO_MAX;
+
+    // read straight into the response, short reads past EOF are
+    // zero-filled by the client
+    resp->data = malloc(count + sizeof(ssize_t));
+    ra_observe(fd, first_page * page_size, count);
+    ssize_t r = fcache_read(fd, resp->data + sizeof(ssize_t), count, first_page * page_size);
+    if (r == FC_MISS) {
+        r = sched_io(fd, resp->data + sizeof(ssize_t), count, first_page * page_size, false);
+    }
+    resp->err_no = errno;
+    mem_write_data(resp->data, 0, &r, sizeof(ssize_t));
+    resp->size = sizeof(ssize_t) + (r > 0 ? r : 0);
+    fprintf(stderr, "op: pgread page %ld x %u return %zd\n", first_page, npages, r);
+    return resp;
+}
+
+// whole small files for the client's prefetcher, in one reply:
+// [n][(err, stat, len, data) per file]; a file over the client's limit,
+// or past MAXMREAD in total, is skipped with EFBIG
+rpc_resp* do_mread(const rpc_frame* frame) {
+    fprintf(stderr, "do mread\n");
+    u_int32_t n, max;
+    rpc_resp *resp = malloc(sizeof(rpc_resp));
+    const char **paths = call_mread_unmarshal(frame->payload, &n, &max);
+    size_t cap = MAXMSGLEN;
+    size_t total = 0;
+    resp->data = malloc(cap);
+    size_t off = mem_write_int32(resp->data, 0, n);
+    u_int32_t i;
+    for (i = 0; i < n; i++) {
+        struct stat st;
+        memset(&st, 0, sizeof(struct stat));
+        int e = 0;
+        ssize_t r = 0;
+        int fd = open(paths[i], O_RDONLY);
+        if (fd < 0 || fstat(fd, &st) < 0) {
+            e = errno;
+        } else if (!S_ISREG(st.st_mode)) {
+            e = EINVAL;
+        } else if (st.st_size > max || total + st.st_size > MAXMREAD) {
+            e = EFBIG;
+        }
+        resp->data = ensure_cap(resp->data, &cap, off + sizeof(int) + sizeof(struct stat) + sizeof(u_int32_t)
+                                + (e == 0 ? st.st_size : 0));
+        size_t head = off;
+        off += sizeof(int) + sizeof(struct stat) + sizeof(u_int32_t);
+        if (e == 0) {
+            // hot files come from the shared cache like any other read
+            fcache_track(fd, 1);
+            r = fcache_read(fd, resp->data + off, st.st_size, 0);
+            if (r == FC_MISS) {
+                r = sched_io(fd, resp->data + off, st.st_size, 0, false);
+            }
+            fcache_track(fd, 0);
+            if (r < 0) {
+                e = errno;
+                r = 0;
+            }
+            // a file that shrank meanwhile is sent as read
+            st.st_size = r;
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+        head = mem_write_int32(resp->data, head, e);
+        head = mem_write_data(resp->data, head, &st, sizeof(struct stat));
+        mem_write_int32(resp->data, head, r);
+        off += r;
+        total += r;
+    }
+    resp->err_no = 0;
+    resp->size = off;
+    fprintf(stderr, "op: mread %u files, %zu bytes\n", n, total);
+    free(paths);
+    return resp;
+}
+
+// copy_file_range() between two files open in this session, the data never
+// crosses the wire and filesystems that can clone extents share them
+// instead of copying; across filesystems it goes through a buffer here.
+// Scheduled a slice at a time like reads and writes. [r]
+rpc_resp* do_copy(const rpc_frame* frame) {
+    fprintf(stderr, "do copy\n");
+    int in_fd, out_fd;
+    off_t off_in, off_out;
+    size_t len;
+    rpc_resp *resp = malloc(sizeof(rpc_resp));
+
+    call_copy_unmarshal(frame->payload, &in_fd, &off_in, &out_fd, &off_out, &len);
+    int fd_in = unpack_fd(in_fd);
+    int fd_out = unpack_fd(out_fd);
+    char *buf = NULL;
+    size_t done = 0;
+    ssize_t r = 0;
+    while (done < len) {
+        size_t n = len - done;
+        if (sched_slot >= 0 && n > SLICE) {
+            n = SLICE;
+        }
+        sched_acquire(n);
+        r = copy_file_range(fd_in, &off_in, fd_out, &off_out, n, 0);
+        if (r < 0 && (errno == EXDEV || errno == ENOSYS || errno == EOPNOTSUPP)) {
+            if (buf == NULL) {
+                buf = malloc(SLICE);
+            }
+            r = pread(fd_in, buf, n < SLICE ? n : SLICE, off_in);
+            if (r > 0) {
+                r = pwrite(fd_out, buf, r, off_out);
+            }
+            if (r > 0) {
+                off_in += r;
+                off_out += r;
+            }
+        }
+        sched_release();
+        if (r <= 0) {
+            break;
+        }
+        done += r;
+    }
+    if (done > 0) {
+        r = done;
+    }
+    r = durable_ack(fd_out, r);
+    resp->err_no = errno;
+    if (r > 0) {
+        callback_fd(fd_out);
+    }
+    resp->size = sizeof(ssize_t);
+    resp->data = malloc(resp->size);
+    mem_write_data(resp->data, 0, &r, sizeof(ssize_t));
+    fprintf(stderr, "op: copy return %zd\n", r);
+    free(buf);
+    return resp;
+}
+
+rpc_resp* do_open(const rpc_frame* frame) {
+    fprintf(stderr, "do open\n");
+    char *pathname = malloc(MAXMSGLEN);
+    u_int32_t flag;
+    u_int16_t mode;
+    rpc_resp *resp = malloc(sizeof(rpc_resp));
+
+    fprintf(stderr, "frame size: [%d]\n", frame->payload_size);
+    call_open_unmarshal(frame->payload, pathname, &flag, &mode);
+    // synchronous opens are synced in shared batches instead of per write
+    int fd = open(pathname, (int)flag & ~(O_SYNC | O_DSYNC), mode);
+    resp->err_no = errno;
+    opened[nopened++ % PENDING_OPENS] = fd;
+    if (fd >= 0) {
+        set_durable(fd, (flag & O_SYNC) == O_SYNC ? DURABLE_FULL : (flag & O_DSYNC) ? DURABLE_DATA : 0);
+        fcache_track(fd, (flag & O_ACCMODE) != O_WRONLY);
+        callback_fd_reset(fd);
+        ra_reset(fd);
+        if (flag & O_TRUNC) {
+            callback_fd(fd);
+        }
+        if (flag & O_CREAT) {
+            callback_break_parent(pathname);
+        }
+    }
+    int fd_out = pack_fd(fd);
+    resp->size = sizeof(int);
+    resp->data = malloc(resp->size);
+    mem_write_data(resp->data, 0, &fd_out, resp->size);
+    fprintf(stderr, "op: open return fd %d\n", fd_out);
+    free(pathname);
+    return resp;
+}
+
+rpc_resp* do_close(const rpc_frame* frame) {
+    fprintf(stderr, "do close\n");
+    int fd_in;
+    rpc_resp *resp = malloc(sizeof(rpc_resp));
+
+    call_close_unmarshal(frame->payload, &fd_in);
+    int fd = unpack_fd(fd_in);
+    int r = close(fd);
+    resp->err_no = errno;
+    if (r == 0) {
+        set_durable(fd, 0);
+        fcache_track(fd, 0);
+        ra_reset(fd);
+    }
+    resp->size = sizeof(int);
+    resp->data = malloc(resp->size);
+    mem_write_data(resp->data, 0, &r, resp->size);
+    fprintf(stderr, "op: close return %d\n", r);
+    return resp;
+}
+
+rpc_resp* do_write(const rpc_frame* frame) {
+    fprintf(stderr, "do write\n");
+    int fd_in;
+    rpc_resp *resp = malloc(sizeof(rpc_resp));
+    size_t count;
+
+    const char *buf = call_write_unmarshal(frame->payload, &fd_in, &count);
+    int fd = unpack_fd(fd_in);
+    ssize_t r = durable_ack(fd, sched_io(fd, (char *) buf, count, -1, true));
+    resp->err_no = errno;
+    if (r > 0) {
+        callback_fd(fd);
+    }
+    resp->size = sizeof(ssize_t);
+    resp->data = malloc(resp->size);
+    mem_write_data(resp->data, 0, &r, resp->size);
+    fprintf(stderr, "op: write return %ld\n", r);
+    return resp;
+}
+
+// map the commit group into memory the forked sessions share
+void group_init() {
+    group = mmap(NULL, sizeof(commit_group), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (group == MAP_FAILED) err(1, 0);
+    memset(group, 0, sizeof(commit_group));
+    shared_sync_init(&group->lock, &group->done);
+
+    // the kernel already shares journal commits between concurrent
+    // fsyncs, the batch only pays off where it doesn't
+    group_on = getenv("groupcommit15440") != NULL;
+    // how long a batch leader waits for more writers to join
+    char *window = getenv("syncwindow15440");
+    commit_window_us = window ? atol(window) : 0;
+    fprintf(stderr, "group commit %d, window %ld us\n", group_on, commit_window_us);
+}
+
+// lock and condition variable usable across the forked sessions, cond
+// may be NULL
+void shared_sync_init(pthread_mutex_t *lock, pthread_cond_t *cond) {
+    pthread_mutexattr_t mattr;
+    pthread_mutexattr_init(&mattr);
+    pthread_mutexattr_setpshared(&mattr, PTHREAD_PROCESS_SHARED);
+    // a session killed while holding the lock must not wedge the rest
+    pthread_mutexattr_setrobust(&mattr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(lock, &mattr);
+    pthread_mutexattr_destroy(&mattr);
+    if (cond == NULL) {
+        return;
+    }
+
+    pthread_condattr_t cattr;
+    pthread_condattr_init(&cattr);
+    pthread_condattr_setpshared(&cattr, PTHREAD_PROCESS_SHARED);
+    pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC);
+    pthread_cond_init(cond, &cattr);
+    pthread_condattr_destroy(&cattr);
+}
+
+void shared_lock(pthread_mutex_t *lock) {
+    if (pthread_mutex_lock(lock) == EOWNERDEAD) {
+        pthread_mutex_consistent(lock);
+    }
+}
+
+void group_lock() {
+    shared_lock(&group->lock);
+}
+
+// make everything written to fd so far durable at level, sharing one
+// batch of syncs with whatever other writers are waiting, 0 on success
+int group_commit(int fd, int level) {
+    char path[COMMITPATH];
+    snprintf(path, COMMITPATH, "/proc/%d/fd/%d", getpid(), fd);
+
+    group_lock();
+    if (group->npending == MAXCOMMIT) {
+        // batch is full, sync alone rather than wait for room
+        pthread_mutex_unlock(&group->lock);
+        return durable_sync(fd, level);
+    }
+    memcpy(group->pending[group->npending], path, COMMITPATH);
+    group->level[group->npending++] = level;
+    u_int64_t ticket = ++group->next_ticket;
+    u_int64_t failures = group->failures;
+
+    while (group->synced < ticket) {
+        if (group->leader != 0 && kill(group->leader, 0) == 0) {
+            // someone else is syncing, the next batch may cover us
+            struct timespec ts;
+            clock_gettime(CLOCK_MONOTONIC, &ts);
+            ts.tv_nsec += 100 * 1000 * 1000;
+            if (ts.tv_nsec >= 1000000000) {
+                ts.tv_sec += 1;
+                ts.tv_nsec -= 1000000000;
+            }
+            if (pthread_cond_timedwait(&group->done, &group->lock, &ts) == EOWNERDEAD) {
+                pthread_mutex_consistent(&group->lock);
+            }
+            continue;
+        }
+
+        // lead the next batch; a dead leader's batch is still pending, so
+        // it is synced again as part of this one
+        group->leader = getpid();
+        pthread_mutex_unlock(&group->lock);
+        if (commit_window_us > 0) {
+            usleep(commit_window_us);
+        }
+        group_lock();
+        u_int64_t upto = group->next_ticket;
+        int n = group->npending;
+        char (*batch)[COMMITPATH] = malloc((size_t) n * COMMITPATH);
+        unsigned char *levels = malloc(n);
+        memcpy(batch, group->pending, (size_t) n * COMMITPATH);
+        memcpy(levels, group->level, n);
+        pthread_mutex_unlock(&group->lock);
+
+        // any fd on the inode syncs it, the writers' own fds stay open
+        // while they wait; a write-only file may not be readable. Each
+        // inode is synced once at the strongest level asked for, after
+        // writeback has been started on all of them so their data goes
+        // out together
+        int failed = 0;
+        int i, j;
+        int *sfds = malloc(sizeof(int) * n);
+        struct stat *sts = malloc(sizeof(struct stat) * n);
+        for (i = 0; i < n; i++) {
+            sfds[i] = open(batch[i], O_RDONLY);
+            if (sfds[i] < 0) {
+                sfds[i] = open(batch[i], O_WRONLY);
+            }
+            if (sfds[i] < 0 || fstat(sfds[i], &sts[i]) < 0) {
+                failed = 1;
+                continue;
+            }
+            for (j = 0; j < i; j++) {
+                if (sfds[j] >= 0 && sts[j].st_dev == sts[i].st_dev && sts[j].st_ino == sts[i].st_ino) {
+                    break;
+                }
+            }
+            if (j < i) {
+                if (levels[i] > levels[j]) {
+                    levels[j] = levels[i];
+                }
+                close(sfds[i]);
+                sfds[i] = -1;
+                continue;
+            }
+            sync_file_range(sfds[i], 0, 0, SYNC_FILE_RANGE_WRITE);
+        }
+        for (i = 0; i < n; i++) {
+            if (sfds[i] >= 0) {
+                if (durable_sync(sfds[i], levels[i]) < 0) {
+                    failed = 1;
+                }
+                close(sfds[i]);
+            }
+        }
+        free(sfds);
+        free(sts);
+        free(batch);
+        free(levels);
+        fprintf(stderr, "group commit: synced %d files up to ticket %lu\n", n, upto);
+
+        group_lock();
+        if (failed) {
+            ++group->failures;
+        }
+        // writers that came in during the batch wait for the next one
+        group->npending -= n;
+        memmove(group->pending, group->pending + n, (size_t) group->npending * COMMITPATH);
+        memmove(group->level, group->level + n, group->npending);
+        group->synced = upto;
+        group->leader = 0;
+        pthread_cond_broadcast(&group->done);
+    }
+    int recheck = group->failures != failures;
+    pthread_mutex_unlock(&group->lock);
+
+    // some file in a batch failed, our own fd reports whether it was ours
+    return recheck ? durable_sync(fd, level) : 0;
+}
+
+// fsync for O_SYNC, fdatasync for O_DSYNC
+int durable_sync(int fd, int level) {
+    return level == DURABLE_FULL ? fsync(fd) : fdatasync(fd);
+}
+
+// a leader that died mid batch hands it to the next writer
+void group_reap(pid_t pid) {
+    group_lock();
+    if (group->leader == pid) {
+        group->leader = 0;
+        pthread_cond_broadcast(&group->done);
+    }
+    pthread_mutex_unlock(&group->lock);
+}
+
+// hold back the result of a write on a durable fd until it is synced
+ssize_t durable_ack(int fd, ssize_t r) {
+    if (r < 0 || fd < 0 || fd >= durable_cap || !durable[fd]) {
+        return r;
+    }
+    if (!group_on) {
+        return durable_sync(fd, durable[fd]) < 0 ? -1 : r;
+    }
+    return group_commit(fd, durable[fd]) < 0 ? -1 : r;
+}
+
+void set_durable(int fd, int on) {
+    if (fd < 0) {
+        return;
+    }
+    if (fd >= durable_cap) {
+        if (!on) {
+            return;
+        }
+        int cap = durable_cap ? durable_cap : 64;
+        while (cap <= fd) {
+            cap *= 2;
+        }
+        durable = realloc(durable, cap);
+        memset(durable + durable_cap, 0, cap - durable_cap);
+        durable_cap = cap;
+    }
+    durable[fd] = on;
+}
+
+// map the scheduler into memory the forked sessions share
+void sched_init() {
+    sched = mmap(NULL, sizeof(fair_sched), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (sched == MAP_FAILED) err(1, 0);
+    memset(sched, 0, sizeof(fair_sched));
+    shared_sync_init(&sched->lock, &sched->turn_cv);
+    sched->turn = -1;
+
+    // off unless asked for
+    char *width = getenv("schedwidth15440");
+    sched->width = width ? atoi(width) : 0;
+    char *inflight = getenv("schedinflight15440");
+    sched->inflight_max = inflight ? (size_t) atol(inflight) : 4 * SLICE;
+    fprintf(stderr, "scheduler width %d, %zu bytes in flight per host\n", sched->width, sched->inflight_max);
+}
+
+// count this session under its client host, hosts share fairly no matter
+// how many connections they open; with every slot taken it goes unscheduled
+void sched_join(in_addr_t addr) {
+    if (sched->width <= 0) {
+        return;
+    }
+    shared_lock(&sched->lock);
+    int i, j, free_slot = -1;
+    for (i = 0; i < MAXCLIENTS; i++) {
+        if (sched->c[i].sessions > 0 && sched->c[i].addr == addr) {
+            break;
+        }
+        if (sched->c[i].sessions == 0 && free_slot < 0) {
+            free_slot = i;
+        }
+    }
+    if (i == MAXCLIENTS) {
+        i = free_slot;
+    }
+    for (j = 0; j < MAXCLIENTS && sched->s[j].pid != 0; j++);
+    if (i >= 0 && j < MAXCLIENTS) {
+        if (sched->c[i].sessions == 0) {
+            memset(&sched->c[i], 0, sizeof(sched_client));
+            sched->c[i].addr = addr;
+        }
+        ++sched->c[i].sessions;
+        sched_slot = i;
+        sched_me = &sched->s[j];
+        memset(sched_me, 0, sizeof(sched_session));
+        sched_me->pid = getpid();
+        sched_me->client = i;
+    }
+    pthread_mutex_unlock(&sched->lock);
+}
+
+// give back whatever a finished session held, however it ended; called by
+// the parent once the session is reaped
+void sched_reap(pid_t pid) {
+    shared_lock(&sched->lock);
+    int j;
+    for (j = 0; j < MAXCLIENTS && sched->s[j].pid != pid; j++);
+    if (j < MAXCLIENTS) {
+        sched_session *s = &sched->s[j];
+        sched_client *c = &sched->c[s->client];
+        if (s->held > 0) {
+            c->inflight -= s->held;
+            --sched->running;
+        }
+        if (s->waiting) {
+            --c->waiting;
+        }
+        if (s->meta) {
+            --sched->meta;
+        }
+        if (--c->sessions == 0 && sched->turn == s->client) {
+            sched->turn = -1;
+        }
+        memset(s, 0, sizeof(sched_session));
+        pthread_cond_broadcast(&sched->turn_cv);
+    }
+    pthread_mutex_unlock(&sched->lock);
+}
+
+// collect every finished session and take back its shared state
+void reap_sessions() {
+    pid_t pid;
+    while ((pid = waitpid(-1, NULL, WNOHANG)) > 0) {
+        fprintf(stderr, "session %d ended\n", pid);
+        sched_reap(pid);
+        group_reap(pid);
+        callback_reap(pid);
+    }
+}
+
+// only there to cut the wait for the next client short
+void reap_signal(int sig) {
+}
+
+// while metadata calls are pending bulk work narrows to one slice at a time
+void sched_meta(bool begin) {
+    if (sched_slot < 0) {
+        return;
+    }
+    shared_lock(&sched->lock);
+    sched_me->meta = begin;
+    if (begin) {
+        ++sched->meta;
+    } else if (--sched->meta == 0) {
+        pthread_cond_broadcast(&sched->turn_cv);
+    }
+    pthread_mutex_unlock(&sched->lock);
+}
+
+bool op_is_meta(u_int32_t opcode) {
+    switch (opcode) {
+#define RPC_KIND_META true
+#define RPC_KIND_BULK false
+#define RPC_IS_META(OP, code, name, kind, shape) case OP_##OP: return RPC_KIND_##kind;
+        RPC_OPS(RPC_IS_META)
+        default:
+            return false;
+    }
+}
+
+// pick the next host by deficit round robin among those with a session
+// waiting and room under their in-flight limit, left in sched->turn;
+// called with the lock held
+void sched_pick() {
+    int visits;
+    for (visits = 0; visits < 2 * MAXCLIENTS; visits++) {
+        sched_client *c = &sched->c[sched->cursor];
+        if (c->waiting == 0) {
+            // idle hosts don't bank credit
+            c->deficit = 0;
+        } else if (c->inflight == 0 || c->inflight + SLICE <= sched->inflight_max) {
+            if (c->deficit <= 0) {
+                c->deficit += SLICE;
+            }
+            if (c->deficit > 0) {
+                sched->turn = sched->cursor;
+                return;
+            }
+        }
+        sched->cursor = (sched->cursor + 1) % MAXCLIENTS;
+    }
+    sched->turn = -1;
+}
+
+// wait for this session's turn to run a slice of bytes
+void sched_acquire(size_t bytes) {
+    if (sched_slot < 0) {
+        return;
+    }
+    shared_lock(&sched->lock);
+    sched_client *me = &sched->c[sched_slot];
+    ++me->waiting;
+    sched_me->waiting = true;
+    while (1) {
+        bool room = sched->running < (sched->meta > 0 ? 1 : sched->width);
+        if (room && sched->turn < 0) {
+            sched_pick();
+        }
+        if (room && sched->turn == sched_slot) {
+            break;
+        }
+        if (pthread_cond_wait(&sched->turn_cv, &sched->lock) == EOWNERDEAD) {
+            pthread_mutex_consistent(&sched->lock);
+        }
+    }
+    --me->waiting;
+    sched_me->waiting = false;
+    sched->turn = -1;
+    me->deficit -= bytes;
+    if (me->deficit <= 0) {
+        // round used up, the next host goes first
+        sched->cursor = (sched_slot + 1) % MAXCLIENTS;
+    }
+    me->inflight += bytes;
+    ++sched->running;
+    sched_me->held = bytes;
+    // another slice may fit alongside this one
+    pthread_cond_broadcast(&sched->turn_cv);
+    pthread_mutex_unlock(&sched->lock);
+}
+
+void sched_release() {
+    if (sched_slot < 0 || sched_me->held == 0) {
+        return;
+    }
+    int saved = errno;
+    shared_lock(&sched->lock);
+    sched->c[sched_slot].inflight -= sched_me->held;
+    --sched->running;
+    sched_me->held = 0;
+    pthread_cond_broadcast(&sched->turn_cv);
+    pthread_mutex_unlock(&sched->lock);
+    errno = saved;
+}
+
+// pread/pwrite, or read/write at the file position when offset < 0, one
+// scheduled slice at a time; short counts end it like a single call would
+ssize_t sched_io(int fd, void *buf, size_t count, off_t offset, bool write_op) {
+    size_t slice = sched_slot < 0 ? count : SLICE;
+    size_t done = 0;
+    ssize_t r;
+    do {
+        size_t n = count - done < slice ? count - done : slice;
+        char *p = (char *) buf + done;
+        sched_acquire(n);
+        if (write_op) {
+            r = offset < 0 ? write(fd, p, n) : pwrite(fd, p, n, offset + done);
+        } else {
+            r = offset < 0 ? read(fd, p, n) : pread(fd, p, n, offset + done);
+        }
+        sched_release();
+        if (r <= 0) {
+            break;
+        }
+        done += r;
+        if ((size_t) r < n) {
+            break;
+        }
+    } while (done < count);
+    return done > 0 ? (ssize_t) done : r;
+}
+
+// preadv/pwritev in scheduled slices, iov is advanced in place
+ssize_t sched_iov(int fd, struct iovec *iov, int iovcnt, off_t offset, bool write_op) {
+    if (sched_slot < 0) {
+        return write_op ? pwritev(fd, iov, iovcnt, offset) : preadv(fd, iov, iovcnt, offset);
+    }
+    size_t done = 0;
+    ssize_t r = 0;
+    while (iovcnt > 0) {
+        // entries up to SLICE bytes, the last one cut short
+        int k = 0;
+        size_t n = 0;
+        while (k < iovcnt && n < SLICE) {
+            n += iov[k++].iov_len;
+        }
+        size_t cut = n > SLICE ? n - SLICE : 0;
+        iov[k - 1].iov_len -= cut;
+        n -= cut;
+        sched_acquire(n);
+        r = write_op ? pwritev(fd, iov, k, offset + done) : preadv(fd, iov, k, offset + done);
+        sched_release();
+        iov[k - 1].iov_len += cut;
+        if (r <= 0) {
+            break;
+        }
+        done += r;
+        if ((size_t) r < n) {
+            break;
+        }
+        size_t adv = r;
+        while (iovcnt > 0 && adv >= iov->iov_len) {
+            adv -= iov->iov_len;
+            ++iov;
+            --iovcnt;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *) iov->iov_base + adv;
+            iov->iov_len -= adv;
+        }
+    }
+    return done > 0 ? (ssize_t) done : r;
+}
+
+// map the callback table into memory the forked sessions share, it comes
+// zero-filled
+void callback_init() {
+    callbacks = mmap(NULL, sizeof(callback_table), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (callbacks == MAP_FAILED) err(1, 0);
+    shared_sync_init(&callbacks->lock, &callbacks->pushed_cv);
+    callbacks->epoch = 1;
+}
+
+// take a session slot the first time the client asks for a callback; with
+// every slot taken the client gets no promises
+bool callback_join() {
+    if (cb_slot >= 0) {
+        return true;
+    }
+    // breaks only cut short the wait for the next request, never a call,
+    // and must not find SIGUSR1 still fatal once the slot is visible
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = callback_signal;
+    sigaction(SIGUSR1, &sa, NULL);
+    sigset_t block;
+    sigemptyset(&block);
+    sigaddset(&block, SIGUSR1);
+    sigprocmask(SIG_BLOCK, &block, &cb_waitmask);
+    sigdelset(&cb_waitmask, SIGUSR1);
+
+    shared_lock(&callbacks->lock);
+    int i;
+    for (i = 0; i < MAXCLIENTS && callbacks->s[i].pid != 0; i++) {
+    }
+    if (i < MAXCLIENTS) {
+        memset(&callbacks->s[i], 0, sizeof(cb_session));
+        callbacks->s[i].pid = getpid();
+        cb_slot = i;
+        atexit(callback_leave);
+    }
+    pthread_mutex_unlock(&callbacks->lock);
+    return cb_slot >= 0;
+}
+
+void callback_leave() {
+    if (cb_slot < 0) {
+        return;
+    }
+    callback_reap(getpid());
+    cb_slot = -1;
+}
+
+// free the slot of a session that ended, killed ones never got to
+// callback_leave(); writers waiting on its breaks stop waiting
+void callback_reap(pid_t pid) {
+    shared_lock(&callbacks->lock);
+    int i, j;
+    for (i = 0; i < MAXCLIENTS && callbacks->s[i].pid != pid; i++) {
+    }
+    if (i < MAXCLIENTS) {
+        for (j = 0; j < CB_SLOTS; j++) {
+            callbacks->slots[j].holders &= ~(1ULL << i);
+        }
+        callbacks->s[i].pid = 0;
+        pthread_cond_broadcast(&callbacks->pushed_cv);
+    }
+    pthread_mutex_unlock(&callbacks->lock);
+}
+
+void callback_signal(int sig) {
+}
+
+// the entry of a file, or NULL; with insert a free entry is taken for it,
+// breaking the callbacks in its home entry if the probe finds none.
+// called with the lock held
+callback *callback_find(const file_id *id, bool insert) {
+    u_int64_t h = (id->dev * 0x9e3779b97f4a7c15ULL) ^ id->ino;
+    h = (h * 0xbf58476d1ce4e5b9ULL) >> 32;
+    callback *free_cb = NULL;
+    int k;
+    for (k = 0; k < CB_PROBE; k++) {
+        callback *cb = &callbacks->slots[(h + k) % CB_SLOTS];
+        if (cb->holders == 0) {
+            if (free_cb == NULL) {
+                free_cb = cb;
+            }
+        } else if (cb->id.dev == id->dev && cb->id.ino == id->ino) {
+            return cb;
+        }
+    }
+    if (!insert) {
+        return NULL;
+    }
+    if (free_cb == NULL) {
+        free_cb = &callbacks->slots[h % CB_SLOTS];
+        callback_notify(free_cb, 0);
+    }
+    free_cb->id = *id;
+    free_cb->holders = 0;
+    return free_cb;
+}
+
+// queue a break for every holder not in keep and wake them, called with
+// the lock held
+void callback_notify(callback *cb, u_int64_t keep) {
+    u_int64_t h = cb->holders & ~keep;
+    int i;
+    for (i = 0; h != 0; i++, h >>= 1) {
+        if (!(h & 1)) {
+            continue;
+        }
+        cb_session *s = &callbacks->s[i];
+        if (s->nqueued < CB_QUEUE) {
+            s->queue[s->nqueued++] = cb->id;
+        } else {
+            s->overflow = true;
+        }
+        s->queued++;
+        if (s->pid > 0) {
+            kill(s->pid, SIGUSR1);
+        }
+    }
+    if (cb->holders & ~keep) {
+        // a holder waiting in callback_break() pushes its own
+        pthread_cond_broadcast(&callbacks->pushed_cv);
+    }
+    cb->holders &= keep;
+}
+
+// hold a callback on the file st came from and stat path again for the
+// result: a change racing the first stat is then either seen or reported.
+// -1 if path keeps turning into other files
+int callback_statat(int dirfd, const char *path, struct stat *st) {
+    int tries;
+    for (tries = 0; tries < 3; tries++) {
+        file_id id = {st->st_dev, st->st_ino};
+        shared_lock(&callbacks->lock);
+        callback *cb = callback_find(&id, true);
+        cb->holders |= 1ULL << cb_slot;
+        __atomic_add_fetch(&callbacks->epoch, 1, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&callbacks->lock);
+        if (fstatat(dirfd, path, st, 0) < 0) {
+            return -1;
+        }
+        if (st->st_dev == id.dev && st->st_ino == id.ino) {
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// a file changed, break the callbacks other sessions hold on it; this
+// session's client saw the change itself. Returns once the holders sent
+// the breaks to their clients, so none of them trusts the old attributes
+// after this session's reply; a holder stuck for CB_PUSH_MS is given up on
+void callback_break(dev_t dev, ino_t ino) {
+    file_id id = {dev, ino};
+    u_int64_t keep = cb_slot >= 0 ? 1ULL << cb_slot : 0;
+    u_int64_t want[MAXCLIENTS];
+    pid_t pids[MAXCLIENTS];
+    int i;
+    shared_lock(&callbacks->lock);
+    callback *cb = callback_find(&id, false);
+    u_int64_t h = cb != NULL ? cb->holders & ~keep : 0;
+    if (cb != NULL) {
+        callback_notify(cb, keep);
+    }
+    for (i = 0; i < MAXCLIENTS; i++) {
+        want[i] = callbacks->s[i].queued;
+        pids[i] = callbacks->s[i].pid;
+    }
+
+    struct timespec until;
+    clock_gettime(CLOCK_MONOTONIC, &until);
+    until.tv_sec += CB_PUSH_MS / 1000;
+    until.tv_nsec += (CB_PUSH_MS % 1000) * 1000000L;
+    if (until.tv_nsec >= 1000000000) {
+        until.tv_sec += 1;
+        until.tv_nsec -= 1000000000;
+    }
+    while (1) {
+        for (i = 0; i < MAXCLIENTS; i++) {
+            cb_session *s = &callbacks->s[i];
+            if ((h >> i & 1) && (s->pid != pids[i] || s->pushed >= want[i])) {
+                h &= ~(1ULL << i);
+            }
+        }
+        if (h == 0) {
+            break;
+        }
+        cb_session *me = cb_slot >= 0 ? &callbacks->s[cb_slot] : NULL;
+        if (me != NULL && me->pushed < me->queued) {
+            // a writer waiting on this session the same way
+            pthread_mutex_unlock(&callbacks->lock);
+            callback_push(cb_sessfd);
+            shared_lock(&callbacks->lock);
+            continue;
+        }
+        int r = pthread_cond_timedwait(&callbacks->pushed_cv, &callbacks->lock, &until);
+        if (r == EOWNERDEAD) {
+            pthread_mutex_consistent(&callbacks->lock);
+        } else if (r == ETIMEDOUT) {
+            fprintf(stderr, "server - callback breaks not pushed in time\n");
+            break;
+        }
+    }
+    pthread_mutex_unlock(&callbacks->lock);
+}
+
+// an entry of path's directory was added or removed
+void callback_break_parent(const char *path) {
+    if (__atomic_load_n(&callbacks->epoch, __ATOMIC_ACQUIRE) == 1) {
+        return;
+    }
+    char *dir = strdup(path);
+    char *slash = strrchr(dir, '/');
+    struct stat st;
+    if (slash == dir) {
+        slash[1] = '\0';
+    } else if (slash != NULL) {
+        *slash = '\0';
+    }
+    if (stat(slash != NULL ? dir : ".", &st) == 0) {
+        callback_break(st.st_dev, st.st_ino);
+    }
+    free(dir);
+}
+
+// after a write through fd. Checked once per fd until another callback is
+// set anywhere, so streaming writes mostly cost an atomic load
+void callback_fd(int fd) {
+    u_int64_t epoch = __atomic_load_n(&callbacks->epoch, __ATOMIC_ACQUIRE);
+    if (fd < 0 || epoch == 1) {
+        return;
+    }
+    if (fd >= cb_seen_cap) {
+        int cap = cb_seen_cap ? cb_seen_cap : 64;
+        while (cap <= fd) {
+            cap *= 2;
+        }
+        cb_seen = realloc(cb_seen, cap * sizeof(u_int64_t));
+        memset(cb_seen + cb_seen_cap, 0, (cap - cb_seen_cap) * sizeof(u_int64_t));
+        cb_seen_cap = cap;
+    }
+    if (cb_seen[fd] == epoch) {
+        return;
+    }
+    cb_seen[fd] = epoch;
+    struct stat st;
+    if (fstat(fd, &st) == 0) {
+        callback_break(st.st_dev, st.st_ino);
+    }
+}
+
+// fd was opened on a file it may not have been checked for
+void callback_fd_reset(int fd) {
+    if (fd < cb_seen_cap) {
+        cb_seen[fd] = 0;
+    }
+}
+
+// push the breaks queued for this session, then wait for the next request;
+// breaks queued meanwhile cut the wait short
+bool callback_wait(int sessfd) {
+    if (cb_slot < 0) {
+        busy_wait(sessfd);
+        return true;
+    }
+    while (1) {
+        callback_push(sessfd);
+        busy_wait(sessfd);
+        struct pollfd pfd = {sessfd, POLLIN, 0};
+        int r = ppoll(&pfd, 1, NULL, &cb_waitmask);
+        if (r > 0) {
+            return true;
+        }
+        if (r < 0 && errno != EINTR) err(1, 0);
+    }
+}
+
+// spin until the next request starts to arrive, or for busy_poll_us, so
+// a client right behind its last reply doesn't wait on a wakeup
+void busy_wait(int sessfd) {
+    if (busy_poll_us <= 0) {
+        return;
+    }
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    char c;
+    while (recv(sessfd, &c, 1, MSG_PEEK | MSG_DONTWAIT) < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if ((now.tv_sec - start.tv_sec) * 1000000L + (now.tv_nsec - start.tv_nsec) / 1000 >= busy_poll_us) {
+            return;
+        }
+    }
+}
+
+// send the queued breaks as one FRAME_CALLBACK frame, the client reads it
+// ahead of its next reply
+void callback_push(int sessfd) {
+    file_id ids[CB_QUEUE];
+    shared_lock(&callbacks->lock);
+    cb_session *me = &callbacks->s[cb_slot];
+    bool any = me->overflow || me->nqueued > 0;
+    u_int32_t n = me->overflow ? 0 : me->nqueued;
+    u_int64_t upto = me->queued;
+    memcpy(ids, me->queue, sizeof(file_id) * n);
+    me->nqueued = 0;
+    me->overflow = false;
+    pthread_mutex_unlock(&callbacks->lock);
+    if (!any) {
+        return;
+    }
+
+    char buf[sizeof(int) + sizeof(u_int32_t) + sizeof(ids)];
+    int word = (int) (callback_marshal(buf + sizeof(int), ids, n) | FRAME_CALLBACK);
+    memcpy(buf, &word, sizeof(int));
+    size_t total = sizeof(int) + FRAME_SIZE(word);
+    size_t sent = 0;
+    while (sent < total) {
+        ssize_t rv = send(sessfd, buf + sent, total - sent, 0);
+        if (rv < 0) err(1, 0);
+        sent += rv;
+    }
+    fprintf(stderr, "server - pushed %u callback breaks\n", n);
+
+    shared_lock(&callbacks->lock);
+    me->pushed = upto;
+    pthread_cond_broadcast(&callbacks->pushed_cv);
+    pthread_mutex_unlock(&callbacks->lock);
+}
+
+// map the file cache into memory the forked sessions share, sized by
+// filecache15440 in bytes; 0 turns it off
+void fcache_init() {
+    char *size = getenv("filecache15440");
+    size_t bytes = size ? (size_t) atol(size) : (32 << 20);
+    u_int32_t nblocks = bytes / FC_BLOCK;
+    fcache = mmap(NULL, sizeof(file_cache) + sizeof(u_int32_t) * nblocks, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (fcache == MAP_FAILED) err(1, 0);
+    if (nblocks > 0) {
+        fc_arena = mmap(NULL, (size_t) nblocks * FC_BLOCK, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (fc_arena == MAP_FAILED) err(1, 0);
+    }
+    shared_sync_init(&fcache->lock, NULL);
+    fcache->nblocks = nblocks;
+    fcache->nfree = nblocks;
+    u_int32_t i;
+    for (i = 0; i < nblocks; i++) {
+        fcache->free_blocks[i] = i;
+    }
+    fprintf(stderr, "file cache %u blocks of %d bytes\n", nblocks, FC_BLOCK);
+}
+
+void fcache_track(int fd, int on) {
+    if (fd < 0) {
+        return;
+    }
+    if (fd >= fc_readable_cap) {
+        if (!on) {
+            return;
+        }
+        int cap = fc_readable_cap ? fc_readable_cap : 64;
+        while (cap <= fd) {
+            cap *= 2;
+        }
+        fc_readable = realloc(fc_readable, cap);
+        memset(fc_readable + fc_readable_cap, 0, cap - fc_readable_cap);
+        fc_readable_cap = cap;
+    }
+    fc_readable[fd] = on;
+}
+
+// pread from the cache, filling it from the file if it's hot enough;
+// FC_MISS if the read has to go to the file
+ssize_t fcache_read(int fd, char *buf, size_t count, off_t offset) {
+    struct stat st;
+    if (fcache->nblocks == 0 || fd < 0 || fd >= fc_readable_cap || !fc_readable[fd] || offset < 0 ||
+        fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size > FC_MAXBLOCKS * FC_BLOCK) {
+        return FC_MISS;
+    }
+    size_t n = offset >= st.st_size ? 0 : st.st_size - offset;
+    if (n > count) {
+        n = count;
+    }
+    file_id id = {st.st_dev, st.st_ino};
+
+    shared_lock(&fcache->lock);
+    u_int8_t *seen = fcache_sketch(&id);
+    if (*seen < 255) {
+        ++*seen;
+    }
+    // halve the counts now and then, so they follow what is hot now
+    if (++fcache->sketch_adds >= FC_SKETCH * 4) {
+        int i;
+        for (i = 0; i < FC_SKETCH; i++) {
+            fcache->sketch[i] >>= 1;
+        }
+        fcache->sketch_adds = 0;
+    }
+    fc_entry *home;
+    fc_entry *e = fcache_find(&id, &home);
+    if (e != NULL && (e->size != st.st_size || e->mtime.tv_sec != st.st_mtim.tv_sec ||
+                      e->mtime.tv_nsec != st.st_mtim.tv_nsec)) {
+        fcache_evict(e);
+        e = NULL;
+    }
+    if (e != NULL) {
+        size_t done = 0;
+        while (done < n) {
+            size_t pos = offset + done;
+            size_t k = FC_BLOCK - pos % FC_BLOCK;
+            if (k > n - done) {
+                k = n - done;
+            }
+            memcpy(buf + done, fc_arena + (size_t) e->block[pos / FC_BLOCK] * FC_BLOCK + pos % FC_BLOCK, k);
+            done += k;
+        }
+        e->ref = 3;
+        pthread_mutex_unlock(&fcache->lock);
+        fprintf(stderr, "file cache hit, %zu bytes\n", n);
+        return n;
+    }
+    // read once before, and not written in the last second: a write in
+    // the same clock tick would leave mtime as it is
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    bool admit = *seen >= 2 && st.st_mtim.tv_sec < now.tv_sec - 1;
+    pthread_mutex_unlock(&fcache->lock);
+    if (!admit) {
+        return FC_MISS;
+    }
+
+    // the whole file, served from this copy whether or not it gets in
+    char *data = malloc(st.st_size + 1);
+    if (pread(fd, data, st.st_size, 0) != st.st_size) {
+        free(data);
+        return FC_MISS;
+    }
+    memcpy(buf, data + (n > 0 ? offset : 0), n);
+    shared_lock(&fcache->lock);
+    if (fcache_find(&id, &home) == NULL) {
+        fcache_admit(&st, data, home);
+    }
+    pthread_mutex_unlock(&fcache->lock);
+    free(data);
+    return n;
+}
+
+u_int8_t *fcache_sketch(const file_id *id) {
+    u_int64_t h = (id->dev * 0x9e3779b97f4a7c15ULL) ^ id->ino;
+    return &fcache->sketch[((h * 0xbf58476d1ce4e5b9ULL) >> 32) % FC_SKETCH];
+}
+
+// the entry of a file or NULL, *home is a free entry it could go in, or
+// the one to replace when the probe finds none. Lock held
+fc_entry *fcache_find(const file_id *id, fc_entry **home) {
+    u_int64_t h = (id->dev * 0x9e3779b97f4a7c15ULL) ^ id->ino;
+    h = (h * 0xbf58476d1ce4e5b9ULL) >> 32;
+    *home = &fcache->e[h % FC_ENTRIES];
+    bool found_free = false;
+    int k;
+    for (k = 0; k < FC_PROBE; k++) {
+        fc_entry *e = &fcache->e[(h + k) % FC_ENTRIES];
+        if (!e->used) {
+            if (!found_free) {
+                *home = e;
+                found_free = true;
+            }
+        } else if (e->id.dev == id->dev && e->id.ino == id->ino) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+void fcache_evict(fc_entry *e) {
+    u_int32_t i;
+    for (i = 0; i < e->nblocks; i++) {
+        fcache->free_blocks[fcache->nfree++] = e->block[i];
+    }
+    e->used = false;
+}
+
+// make room by clock and copy a file in; a victim read more often lately
+// than the new file stops it, so one pass over many cold files doesn't
+// flush the hot ones. Lock held
+bool fcache_admit(const struct stat *st, const char *data, fc_entry *home) {
+    file_id id = {st->st_dev, st->st_ino};
+    u_int8_t want = *fcache_sketch(&id);
+    u_int32_t need = (st->st_size + FC_BLOCK - 1) / FC_BLOCK;
+    if (need > fcache->nblocks / 16) {
+        return false;
+    }
+    if (home->used) {
+        if (*fcache_sketch(&home->id) > want) {
+            return false;
+        }
+        fcache_evict(home);
+    }
+    u_int32_t steps;
+    for (steps = 0; fcache->nfree < need && steps < 4 * FC_ENTRIES; steps++) {
+        fc_entry *v = &fcache->e[fcache->hand];
+        fcache->hand = (fcache->hand + 1) % FC_ENTRIES;
+        if (!v->used) {
+            continue;
+        }
+        if (v->ref > 0) {
+            --v->ref;
+        } else if (*fcache_sketch(&v->id) > want) {
+            return false;
+        } else {
+            fcache_evict(v);
+        }
+    }
+    if (fcache->nfree < need) {
+        return false;
+    }
+    home->id = id;
+    home->mtime = st->st_mtim;
+    home->size = st->st_size;
+    home->ref = 1;
+    home->nblocks = need;
+    u_int32_t i;
+    for (i = 0; i < need; i++) {
+        u_int32_t b = fcache->free_blocks[--fcache->nfree];
+        size_t k = st->st_size - (size_t) i * FC_BLOCK;
+        memcpy(fc_arena + (size_t) b * FC_BLOCK, data + (size_t) i * FC_BLOCK, k < FC_BLOCK ? k : FC_BLOCK);
+        home->block[i] = b;
+    }
+    home->used = true;
+    return true;
+}
+
+void ra_reset(int fd) {
+    if (fd >= 0 && fd < ra_cap) {
+        memset(&ra[fd], 0, sizeof(ra_state));
+    }
+}
+
+// match a read against the fd's stream and fetch ahead of it
+void ra_observe(int fd, off_t off, size_t len) {
+    if (!ra_on || fd < 0 || off < 0 || len == 0) {
+        return;
+    }
+    if (fd >= ra_cap) {
+        int cap = ra_cap ? ra_cap : 64;
+        while (cap <= fd) {
+            cap *= 2;
+        }
+        ra = realloc(ra, cap * sizeof(ra_state));
+        memset(ra + ra_cap, 0, (cap - ra_cap) * sizeof(ra_state));
+        ra_cap = cap;
+    }
+    ra_state *s = &ra[fd];
+    off_t end = off + len;
+    bool seq = off == s->next;
+    bool strided = !seq && s->stride != 0 && off - s->last == s->stride;
+    if (seq || strided) {
+        ++s->streak;
+        s->misses = 0;
+    } else {
+        s->stride = off - s->last;
+        s->streak = 0;
+        s->ahead = 0;
+        ++s->misses;
+    }
+    s->last = off;
+    s->next = end;
+
+    int advice = s->advice;
+    if (s->misses >= RA_RANDOM) {
+        advice = POSIX_FADV_RANDOM;
+    } else if (s->streak >= 2) {
+        advice = seq ? POSIX_FADV_SEQUENTIAL : POSIX_FADV_NORMAL;
+    }
+    if (advice != s->advice) {
+        posix_fadvise(fd, 0, 0, advice);
+        s->advice = advice;
+    }
+    if (s->streak >= 2 && strided) {
+        // records stride apart, topped up once half of them are read;
+        // the stride may run backwards
+        off_t left = s->ahead == 0 ? 0 : (s->ahead - off) / s->stride;
+        if (left >= RA_RECORDS / 2) {
+            return;
+        }
+        off_t from = s->ahead == 0 ? off + s->stride : s->ahead;
+        int count = RA_RECORDS - left;
+        if (from < 0) {
+            return;
+        }
+        if (s->stride < 0 && from + (count - 1) * s->stride < 0) {
+            count = from / -s->stride + 1;
+        }
+        ra_queue(fd, from, len, s->stride, count);
+        s->ahead = from + count * s->stride;
+    }
+}
+
+// hand a range to the readahead thread, started with the first one; a
+// full queue drops it, readahead is only a hint
+void ra_queue(int fd, off_t off, size_t len, off_t stride, int count) {
+    pthread_mutex_lock(&ra_lock);
+    if (!ra_started) {
+        // the thread must not take SIGUSR1, callback breaks wake the
+        // session's own wait
+        sigset_t all, old;
+        sigfillset(&all);
+        pthread_sigmask(SIG_BLOCK, &all, &old);
+        pthread_t t;
+        ra_started = pthread_create(&t, NULL, ra_worker, NULL) == 0;
+        pthread_sigmask(SIG_SETMASK, &old, NULL);
+        if (ra_started) {
+            pthread_detach(t);
+        } else {
+            ra_on = false;
+        }
+    }
+    int dup_fd = ra_started && ra_count < RA_QUEUE ? fcntl(fd, F_DUPFD_CLOEXEC, 0) : -1;
+    if (dup_fd >= 0) {
+        ra_job *job = &ra_jobs[(ra_head + ra_count) % RA_QUEUE];
+        job->fd = dup_fd;
+        job->off = off;
+        job->len = len;
+        job->stride = stride;
+        job->count = count;
+        ++ra_count;
+        pthread_cond_signal(&ra_cv);
+    }
+    pthread_mutex_unlock(&ra_lock);
+}
+
+void *ra_worker(void *arg) {
+    while (1) {
+        pthread_mutex_lock(&ra_lock);
+        while (ra_count == 0) {
+            pthread_cond_wait(&ra_cv, &ra_lock);
+        }
+        ra_job job = ra_jobs[ra_head];
+        ra_head = (ra_head + 1) % RA_QUEUE;
+        --ra_count;
+        pthread_mutex_unlock(&ra_lock);
+
+        int i;
+        for (i = 0; i < job.count; i++) {
+            readahead(job.fd, job.off + i * job.stride, job.len);
+        }
+        close(job.fd);
+    }
+    return NULL;
+}